@@ -0,0 +1,41 @@
+/*
+ * bench.h - helpers shared by the allocator benchmarks.
+ */
+#ifndef __SF_BENCH_H__
+#define __SF_BENCH_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+static inline double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Integer argument i of argv, or def if it is not given. */
+static inline long arg_long(int argc, char** argv, int i, long def) {
+  return (argc > i) ? strtol(argv[i], NULL, 10) : def;
+}
+
+/* xorshift64 */
+static inline uint64_t rand_next(uint64_t* s) {
+  uint64_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *s = x;
+}
+
+/* Print one result line. run.sh collects these lines. */
+static inline void report(const char* name, int threads, double ops, double sec) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-13s threads %3d: %14.0f ops/s %8.3f sec  max rss %8ld KB\n",
+         name, threads, ops / sec, sec, ru.ru_maxrss);
+}
+
+#endif //__SF_BENCH_H__
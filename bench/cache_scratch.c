@@ -0,0 +1,55 @@
+/*
+ * cache_scratch.c - passive false sharing test of the Hoard benchmarks.
+ *
+ * The main thread allocates one small object per thread, so the objects
+ * may share cache lines.  Each thread frees its object and then repeatedly
+ * allocates an object of the same size, writes to it and frees it.  An
+ * allocator that reuses the freed object in another thread causes false
+ * sharing.  The total work is divided among the threads.
+ *
+ *   ./cache_scratch [threads] [iterations] [size] [repetitions]
+ */
+#include <pthread.h>
+
+#include "bench.h"
+
+static long g_iterations;
+static long g_size;
+static long g_repetitions;
+
+static void* worker(void* p) {
+  free(p);
+  long it, r, j;
+  for (it = 0; it < g_iterations; it++) {
+    volatile char* obj = (volatile char*)malloc(g_size);
+    for (r = 0; r < g_repetitions; r++) {
+      for (j = 0; j < g_size; j++) obj[j]++;
+    }
+    free((void*)obj);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int threads   = arg_long(argc, argv, 1, 1);
+  g_iterations  = arg_long(argc, argv, 2, 1000);
+  g_size        = arg_long(argc, argv, 3, 8);
+  g_repetitions = arg_long(argc, argv, 4, 100000) / threads;
+
+  void** objs = (void**)malloc(threads * sizeof(void*));
+  int t;
+  for (t = 0; t < threads; t++) objs[t] = malloc(g_size);
+
+  pthread_t* th = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  double start = now_sec();
+  for (t = 0; t < threads; t++) {
+    pthread_create(&th[t], NULL, worker, objs[t]);
+  }
+  for (t = 0; t < threads; t++) pthread_join(th[t], NULL);
+  double elapsed = now_sec() - start;
+
+  // Count the writes.
+  report("cache-scratch", threads,
+         (double)g_iterations * g_repetitions * g_size * threads, elapsed);
+  return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * cache_thrash.c - active false sharing test of the Hoard benchmarks.
+ *
+ * Each thread repeatedly allocates a small object, writes to it and frees
+ * it.  An allocator that gives objects in the same cache line to different
+ * threads causes false sharing.  The total work is divided among the
+ * threads.
+ *
+ *   ./cache_thrash [threads] [iterations] [size] [repetitions]
+ */
+#include <pthread.h>
+
+#include "bench.h"
+
+static long g_iterations;
+static long g_size;
+static long g_repetitions;
+
+static void* worker(void* p) {
+  long it, r, j;
+  for (it = 0; it < g_iterations; it++) {
+    volatile char* obj = (volatile char*)malloc(g_size);
+    for (r = 0; r < g_repetitions; r++) {
+      for (j = 0; j < g_size; j++) obj[j]++;
+    }
+    free((void*)obj);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int threads   = arg_long(argc, argv, 1, 1);
+  g_iterations  = arg_long(argc, argv, 2, 1000);
+  g_size        = arg_long(argc, argv, 3, 8);
+  g_repetitions = arg_long(argc, argv, 4, 100000) / threads;
+
+  pthread_t* th = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  double start = now_sec();
+  int t;
+  for (t = 0; t < threads; t++) pthread_create(&th[t], NULL, worker, NULL);
+  for (t = 0; t < threads; t++) pthread_join(th[t], NULL);
+  double elapsed = now_sec() - start;
+
+  // Count the writes.
+  report("cache-thrash", threads,
+         (double)g_iterations * g_repetitions * g_size * threads, elapsed);
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * free_random.c - cost of free() in a random order over a spread heap.
+ *
+ * Allocates live_blocks small blocks of random sizes between min_size and
+ * max_size bytes.  After every live_blocks/regions blocks, a gap block of
+ * gap_mb MB is allocated and kept, without touching it, so that the blocks
+ * are spread over many 1 GB regions of the address space.  Each round then
+ * frees all blocks in a new random order and allocates them again.  Prints
+ * the average time of a free() and of a malloc().
+ *
+ *   ./free_random [-l live_blocks] [-r rounds] [-s min_size] [-S max_size]
+ *                 [-R regions] [-g gap_mb]
+ */
+#include <unistd.h>
+
+#include "bench.h"
+
+int main(int argc, char** argv) {
+  long live = 1 << 20;
+  long rounds = 10;
+  long min_size = 16;
+  long max_size = 256;
+  long regions = 16;
+  long gap_mb = 1024;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:r:s:S:R:g:")) != -1) {
+    long v = strtol(optarg, NULL, 10);
+    switch (opt) {
+      case 'l': live = v; break;
+      case 'r': rounds = v; break;
+      case 's': min_size = v; break;
+      case 'S': max_size = v; break;
+      case 'R': regions = v; break;
+      case 'g': gap_mb = v; break;
+      default:
+        fprintf(stderr, "usage: %s [-l live_blocks] [-r rounds] "
+                "[-s min_size] [-S max_size] [-R regions] [-g gap_mb]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (live < 1) live = 1;
+  if (min_size < 1) min_size = 1;
+  if (max_size < min_size) max_size = min_size;
+  if (regions < 1) regions = 1;
+  if (gap_mb < 0) gap_mb = 0;
+
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  long range = max_size - min_size + 1;
+  void** blk = (void**)calloc(live, sizeof(void*));
+  size_t* size = (size_t*)calloc(live, sizeof(size_t));
+  long* order = (long*)calloc(live, sizeof(long));
+  void** gap = (void**)calloc(regions, sizeof(void*));
+  long i;
+  for (i = 0; i < live; i++) {
+    if (gap_mb > 0 && i % ((live + regions - 1) / regions) == 0) {
+      gap[i / ((live + regions - 1) / regions)] = malloc(gap_mb << 20);
+    }
+    size[i] = min_size + rand_next(&seed) % range;
+    blk[i] = malloc(size[i]);
+    order[i] = i;
+  }
+
+  double free_sec = 0;
+  double malloc_sec = 0;
+  long r;
+  for (r = 0; r < rounds; r++) {
+    // Shuffle the order of the frees.
+    for (i = live - 1; i > 0; i--) {
+      long k = rand_next(&seed) % (i + 1);
+      long t = order[i];
+      order[i] = order[k];
+      order[k] = t;
+    }
+
+    double start = now_sec();
+    for (i = 0; i < live; i++) free(blk[order[i]]);
+    double mid = now_sec();
+    for (i = 0; i < live; i++) blk[i] = malloc(size[i]);
+    double end = now_sec();
+
+    free_sec += mid - start;
+    malloc_sec += end - mid;
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "free_random");
+  report(name, 1, 2.0 * live * rounds, free_sec + malloc_sec);
+  printf("  %.1f ns per free  %.1f ns per malloc\n",
+         free_sec * 1e9 / (live * rounds),
+         malloc_sec * 1e9 / (live * rounds));
+
+  for (i = 0; i < live; i++) free(blk[i]);
+  for (i = 0; i < regions; i++) free(gap[i]);
+  free(blk);
+  free(size);
+  free(order);
+  free(gap);
+  return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * large_alloc.c - latency of large allocations under fragmentation.
+ *
+ * Keeps a number of live blocks of random sizes between min_pages and
+ * max_pages pages and replaces a random one at each step.  The more blocks
+ * are live, the more the free pages of the thread are split into runs of
+ * different lengths.  Prints the average time of a malloc()/free() pair
+ * and, with libsfmalloc.so, the bytes in free page blocks at the end.
+ * Keep the free superpages with SFMALLOC_OPTIONS=free_sp_mult:N to leave
+ * mmap() out of the measurement.
+ *
+ *   ./large_alloc [-l live_blocks] [-n steps] [-p min_pages] [-P max_pages]
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "bench.h"
+
+#define PAGE_SIZE   4096
+
+typedef int (*mallctl_t)(const char*, void*, size_t*, void*, size_t);
+
+int main(int argc, char** argv) {
+  long live = 256;
+  long steps = 1000000;
+  long min_pages = 9;
+  long max_pages = 32;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:p:P:")) != -1) {
+    long v = strtol(optarg, NULL, 10);
+    switch (opt) {
+      case 'l': live = v; break;
+      case 'n': steps = v; break;
+      case 'p': min_pages = v; break;
+      case 'P': max_pages = v; break;
+      default:
+        fprintf(stderr, "usage: %s [-l live_blocks] [-n steps] "
+                "[-p min_pages] [-P max_pages]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (live < 1) live = 1;
+  if (min_pages < 1) min_pages = 1;
+  if (max_pages < min_pages) max_pages = min_pages;
+
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  long range = max_pages - min_pages + 1;
+  void** blk = (void**)calloc(live, sizeof(void*));
+  long i;
+  for (i = 0; i < live; i++) {
+    size_t pages = min_pages + rand_next(&seed) % range;
+    blk[i] = malloc(pages * PAGE_SIZE);
+  }
+
+  double start = now_sec();
+  for (i = 0; i < steps; i++) {
+    long k = rand_next(&seed) % live;
+    size_t pages = min_pages + rand_next(&seed) % range;
+    free(blk[k]);
+    blk[k] = malloc(pages * PAGE_SIZE);
+  }
+  double elapsed = now_sec() - start;
+
+  char name[32];
+  snprintf(name, sizeof(name), "large %ld", live);
+  report(name, 1, steps, elapsed);
+  printf("  %.1f ns per malloc/free", elapsed * 1e9 / steps);
+
+  mallctl_t ctl = (mallctl_t)dlsym(RTLD_DEFAULT, "sf_mallctl");
+  uint64_t free_pb = 0;
+  size_t len = sizeof(free_pb);
+  if (ctl != NULL && ctl("stats.free_pb", &free_pb, &len, NULL, 0) == 0) {
+    printf("  free page blocks %lu KB", (unsigned long)(free_pb >> 10));
+  }
+  printf("\n");
+
+  for (i = 0; i < live; i++) free(blk[i]);
+  free(blk);
+  return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * larson.c - server workload of Larson and Krishnan.
+ *
+ * Each thread owns an array of blocks and repeatedly frees a random block
+ * and allocates a new one of a random size.  After a round, the thread
+ * hands its array to a new thread, so blocks are freed by threads other
+ * than the one that allocated them.  The blocks are initially allocated
+ * by the main thread.
+ *
+ *   ./larson [threads] [seconds] [min_size] [max_size] [blocks] [rounds]
+ */
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+typedef struct {
+  void**   blocks;
+  long     num_blocks;
+  long     min_size;
+  long     max_size;
+  long     rounds;        // replacements per thread generation
+  uint64_t seed;
+  uint64_t ops;
+} larson_arg_t;
+
+static volatile int g_stop = 0;
+static volatile int g_running = 0;
+
+static void* worker(void* p) {
+  larson_arg_t* a = (larson_arg_t*)p;
+  long range = a->max_size - a->min_size + 1;
+  long r;
+  for (r = 0; r < a->rounds; r++) {
+    long i = rand_next(&a->seed) % a->num_blocks;
+    free(a->blocks[i]);
+    size_t size = a->min_size + rand_next(&a->seed) % range;
+    a->blocks[i] = malloc(size);
+    *(char*)a->blocks[i] = 1;
+  }
+  a->ops += 2 * a->rounds;
+
+  // Pass the blocks to a new thread.
+  if (!g_stop) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker, a) == 0) {
+      pthread_detach(t);
+      return NULL;
+    }
+  }
+  __sync_fetch_and_sub(&g_running, 1);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int  threads  = arg_long(argc, argv, 1, 1);
+  long seconds  = arg_long(argc, argv, 2, 2);
+  long min_size = arg_long(argc, argv, 3, 8);
+  long max_size = arg_long(argc, argv, 4, 1000);
+  long blocks   = arg_long(argc, argv, 5, 1000);
+  long rounds   = arg_long(argc, argv, 6, 10000);
+
+  larson_arg_t* args = (larson_arg_t*)calloc(threads, sizeof(larson_arg_t));
+  int t;
+  for (t = 0; t < threads; t++) {
+    larson_arg_t* a = &args[t];
+    a->blocks = (void**)malloc(blocks * sizeof(void*));
+    a->num_blocks = blocks;
+    a->min_size = min_size;
+    a->max_size = max_size;
+    a->rounds = rounds;
+    a->seed = 88172645463325252ULL + t;
+    long i;
+    for (i = 0; i < blocks; i++) {
+      a->blocks[i] = malloc(min_size + rand_next(&a->seed) %
+                                       (max_size - min_size + 1));
+    }
+  }
+
+  double start = now_sec();
+  g_running = threads;
+  for (t = 0; t < threads; t++) {
+    pthread_t th;
+    pthread_create(&th, NULL, worker, &args[t]);
+    pthread_detach(th);
+  }
+  sleep(seconds);
+  g_stop = 1;
+  while (g_running > 0) usleep(1000);
+  double elapsed = now_sec() - start;
+
+  uint64_t ops = 0;
+  for (t = 0; t < threads; t++) ops += args[t].ops;
+  report("larson", threads, ops, elapsed);
+  return 0;
+}
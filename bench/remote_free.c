@@ -0,0 +1,185 @@
+/*
+ * remote_free.c - cross-thread free stress test.
+ *
+ * Producers allocate blocks and pass them in batches to consumers, which
+ * free them, so every free is a remote free.  Producer k sends its batches
+ * to the consumers in turn.  With -r, the producers exit and are replaced
+ * by new ones r times, so consumers also free into the superpages of dead
+ * threads and adopt them.
+ *
+ *   ./remote_free [-p producers] [-c consumers] [-n blocks] [-b batch]
+ *                 [-s min_size] [-S max_size] [-r rounds]
+ *
+ * Sizes are log-uniform in [min_size, max_size].  With libsfmalloc.so, the
+ * remote free, CAS retry and adoption counters are printed as well.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "bench.h"
+
+#define RING_LEN    4096    // power of 2
+
+/* Single-producer single-consumer ring of blocks */
+typedef struct {
+  void*             slot[RING_LEN];
+  volatile uint64_t head;   // next slot to pop
+  char              pad1[56];
+  volatile uint64_t tail;   // next slot to push
+  char              pad2[56];
+} ring_t;
+
+static ring_t*          g_rings;        // g_rings[p * g_cons + c]
+static int              g_prod = 1;
+static int              g_cons = 1;
+static long             g_blocks = 4000000;
+static long             g_batch = 64;
+static long             g_min_size = 8;
+static long             g_max_size = 32768;
+static long             g_rounds = 1;
+static volatile int     g_producing;
+static double           g_log_ratio;
+
+typedef int (*mallctl_t)(const char*, void*, size_t*, void*, size_t);
+
+static size_t next_size(uint64_t* seed) {
+  // log-uniform between g_min_size and g_max_size
+  double u = (rand_next(seed) >> 11) * (1.0 / 9007199254740992.0);
+  return (size_t)(g_min_size * __builtin_exp(u * g_log_ratio));
+}
+
+static void* producer(void* p) {
+  long id = (long)p;
+  long n = g_blocks / g_prod / g_rounds;
+  uint64_t seed = 0x2545F4914F6CDD1DULL + id * 7919 + (uint64_t)pthread_self();
+  int c = id % g_cons;
+  long i, k;
+
+  for (i = 0; i < n; i += g_batch) {
+    ring_t* r = &g_rings[(id % g_prod) * g_cons + c];
+    long len = (n - i < g_batch) ? n - i : g_batch;
+    while (r->tail + len - r->head > RING_LEN) sched_yield();
+
+    uint64_t tail = r->tail;
+    for (k = 0; k < len; k++) {
+      void* blk = malloc(next_size(&seed));
+      *(volatile char*)blk = 1;
+      r->slot[(tail + k) & (RING_LEN - 1)] = blk;
+    }
+    __sync_synchronize();
+    r->tail = tail + len;
+
+    c = (c + 1) % g_cons;
+  }
+  return NULL;
+}
+
+static void* consumer(void* p) {
+  long id = (long)p;
+  int done;
+
+  do {
+    done = !g_producing;
+    __sync_synchronize();
+    int empty = 1;
+    int k;
+    for (k = 0; k < g_prod; k++) {
+      ring_t* r = &g_rings[k * g_cons + id];
+      uint64_t head = r->head;
+      uint64_t tail = r->tail;
+      __sync_synchronize();
+      if (head == tail) continue;
+      for (; head != tail; head++) {
+        free(r->slot[head & (RING_LEN - 1)]);
+      }
+      __sync_synchronize();
+      r->head = head;
+      empty = 0;
+    }
+    if (empty) sched_yield();
+  } while (!done);
+  return NULL;
+}
+
+static uint64_t get_stat(mallctl_t ctl, const char* name) {
+  uint64_t v = 0;
+  size_t len = sizeof(v);
+  if (ctl == NULL || ctl(name, &v, &len, NULL, 0) != 0) return 0;
+  return v;
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:c:n:b:s:S:r:")) != -1) {
+    long v = strtol(optarg, NULL, 10);
+    switch (opt) {
+      case 'p': g_prod = v; break;
+      case 'c': g_cons = v; break;
+      case 'n': g_blocks = v; break;
+      case 'b': g_batch = v; break;
+      case 's': g_min_size = v; break;
+      case 'S': g_max_size = v; break;
+      case 'r': g_rounds = v; break;
+      default:
+        fprintf(stderr, "usage: %s [-p producers] [-c consumers] "
+                "[-n blocks] [-b batch] [-s min_size] [-S max_size] "
+                "[-r rounds]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (g_prod < 1) g_prod = 1;
+  if (g_cons < 1) g_cons = 1;
+  if (g_rounds < 1) g_rounds = 1;
+  if (g_batch < 1) g_batch = 1;
+  if (g_batch > RING_LEN) g_batch = RING_LEN;
+  if (g_min_size < 1) g_min_size = 1;
+  if (g_max_size < g_min_size) g_max_size = g_min_size;
+  g_log_ratio = __builtin_log((double)g_max_size / g_min_size);
+
+  mallctl_t ctl = (mallctl_t)dlsym(RTLD_DEFAULT, "sf_mallctl");
+  uint64_t remote0 = get_stat(ctl, "stats.remote_free");
+  uint64_t retry0  = get_stat(ctl, "stats.remote_retry");
+  uint64_t adopt0  = get_stat(ctl, "stats.sp_adopt");
+
+  g_rings = (ring_t*)calloc((size_t)g_prod * g_cons, sizeof(ring_t));
+  pthread_t* pth = (pthread_t*)malloc(g_prod * sizeof(pthread_t));
+  pthread_t* cth = (pthread_t*)malloc(g_cons * sizeof(pthread_t));
+  long t, round;
+
+  double start = now_sec();
+  g_producing = 1;
+  for (t = 0; t < g_cons; t++) {
+    pthread_create(&cth[t], NULL, consumer, (void*)t);
+  }
+  for (round = 0; round < g_rounds; round++) {
+    for (t = 0; t < g_prod; t++) {
+      pthread_create(&pth[t], NULL, producer, (void*)(round * g_prod + t));
+    }
+    for (t = 0; t < g_prod; t++) pthread_join(pth[t], NULL);
+  }
+  __sync_synchronize();
+  g_producing = 0;
+  for (t = 0; t < g_cons; t++) pthread_join(cth[t], NULL);
+  double elapsed = now_sec() - start;
+
+  long total = g_blocks / g_prod / g_rounds * g_prod * g_rounds;
+  char name[32];
+  snprintf(name, sizeof(name), "remote %d:%d", g_prod, g_cons);
+  report(name, g_prod + g_cons, 2.0 * total, elapsed);
+
+  if (ctl != NULL) {
+    uint64_t remote = get_stat(ctl, "stats.remote_free") - remote0;
+    uint64_t retry  = get_stat(ctl, "stats.remote_retry") - retry0;
+    uint64_t adopt  = get_stat(ctl, "stats.sp_adopt") - adopt0;
+    printf("  remote free %lu  CAS retry %lu (%.3f per free)  "
+           "adopt %lu (%.1f/s)\n",
+           (unsigned long)remote, (unsigned long)retry,
+           remote ? (double)retry / remote : 0.0,
+           (unsigned long)adopt, adopt / elapsed);
+  }
+  return 0;
+}
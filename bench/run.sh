@@ -0,0 +1,28 @@
+#!/bin/sh
+# Run the workloads with 1, 2, 4, ... up to MAX_THREADS threads against
+# the system allocator and libsfmalloc.so.
+#
+#   ./run.sh [max_threads] [workload...]
+MAX_THREADS=${1:-$(nproc)}
+[ $# -gt 0 ] && shift
+WORKLOADS=${*:-"larson threadtest shbench xmalloc cache_scratch cache_thrash"}
+LIB=$(cd "$(dirname "$0")/.." && pwd)/libsfmalloc.so
+cd "$(dirname "$0")"
+
+thread_counts() {
+  t=1
+  while [ $t -lt $MAX_THREADS ]; do
+    echo $t
+    t=$((t * 2))
+  done
+  echo $MAX_THREADS
+}
+
+for w in $WORKLOADS; do
+  for t in $(thread_counts); do
+    printf "%-9s " system
+    ./$w $t
+    printf "%-9s " sfmalloc
+    LD_PRELOAD=$LIB ./$w $t
+  done
+done
@@ -0,0 +1,235 @@
+/*
+ * sf_replay.c - replay an allocation trace.
+ *
+ * Re-executes a trace recorded by sfmalloc built with MALLOC_USE_TRACE and
+ * run with SFMALLOC_OPTIONS=trace:1.  Each traced thread is replayed by its
+ * own thread, in the order of its calls.  A call on a block allocated by
+ * another thread waits until that allocation has been replayed.  With -s,
+ * all calls are replayed one at a time in the traced order instead.
+ *
+ *   gcc -O2 -pthread -o sf_replay sf_replay.c
+ *   LD_PRELOAD=../libsfmalloc.so ./sf_replay [-s] sfmalloc.<pid>.trace
+ *   ./sf_replay [-s] sfmalloc.<pid>.trace          (glibc, for comparison)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../sf_malloc.h"
+
+typedef struct {
+  sf_trace_rec_t r;
+  uint64_t       idx;     // position in the file, to keep the thread order
+  int64_t        dep;     // record that allocated the block we use, or -1
+} rec_t;
+
+typedef struct {
+  pthread_t tid;
+  uint32_t  id;           // traced thread id
+  uint64_t* recs;         // indexes of its records in g_recs
+  uint64_t  num;
+  uint64_t  cap;
+} thr_t;
+
+static rec_t*             g_recs;
+static uint64_t           g_num;
+static void**             g_ptrs;   // replayed block of each record
+static volatile uint8_t*  g_done;   // 1 if the record has been replayed
+static volatile uint64_t  g_next;   // next record in strict mode
+static int                g_strict = 0;
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_rec(const void* a, const void* b) {
+  const rec_t* x = (const rec_t*)a;
+  const rec_t* y = (const rec_t*)b;
+  if (x->r.time != y->r.time) return (x->r.time < y->r.time) ? -1 : 1;
+  return (x->idx < y->idx) ? -1 : (x->idx > y->idx);
+}
+
+static int produces(uint32_t op) {
+  return op == SF_TRACE_MALLOC || op == SF_TRACE_REALLOC ||
+         op == SF_TRACE_MEMALIGN;
+}
+
+static int consumes(uint32_t op) {
+  return op == SF_TRACE_FREE || op == SF_TRACE_REALLOC;
+}
+
+/* Link each free and realloc to the record that allocated its block.
+   Block addresses are reused, so the map holds the live blocks only. */
+static void link_records() {
+  uint64_t size = 1024;
+  while (size < g_num * 2) size <<= 1;
+  uint64_t* keys = (uint64_t*)calloc(size, sizeof(uint64_t));
+  int64_t*  vals = (int64_t*)malloc(size * sizeof(int64_t));
+  const uint64_t tomb = 1;
+
+  uint64_t i;
+  for (i = 0; i < g_num; i++) {
+    sf_trace_rec_t* r = &g_recs[i].r;
+    g_recs[i].dep = -1;
+
+    if (consumes(r->op) && r->arg != 0) {
+      uint64_t h = (r->arg * 0x9E3779B97F4A7C15ULL) & (size - 1);
+      while (keys[h] != 0) {
+        if (keys[h] == r->arg) {
+          g_recs[i].dep = vals[h];
+          keys[h] = tomb;
+          break;
+        }
+        h = (h + 1) & (size - 1);
+      }
+    }
+
+    if (produces(r->op) && r->ptr != 0) {
+      // If the address is still live, its free was not traced.
+      uint64_t h = (r->ptr * 0x9E3779B97F4A7C15ULL) & (size - 1);
+      int64_t slot = -1;
+      while (keys[h] != 0) {
+        if (keys[h] == r->ptr) { slot = h; break; }
+        if (keys[h] == tomb && slot < 0) slot = h;
+        h = (h + 1) & (size - 1);
+      }
+      if (slot < 0) slot = h;
+      keys[slot] = r->ptr;
+      vals[slot] = i;
+    }
+  }
+
+  free(keys);
+  free(vals);
+}
+
+static void replay_one(uint64_t i) {
+  sf_trace_rec_t* r = &g_recs[i].r;
+  int64_t dep = g_recs[i].dep;
+  void* old = NULL;
+
+  if (dep >= 0) {
+    while (!g_done[dep]) sched_yield();
+    old = g_ptrs[dep];
+  }
+
+  switch (r->op) {
+    case SF_TRACE_MALLOC:
+      g_ptrs[i] = malloc(r->size);
+      break;
+    case SF_TRACE_FREE:
+      if (dep >= 0) free(old);
+      break;
+    case SF_TRACE_REALLOC:
+      g_ptrs[i] = realloc(old, r->size);
+      break;
+    case SF_TRACE_MEMALIGN:
+      if (r->ptr == 0 || posix_memalign(&g_ptrs[i], r->arg, r->size) != 0) {
+        g_ptrs[i] = NULL;
+      }
+      break;
+  }
+  __sync_synchronize();
+  g_done[i] = 1;
+}
+
+static void* replay_thread(void* arg) {
+  thr_t* t = (thr_t*)arg;
+  uint64_t k;
+  for (k = 0; k < t->num; k++) {
+    uint64_t i = t->recs[k];
+    if (g_strict) {
+      while (g_next != i) sched_yield();
+    }
+    replay_one(i);
+    if (g_strict) g_next = i + 1;
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int a = 1;
+  if (a < argc && strcmp(argv[a], "-s") == 0) {
+    g_strict = 1;
+    a++;
+  }
+  if (a >= argc) {
+    fprintf(stderr, "usage: %s [-s] trace_file\n", argv[0]);
+    return 1;
+  }
+
+  FILE* fp = fopen(argv[a], "rb");
+  if (fp == NULL) {
+    perror(argv[a]);
+    return 1;
+  }
+  uint64_t magic = 0;
+  if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != SF_TRACE_MAGIC) {
+    fprintf(stderr, "%s: not an sfmalloc trace\n", argv[a]);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  g_num = (ftell(fp) - sizeof(magic)) / sizeof(sf_trace_rec_t);
+  fseek(fp, sizeof(magic), SEEK_SET);
+
+  g_recs = (rec_t*)malloc(g_num * sizeof(rec_t) + 1);
+  uint64_t i;
+  for (i = 0; i < g_num; i++) {
+    if (fread(&g_recs[i].r, sizeof(sf_trace_rec_t), 1, fp) != 1) break;
+    g_recs[i].idx = i;
+  }
+  g_num = i;
+  fclose(fp);
+
+  qsort(g_recs, g_num, sizeof(rec_t), cmp_rec);
+  link_records();
+
+  // Split the records by thread.
+  thr_t* thrs = NULL;
+  uint32_t nthr = 0;
+  for (i = 0; i < g_num; i++) {
+    uint32_t t;
+    for (t = 0; t < nthr; t++) {
+      if (thrs[t].id == g_recs[i].r.thread) break;
+    }
+    if (t == nthr) {
+      thrs = (thr_t*)realloc(thrs, (nthr + 1) * sizeof(thr_t));
+      memset(&thrs[t], 0, sizeof(thr_t));
+      thrs[t].id = g_recs[i].r.thread;
+      nthr++;
+    }
+    if (thrs[t].num == thrs[t].cap) {
+      thrs[t].cap = thrs[t].cap ? thrs[t].cap * 2 : 1024;
+      thrs[t].recs = (uint64_t*)realloc(thrs[t].recs,
+                                        thrs[t].cap * sizeof(uint64_t));
+    }
+    thrs[t].recs[thrs[t].num++] = i;
+  }
+
+  g_ptrs = (void**)calloc(g_num + 1, sizeof(void*));
+  g_done = (volatile uint8_t*)calloc(g_num + 1, 1);
+
+  double start = now_sec();
+  uint32_t t;
+  for (t = 0; t < nthr; t++) {
+    pthread_create(&thrs[t].tid, NULL, replay_thread, &thrs[t]);
+  }
+  for (t = 0; t < nthr; t++) {
+    pthread_join(thrs[t].tid, NULL);
+  }
+  double elapsed = now_sec() - start;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("records %lu threads %u%s: %.3f sec, %.1f ns/op, max rss %ld KB\n",
+         (unsigned long)g_num, nthr, g_strict ? " (strict)" : "",
+         elapsed, elapsed * 1e9 / (g_num ? g_num : 1), ru.ru_maxrss);
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * shbench.c - mixed-size workload in the style of MicroQuill SmartHeap's
+ * shbench.
+ *
+ * Each thread keeps a window of blocks whose sizes are mostly small with a
+ * tail of larger ones.  It replaces blocks of the window in runs, and
+ * frees some runs in allocation order and others in reverse order.
+ *
+ *   ./shbench [threads] [iterations] [window] [max_size]
+ */
+#include <pthread.h>
+
+#include "bench.h"
+
+static long g_iterations;
+static long g_window;
+static long g_max_size;
+
+/* 7/8 of the sizes are up to 64 bytes, the rest up to g_max_size. */
+static inline size_t mixed_size(uint64_t* seed) {
+  uint64_t r = rand_next(seed);
+  if ((r & 7) != 0) return 1 + (r >> 8) % 64;
+  return 1 + (r >> 8) % g_max_size;
+}
+
+static void* worker(void* p) {
+  uint64_t seed = 0x9E3779B97F4A7C15ULL ^ (uintptr_t)p;
+  void** win = (void**)calloc(g_window, sizeof(void*));
+  long it, i;
+  for (it = 0; it < g_iterations; it++) {
+    long run = 1 + rand_next(&seed) % (g_window / 4);
+    long first = rand_next(&seed) % (g_window - run + 1);
+    if (it & 1) {
+      for (i = first; i < first + run; i++) free(win[i]);
+    } else {
+      for (i = first + run - 1; i >= first; i--) free(win[i]);
+    }
+    for (i = first; i < first + run; i++) {
+      win[i] = malloc(mixed_size(&seed));
+      *(volatile char*)win[i] = 1;
+    }
+  }
+  for (i = 0; i < g_window; i++) free(win[i]);
+  free(win);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int threads  = arg_long(argc, argv, 1, 1);
+  g_iterations = arg_long(argc, argv, 2, 100000);
+  g_window     = arg_long(argc, argv, 3, 1000);
+  g_max_size   = arg_long(argc, argv, 4, 1000);
+
+  pthread_t* th = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  double start = now_sec();
+  int t;
+  for (t = 0; t < threads; t++) {
+    pthread_create(&th[t], NULL, worker, (void*)(uintptr_t)(t + 1));
+  }
+  for (t = 0; t < threads; t++) pthread_join(th[t], NULL);
+  double elapsed = now_sec() - start;
+
+  // A run replaces g_window / 8 blocks on average.
+  report("shbench", threads,
+         2.0 * g_iterations * (g_window / 8) * threads, elapsed);
+  return 0;
+}
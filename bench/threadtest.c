@@ -0,0 +1,50 @@
+/*
+ * threadtest.c - threadtest of the Hoard benchmarks.
+ *
+ * Each thread repeatedly allocates a batch of objects and frees them all.
+ * The total work is divided among the threads.
+ *
+ *   ./threadtest [threads] [iterations] [objects] [size]
+ */
+#include <pthread.h>
+
+#include "bench.h"
+
+static long g_iterations;
+static long g_objects;      // objects per thread
+static long g_size;
+
+static void* worker(void* p) {
+  void** objs = (void**)malloc(g_objects * sizeof(void*));
+  long it, i;
+  for (it = 0; it < g_iterations; it++) {
+    for (i = 0; i < g_objects; i++) {
+      objs[i] = malloc(g_size);
+      *(volatile char*)objs[i] = 1;
+    }
+    for (i = 0; i < g_objects; i++) {
+      free(objs[i]);
+    }
+  }
+  free(objs);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int threads  = arg_long(argc, argv, 1, 1);
+  g_iterations = arg_long(argc, argv, 2, 100);
+  long objects = arg_long(argc, argv, 3, 100000);
+  g_size       = arg_long(argc, argv, 4, 8);
+  g_objects    = objects / threads;
+
+  pthread_t* th = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  double start = now_sec();
+  int t;
+  for (t = 0; t < threads; t++) pthread_create(&th[t], NULL, worker, NULL);
+  for (t = 0; t < threads; t++) pthread_join(th[t], NULL);
+  double elapsed = now_sec() - start;
+
+  report("threadtest", threads,
+         2.0 * g_iterations * g_objects * threads, elapsed);
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * xmalloc.c - producer/consumer workload in the style of xmalloc-test.
+ *
+ * The threads form a ring.  Each thread allocates batches of blocks and
+ * passes them to the next thread, which frees them.  So every free is a
+ * remote free.  Each thread waits for room in the queue of the next thread
+ * by freeing the blocks in its own queue.
+ *
+ *   ./xmalloc [threads] [batches] [batch] [max_size]
+ */
+#include <pthread.h>
+#include <sched.h>
+
+#include "bench.h"
+
+#define QUEUE_LEN   4096    // power of 2
+
+typedef struct {
+  void*             slot[QUEUE_LEN];
+  volatile uint64_t head;   // next slot to pop
+  volatile uint64_t tail;   // next slot to push
+  uint64_t          freed;
+  char              pad[64];
+} queue_t;
+
+static queue_t* g_queues;
+static int      g_threads;
+static long     g_batches;
+static long     g_batch;
+static long     g_max_size;
+
+static void drain(queue_t* q) {
+  uint64_t head = q->head;
+  uint64_t tail = q->tail;
+  __sync_synchronize();
+  for (; head != tail; head++) {
+    free(q->slot[head & (QUEUE_LEN - 1)]);
+    q->freed++;
+  }
+  q->head = head;
+}
+
+static void* worker(void* p) {
+  long id = (long)p;
+  queue_t* mine = &g_queues[id];
+  queue_t* next = &g_queues[(id + 1) % g_threads];
+  uint64_t seed = 0x2545F4914F6CDD1DULL + id;
+  long b, i;
+
+  for (b = 0; b < g_batches; b++) {
+    for (i = 0; i < g_batch; i++) {
+      void* blk = malloc(8 + rand_next(&seed) % g_max_size);
+      *(volatile char*)blk = 1;
+      while (next->tail - next->head >= QUEUE_LEN) {
+        drain(mine);
+        sched_yield();
+      }
+      next->slot[next->tail & (QUEUE_LEN - 1)] = blk;
+      __sync_synchronize();
+      next->tail++;
+    }
+    drain(mine);
+  }
+
+  // The previous thread sends as many blocks as we do.
+  while (mine->freed < (uint64_t)(g_batches * g_batch)) {
+    drain(mine);
+    sched_yield();
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  g_threads  = arg_long(argc, argv, 1, 1);
+  g_batches  = arg_long(argc, argv, 2, 2000);
+  g_batch    = arg_long(argc, argv, 3, 1000);
+  g_max_size = arg_long(argc, argv, 4, 120);
+
+  g_queues = (queue_t*)calloc(g_threads, sizeof(queue_t));
+  pthread_t* th = (pthread_t*)malloc(g_threads * sizeof(pthread_t));
+  double start = now_sec();
+  long t;
+  for (t = 0; t < g_threads; t++) {
+    pthread_create(&th[t], NULL, worker, (void*)t);
+  }
+  for (t = 0; t < g_threads; t++) pthread_join(th[t], NULL);
+  double elapsed = now_sec() - start;
+
+  report("xmalloc", g_threads, 2.0 * g_batches * g_batch * g_threads,
+         elapsed);
+  return 0;
+}
@@ -48,15 +48,23 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <sched.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <execinfo.h>
 
+#include "sf_malloc.h"
 #include "sf_malloc_ctrl.h"
 #include "sf_malloc_def.h"
 #include "sf_malloc_stat.h"
 #include "sf_malloc_atomic.h"
+#ifdef MALLOC_USE_PERCPU
+#include "sf_malloc_rseq.h"
+#endif
 
 #include <assert.h>
 
@@ -76,14 +84,139 @@ static pthread_key_t     g_thread_key;
 static sizemap_t         g_sizemap;
 static pagemap_t         g_pagemap;
 
+// Tunables (see sf_mallctl())
+static volatile uint32_t g_free_sp_mult     = FREE_SP_LIST_MULT;
+static volatile uint32_t g_pb_cache_depth   = PB_CACHE_DEPTH;
+static volatile uint32_t g_return_list_pbhs = RETURN_LIST_PBHS;
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+static volatile uint32_t g_tlh_list_bytes   = TLH_LIST_BYTES;
+#endif
+#ifdef MALLOC_USE_TRANSFER_CACHE
+static transfer_cache_t  g_tc[NUM_CLASSES];
+static uint8_t           g_tc_slots[NUM_CLASSES]; // 0: class not cached
+#endif
+static volatile uint32_t g_stats_print      = 0;  // malloc_stats() at exit
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+static volatile uint32_t g_use_thp          = 1;
+#endif
+#ifdef MALLOC_USE_HUGETLB
+static volatile uint32_t g_use_hugetlb      = 1;
+#endif
+#ifdef MALLOC_USE_HEAP_PROF
+static volatile uint32_t g_prof_sample      = 0;  // mean bytes per sample
+static volatile uint32_t g_prof_signal      = 0;  // signal to dump profile
+#endif
+#ifdef MALLOC_USE_TRACE
+static volatile uint32_t g_trace            = 0;  // record allocation calls
+#endif
+
 // Hazard Pointer List
 static hazard_ptr_t*     g_hazard_ptr_list = NULL;
 static volatile uint32_t g_hazard_ptr_free_num = 0;
 
-// Free Superpage List
-static sph_t*            g_free_sp_list = NULL;
-static volatile uint32_t g_free_sp_len = 0;
-#define FREE_SP_LIST_THRESHOLD    (g_thread_num * 2)
+#ifdef MALLOC_USE_REMOTE_INBOX
+// Remote Free Inboxes
+static inbox_t*          g_inbox_list = NULL;
+#endif
+
+#ifdef MALLOC_USE_PERCPU
+// Per-CPU Caches
+static pcpu_cache_t*     g_pcpu[PCPU_MAX_CPUS];
+static uint32_t          g_pcpu_cap[NUM_CLASSES];   // blocks per stack
+static volatile uint32_t g_percpu = 1;    // 0: use the TLHs only
+#endif
+
+#ifdef MALLOC_USE_SHARED_HEAPS
+// Shared Heaps
+static shared_heap_t*    g_heaps = NULL;
+static uint32_t          g_heap_num = 0;      // opt.heaps at startup
+static volatile uint32_t g_num_heaps = 0;     // 0: one TLH per thread
+static volatile uint32_t g_heap_next = 0;     // for round-robin binding
+static uint8_t           g_front_cap[NUM_CLASSES];  // blocks per list
+#endif
+
+// Free Superpage Lists (one per NUMA node)
+static sph_t*            g_free_sp_list[MAX_NUMA_NODES];
+static volatile uint32_t g_free_sp_len = 0;    // total length of the lists
+static volatile uint32_t g_sp_purge_lock = 0;  // held by the one purger
+#define FREE_SP_LIST_THRESHOLD    (g_thread_num * g_free_sp_mult)
+
+#ifdef MALLOC_USE_ARENA
+// Superpage Arena
+static uintptr_t         g_arena_base = 0;
+static size_t            g_arena_start_page = 0;  // page id of g_arena_base
+static size_t            g_arena_pages = 0;       // 0: no arena
+static uint16_t*         g_arena_map = NULL;      // pbh index of each page
+static volatile uint32_t g_arena_next = 0;        // superpages carved so far
+static uint32_t*         g_arena_free = NULL;     // released superpages
+static uint32_t          g_arena_free_num = 0;
+static volatile uint32_t g_arena_lock = 0;
+static volatile uint32_t g_arena = 1;             // opt.arena at startup
+#endif
+
+// Incremented to ask all threads to release their free memory
+static volatile uint32_t g_release_epoch = 0;
+
+// Heap of the threads that call malloc() or free() after they have exited
+static tlh_t             g_exit_tlh;
+static volatile uint32_t g_exit_lock = 0;
+static uint32_t          g_exit_idle = 0;   // background ticks until release
+
+#ifdef MALLOC_USE_IDLE_FLUSH
+// Idle Thread Flushing
+static idle_slot_t*      g_idle_list = NULL;
+static volatile uint32_t g_idle_flush_ms = IDLE_FLUSH_MS;         // 0: off
+static volatile uint32_t g_idle_flush_events = IDLE_FLUSH_EVENTS; // 0: off
+static volatile uint32_t g_idle_events = 0;     // slow paths so far
+static volatile uint32_t g_idle_next_scan = 0;
+static volatile uint32_t g_idle_scan_lock = 0;
+static volatile uint32_t g_idle_ok = 0;         // membarrier() works
+#endif
+
+#ifdef MALLOC_USE_DECAY_PURGE
+// Purging
+static uint32_t          g_purge = 1;        // 0: never purge by decay
+static uint32_t          g_purge_decay = PURGE_DECAY_MS;
+static uint32_t          g_purge_interval = PURGE_INTERVAL_MS;
+#ifdef MALLOC_USE_MADV_FREE
+static int               g_purge_advice = MADV_FREE;
+#else
+static int               g_purge_advice = MADV_DONTNEED;
+#endif
+#endif
+
+#ifdef MALLOC_USE_HEAP_STATS
+// Heap Statistics
+static heap_stat_t*      g_heap_stat_list = NULL;
+static heap_stat_t       g_heap_stat_anon;    // for threads without a TLH
+static volatile int64_t  g_size_mapped = 0;
+#endif
+
+#ifdef MALLOC_USE_HEAP_PROF
+// Heap Profile
+static prof_sample_t*    g_prof_table = NULL;
+static volatile uint64_t g_prof_alloc_cnt = 0;   // samples taken
+static volatile uint64_t g_prof_alloc_size = 0;
+static volatile uint32_t g_prof_dump_seq = 0;
+static volatile uint32_t g_prof_dump_req = 0;   // set by opt.prof_signal
+#endif
+
+#ifdef MALLOC_USE_TRACE
+// Allocation Trace
+static int               g_trace_fd = -1;
+static trace_buf_t*      g_trace_buf_list = NULL;
+#endif
+
+#ifdef MALLOC_USE_BG_THREAD
+// Background Thread
+static pthread_t         g_bg_thread;
+static volatile uint32_t g_bg_thread_stop = 0;
+static uint32_t          g_bg_interval = BG_THREAD_INTERVAL_MS;
+static sph_t*            g_orphan_sp_list = NULL;
+#ifdef MALLOC_STATS
+static thread_stat_t     g_bg_stat;    // snapshot of the background thread
+#endif
+#endif
 
 
 ////////////////////////////////////////////////////////////////////////////
@@ -91,11 +224,38 @@ static volatile uint32_t g_free_sp_len = 0;
 ////////////////////////////////////////////////////////////////////////////
 #ifdef MALLOC_USE_PAGEMAP_CACHE
 // Page Map Cache
-static __thread size_t          l_pagemap_tag  TLS_MODEL = 0xFFFFFFFFFFFFFFFF;
-static __thread pagemap_leaf_t* l_pagemap_leaf TLS_MODEL = NULL;
+static __thread pagemap_cache_t l_pagemap_cache TLS_MODEL;
 #endif
 // Thread Local Heap (TLH)
+#ifdef MALLOC_USE_HEAP_STATS
+static __thread tlh_t l_tlh TLS_MODEL = { .stat = &g_heap_stat_anon };
+#else
 static __thread tlh_t l_tlh TLS_MODEL;
+#endif
+// Set when the TLH has been cleared at thread exit
+static __thread uint32_t l_tlh_exited TLS_MODEL = 0;
+// &g_exit_tlh while the exited thread holds g_exit_lock
+static __thread tlh_t*   l_exit_heap  TLS_MODEL = NULL;
+#ifdef MALLOC_USE_SHARED_HEAPS
+// Shared heap the thread is bound to, or NULL to use l_tlh
+static __thread shared_heap_t* l_heap  TLS_MODEL = NULL;
+static __thread front_cache_t  l_front TLS_MODEL;
+#endif
+#ifdef MALLOC_USE_IDLE_FLUSH
+// Slot that lets other threads flush the TLH, NULL for a shared heap
+static __thread idle_slot_t* l_idle       TLS_MODEL = NULL;
+static __thread uint32_t     l_idle_ticks TLS_MODEL = 0;
+static __thread uint32_t     l_idle_scan  TLS_MODEL = 0;  // scan is due
+#endif
+#ifdef MALLOC_USE_HEAP_PROF
+// Set while taking a sample, because backtrace() may call malloc().
+static __thread uint32_t l_prof_busy TLS_MODEL = 0;
+#endif
+#ifdef MALLOC_USE_TRACE
+static __thread trace_buf_t* l_trace_buf TLS_MODEL = NULL;
+// Depth of nested library calls. Only the outermost call is recorded.
+static __thread uint32_t     l_trace_nest TLS_MODEL = 0;
+#endif
 
 
 ////////////////////////////////////////////////////////////////////////////
@@ -103,6 +263,7 @@ static __thread tlh_t l_tlh TLS_MODEL;
 ////////////////////////////////////////////////////////////////////////////
 /* Initialization */
 void sf_malloc_init();
+static void options_init();
 void sf_malloc_thread_init();
 void sf_malloc_exit();
 void sf_malloc_thread_exit();
@@ -110,9 +271,63 @@ void sf_malloc_destructor(void* val);
 
 /* mmap/munmap */
 static inline void* do_mmap(size_t size);
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+static void*        do_mmap_aligned(size_t size, size_t align);
+#endif
+#ifdef MALLOC_USE_HUGETLB
+static void*        do_mmap_hugetlb(size_t size, int shift);
+#endif
 static inline void  do_munmap(void* addr, size_t size);
 static inline void  do_madvise(void* addr, size_t size);
 
+#ifdef MALLOC_USE_NUMA
+/* NUMA */
+static uint32_t     numa_get_node();
+static inline void  numa_bind(void* addr, size_t size, uint32_t node);
+#endif
+
+/* Purging */
+static inline uint32_t get_msec();
+static size_t tlh_purge(tlh_t* tlh, uint32_t now, uint32_t decay);
+static size_t sp_list_purge(uint32_t now, uint32_t decay);
+static size_t sp_list_trim(uint32_t keep_len);
+static size_t release_free_memory(uint32_t keep_len);
+#ifdef MALLOC_USE_DECAY_PURGE
+static inline void purge_tick(tlh_t* tlh);
+#define FREE_TIME_NOW()   get_msec()
+#else
+#define purge_tick(tlh)
+/* Without decay, free_time only tells whether pages were purged. */
+#define FREE_TIME_NOW()   1
+#endif
+
+/* Idle Thread Flushing */
+#ifdef MALLOC_USE_IDLE_FLUSH
+static void          idle_init();
+static void          idle_register(tlh_t* tlh);
+static void          idle_unregister();
+static inline void   idle_enter();
+static inline void   idle_leave();
+static void          idle_wait(idle_slot_t* slot);
+static inline void   idle_tick();
+static void          idle_scan();
+static void          idle_flush(idle_slot_t* slot, tlh_t* tlh, uint32_t calls);
+static bool          idle_barrier();
+#else
+#define idle_init()
+#define idle_enter()
+#define idle_leave()
+#define idle_tick()
+#endif
+
+/* Background Thread */
+#ifdef MALLOC_USE_BG_THREAD
+static void  bg_thread_start();
+static void* bg_thread_main(void* arg);
+static void  bg_reclaim_orphans();
+static void  orphan_list_push(sph_t* sph);
+#endif
+
 /* SizeMap */
 static void sizemap_init();
 static inline uint32_t get_logfloor(uint32_t n);
@@ -130,14 +345,34 @@ static inline void* pagemap_get(size_t page_id);
 static inline void* pagemap_get_checked(size_t page_id);
 static inline void  pagemap_set(size_t page_id, void* val);
 static inline void  pagemap_set_range(size_t start, size_t len, void* val);
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+static inline pagemap_leaf_t* pagemap_cache_find(size_t tag);
+static inline void  pagemap_cache_insert(size_t tag, pagemap_leaf_t* leaf);
+static inline pagemap_leaf_t* pagemap_leaf(size_t tag);
+#endif
+
+#ifdef MALLOC_USE_ARENA
+/* Superpage Arena */
+static void   arena_init();
+static inline bool  arena_has_page(size_t page_id);
+static inline void* arena_map_get(size_t page_id);
+static inline void  arena_map_set(size_t page_id, void* val);
+static sph_t* arena_alloc();
+static void   arena_free(sph_t* sph);
+#endif
+static void   sp_unmap(sph_t* sph);
 
 /* Superpage and Superpage Header (SPH) */
 static sph_t* sph_alloc(tlh_t* tlh);
 static void   sph_free(tlh_t* tlh, sph_t* sph);
+static inline sph_t* sp_list_pop_all(uint32_t node);
+static inline void   sp_list_push(uint32_t node, sph_t* first, sph_t* last);
 static void   sph_get_remote_pbs(sph_t* sph);
+static void   sph_free_remote_pbs(tlh_t* tlh, sph_t* sph);
 static void   sph_coalesce_pbs(pbh_t* pbh);
 static bool   take_superpage(tlh_t* tlh, sph_t* sph);
 static void   finish_superpages(tlh_t* tlh);
+static bool   finish_superpage(tlh_t* tlh, sph_t* sph);
 static bool   try_to_free_superpage(sph_t* sph);
 static inline void   sph_link_init(sph_t* sph);
 static inline void   sph_list_prepend(sph_t** list, sph_t* sph);
@@ -149,6 +384,18 @@ static hazard_ptr_t* hazard_ptr_alloc();
 static void          hazard_ptr_free(hazard_ptr_t* hptr);
 static bool scan_hazard_pointers(sph_t* sph);
 
+#ifdef MALLOC_USE_REMOTE_INBOX
+/* Remote Free Inbox */
+static inbox_t*      inbox_alloc();
+static void          inbox_free(inbox_t* ib);
+static inline void   inbox_push(tlh_t* tlh, inbox_t* ib,
+                                 void* first, void* last);
+static void          inbox_drain(tlh_t* tlh, inbox_t* ib, uint32_t mode);
+static void          sph_set_inbox(tlh_t* tlh, sph_t* sph, uint32_t mode);
+static inline void   pbh_remote_push(pbh_t* pbh, void* first, void* last,
+                                     uint32_t N);
+#endif
+
 /* Page Block Header (PBH) */
 static inline pbh_t* pbh_alloc(sph_t* sph, size_t page_id, size_t len);
 static inline void   pbh_free(pbh_t* pbh);
@@ -160,10 +407,16 @@ static void          pbh_add_unused(tlh_t* tlh, pbh_t* pbh,
 static inline sph_t* pbh_get_superpage(pbh_t* pbh);
 static inline void   pbh_link_init(pbh_t* pbh);
 static inline void   pbh_field_init(pbh_t* pbh);
+static inline void   pbh_set_in_use(pbh_t* pbh);
+static inline void   pbh_merge_dirty(pbh_t* lo, pbh_t* hi);
 static inline void   pbh_list_prepend(pbh_t** list, pbh_t* pbh);
 static inline pbh_t* pbh_list_pop(pbh_t** list);
 static inline void   pbh_list_remove(pbh_t** list, pbh_t* pbh);
 static inline void   pbh_list_move_to_first(pbh_t** list, pbh_t* pbh);
+static inline void    free_pb_list_push(tlh_t* tlh, pbh_t* pbh);
+static inline pbh_t*  free_pb_list_pop(tlh_t* tlh, uint32_t c);
+static inline void    free_pb_list_remove(tlh_t* tlh, pbh_t* pbh);
+static inline int32_t free_pb_list_find(tlh_t* tlh, uint32_t c);
 
 /* Page Block (PB) */
 static pbh_t* pb_alloc(tlh_t* tlh, size_t page_len);
@@ -175,10 +428,42 @@ static inline pbh_t* pb_coalesce(tlh_t* tlh, pbh_t* pbh);
 
 /* Thread Local Heap (TLH) */
 static void tlh_init();
+static inline bool tlh_attach();
+static void exit_heap_enter();
+static void exit_heap_leave();
+static size_t exit_heap_release();
+#ifdef MALLOC_USE_BG_THREAD
+static void exit_heap_tick();
+#endif
+static void exit_heap_lock();
+static void exit_heap_unlock();
 static void tlh_clear(tlh_t* tlh);
-static void tlh_return_list(tlh_t* tlh, uint32_t cl);
+static void tlh_flush(tlh_t* tlh);
+static void tlh_return_list(tlh_t* tlh, uint32_t cl, uint32_t keep);
 static void tlh_return_unused(tlh_t* tlh, uint32_t cl);
 static void tlh_return_pbhs(tlh_t* tlh, uint32_t cl);
+static size_t tlh_release(tlh_t* tlh);
+static void tlh_release_pbhs(tlh_t* tlh, uint32_t cl);
+
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+/* Adaptive Block List */
+static inline uint32_t list_max(uint32_t cl);
+static inline void list_set(tlh_t* tlh, uint32_t cl, uint32_t max_free);
+static void list_overflow(tlh_t* tlh, uint32_t cl);
+static void list_grow(tlh_t* tlh, uint32_t cl);
+static void list_steal(tlh_t* tlh, uint32_t cl, size_t need);
+static void list_reset(tlh_t* tlh);
+#endif
+
+#ifdef MALLOC_USE_TRANSFER_CACHE
+/* Transfer Cache */
+static void  tc_init();
+static bool  tc_push(tlh_t* tlh, uint32_t cl, uint32_t keep);
+static void* tc_pop(tlh_t* tlh, uint32_t cl);
+static void  tc_drain();
+static void  tc_drain_to(tlh_t* tlh);
+static inline bool tc_block_dead(void* blk);
+#endif
 
 /* Page Block Cache */
 static inline int  get_cache_hit_index(v8qi val);
@@ -189,14 +474,68 @@ static inline void* bump_alloc(size_t size, blk_list_t* b_list);
 static inline void* small_malloc(uint32_t cl);
 static inline void* large_malloc(size_t page_len);
 static inline void* huge_malloc(size_t page_len);
+#ifdef MALLOC_USE_HUGETLB
+static void*        huge_mmap_hugetlb(size_t* size);
+#endif
 static inline bool  remote_free(tlh_t* tlh, pbh_t* pbh,
                                 void* first, void* last, uint32_t N);
+#ifdef MALLOC_USE_REMOTE_BUFFER
+static inline void  remote_buf_add(tlh_t* tlh, pbh_t* pbh, void* ptr);
+static void         remote_buf_flush(tlh_t* tlh, remote_buf_t* rb);
+static void         remote_buf_flush_all(tlh_t* tlh);
+static inline void  remote_buf_tick(tlh_t* tlh);
+#endif
 static inline void  small_free(void* ptr, pbh_t* pbh);
 static inline void  large_free(void* ptr, pbh_t* pbh);
 static inline void  huge_free(void* ptr, size_t size);
 
+#ifdef MALLOC_USE_PERCPU
+/* Per-CPU Cache */
+static void          pcpu_init();
+static pcpu_cache_t* pcpu_cache_get(uint32_t cpu);
+static inline void*  pcpu_malloc(uint32_t cl);
+static inline void   pcpu_free(void* ptr, pbh_t* pbh);
+static void          pcpu_refill(uint32_t cl);
+static void          pcpu_flush(uint32_t cl, uint32_t n);
+#endif
+
+// TLH of the thread, or the exit heap it holds after it has exited
+#define LOCAL_TLH()     (UNLIKELY(l_exit_heap != NULL) ? l_exit_heap : &l_tlh)
+
+#ifdef MALLOC_USE_SHARED_HEAPS
+/* Shared Heap */
+static void          heaps_init();
+static void          front_init();
+static void          heap_bind();
+static void          heap_unbind();
+static void          heap_init(shared_heap_t* heap);
+static void          heaps_lock_all();
+static void          heaps_unlock_all();
+static inline void   heap_lock(shared_heap_t* heap);
+static inline void   heap_unlock(shared_heap_t* heap);
+static inline void*  front_malloc(uint32_t cl);
+static inline void   front_free(void* ptr, pbh_t* pbh);
+static void          front_flush(uint32_t cl, uint32_t n);
+static void          front_flush_all();
+
+// TLH the calling thread allocates from. Shared ones are locked around it.
+#define CUR_TLH()       (l_heap != NULL ? &l_heap->tlh : LOCAL_TLH())
+#define HEAP_SHARED()   (l_heap != NULL)
+#define HEAP_LOCK()     do { if (l_heap) heap_lock(l_heap); } while (0)
+#define HEAP_UNLOCK()   do { if (l_heap) heap_unlock(l_heap); } while (0)
+#else
+#define CUR_TLH()       LOCAL_TLH()
+#define HEAP_SHARED()   0
+#define HEAP_LOCK()
+#define HEAP_UNLOCK()
+#endif
+
 /* Statistics */
 void malloc_stats();
+#ifdef MALLOC_USE_HEAP_STATS
+static heap_stat_t* heap_stat_alloc();
+static void         heap_stat_free(heap_stat_t* hstat);
+#endif
 #ifdef MALLOC_STATS
 void stats_init();
 void print_stats();
@@ -204,6 +543,44 @@ void print_stats();
 #define stats_init();
 #define print_stats()
 #endif
+#ifdef MALLOC_USE_HEAP_PROF
+static void prof_init();
+static int64_t prof_next_interval(tlh_t* tlh);
+static void prof_malloc_sample(void* ptr, size_t size) __attribute__((noinline));
+static void prof_free_sample(void* ptr);
+static void prof_dump_requested();
+#else
+#define prof_init()
+#define prof_dump_requested()
+#endif
+
+/* Allocation Trace */
+#ifdef MALLOC_USE_TRACE
+static void trace_init();
+static void trace_record(uint32_t op, void* ptr, size_t size, uintptr_t arg);
+static void trace_flush(trace_buf_t* tb);
+static void trace_thread_exit();
+static void trace_exit();
+#define trace_begin()           l_trace_nest++
+#define trace_end(op,p,s,a)     if (--l_trace_nest == 0 && g_trace_fd >= 0) \
+                                  trace_record(op, p, s, (uintptr_t)(a))
+#define trace_free(p)           if (l_trace_nest == 1 && g_trace_fd >= 0) \
+                                  trace_record(SF_TRACE_FREE, p, 0, 0)
+#define trace_leave()           l_trace_nest--
+#else
+#define trace_init()
+#define trace_thread_exit()
+#define trace_exit()
+#define trace_begin()
+#define trace_end(op,p,s,a)
+#define trace_free(p)
+#define trace_leave()
+#endif
+#if defined(MALLOC_STATS) && defined(MALLOC_USE_BG_THREAD)
+static void print_bg_stats();
+#else
+#define print_bg_stats()
+#endif
 
 /* Debugging */
 #ifdef MALLOC_DEBUG
@@ -240,6 +617,21 @@ void sf_malloc_init() {
     CRASH("PBH size (%lu) != cache line size (%u)\n",
           PBH_SIZE, CACHE_LINE_SIZE);
   }
+  if (sizeof(sph_t) > PBH_SIZE) {
+    CRASH("SPH size (%lu) > PBH size (%lu)\n", sizeof(sph_t), PBH_SIZE);
+  }
+#endif
+
+  // Read SFMALLOC_OPTIONS before anything is allocated.
+  options_init();
+  prof_init();
+  trace_init();
+#ifdef MALLOC_USE_SHARED_HEAPS
+  heaps_init();
+#endif
+
+#ifdef MALLOC_USE_IDLE_FLUSH
+  idle_init();
 #endif
 
   // Initialize thread local heap.
@@ -248,7 +640,16 @@ void sf_malloc_init() {
   // Initialize data structures.
   debug_init();
   sizemap_init();
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  tc_init();
+#endif
   pagemap_init();
+#ifdef MALLOC_USE_PERCPU
+  pcpu_init();
+#endif
+#ifdef MALLOC_USE_SHARED_HEAPS
+  front_init();
+#endif
   stats_init();
 
   // Create a thread key to call the destructor.
@@ -263,6 +664,21 @@ void sf_malloc_init() {
   }
 #endif
 
+  // The exit heap may not be left locked in the child after fork().
+  pthread_atfork(exit_heap_lock, exit_heap_unlock, exit_heap_unlock);
+#ifdef MALLOC_USE_SHARED_HEAPS
+  // No heap may be left locked in the child after fork().
+  if (g_heap_num > 0) {
+    pthread_atfork(heaps_lock_all, heaps_unlock_all, heaps_unlock_all);
+  }
+#endif
+
+#ifdef MALLOC_USE_BG_THREAD
+  // Start the background thread, also in the child after fork().
+  bg_thread_start();
+  pthread_atfork(NULL, NULL, bg_thread_start);
+#endif
+
   LOG_D("[T%u] sf_malloc_init(): TLH=%p\n", TID(), &l_tlh);
 }
 
@@ -285,9 +701,19 @@ void sf_malloc_exit() {
   if (g_initialized == 0) return;
   g_initialized = 0;
 
+#ifdef MALLOC_USE_BG_THREAD
+  g_bg_thread_stop = 1;
+#endif
+
   LOG_D("[T%u] sf_malloc_exit()\n", TID());
   print_stats();
+  print_bg_stats();
+  trace_exit();
+#ifdef MALLOC_STATS
   malloc_stats();
+#else
+  if (g_stats_print) malloc_stats();
+#endif
 }
 
 
@@ -295,15 +721,33 @@ void sf_malloc_exit() {
 void sf_malloc_thread_exit() {
   tlh_t* tlh = &l_tlh;
   if (tlh->thread_id == DEAD_OWNER) return;
+  idle_enter();
 
-  // Clear thread-local heap.
-  tlh_clear(&l_tlh);
+  // Clear thread-local heap. A shared heap outlives its threads.
+  if (!HEAP_SHARED()) tlh_clear(&l_tlh);
+  trace_thread_exit();
 
   LOG_D("[T%u] EXIT\n", TID());
   print_stats();
 
   // Reset thread ID
   tlh->thread_id = DEAD_OWNER;
+  l_tlh_exited = 1;
+
+#ifdef MALLOC_USE_SHARED_HEAPS
+  // print_stats() may have allocated, so the heap is kept until here.
+  if (HEAP_SHARED()) heap_unbind();
+#endif
+#ifdef MALLOC_USE_REMOTE_INBOX
+  // print_stats() may have allocated, so the inbox is kept until here.
+  if (tlh->inbox != NULL) inbox_free(tlh->inbox);
+  tlh->inbox = NULL;
+#endif
+
+#ifdef MALLOC_USE_IDLE_FLUSH
+  // No flusher may touch the TLH any more.
+  if (l_idle != NULL) idle_unregister();
+#endif
 
   // Decrease the number of currently running threads.
   atomic_dec_int((volatile int*)&g_thread_num);
@@ -332,9 +776,59 @@ static inline void* do_mmap(size_t size) {
   inc_cnt_mmap();
   inc_size_mmap(size);
   update_size_mmap_max();
+  hstat_add_size_mapped(size);
+
+  return mem;
+}
+
+
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+/* mmap aligned to align, which should be a power of two. */
+static void* do_mmap_aligned(size_t size, size_t align) {
+  void* mem = do_mmap(size);
+  if (((uintptr_t)mem & (align - 1)) == 0) return mem;
+
+  // Map more and unmap the unaligned head and tail.
+  do_munmap(mem, size);
+  mem = do_mmap(size + align);
+
+  uintptr_t start = (uintptr_t)mem;
+  uintptr_t aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+  size_t head = aligned - start;
+  if (head > 0) {
+    do_munmap(mem, head);
+  }
+  do_munmap((void*)(aligned + size), align - head);
+
+  return (void*)aligned;
+}
+#endif
+
+
+#ifdef MALLOC_USE_HUGETLB
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  26
+#endif
+/* mmap with hugetlb pages of (1 << shift) bytes. size should be a multiple
+   of the page size. Return NULL if the hugetlb pool cannot satisfy it. */
+static void* do_mmap_hugetlb(size_t size, int shift) {
+  int flags = MMAP_FLAGS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT);
+  void* mem = mmap(0, size, MMAP_PROT, flags, -1, 0);
+  if (mem == MAP_FAILED) {
+    inc_cnt_hugetlb_fail();
+    return NULL;
+  }
+
+  inc_cnt_mmap();
+  inc_size_mmap(size);
+  update_size_mmap_max();
+  hstat_add_size_mapped(size);
+  inc_cnt_hugetlb();
+  inc_size_hugetlb(size);
 
   return mem;
 }
+#endif
 
 
 static inline void do_munmap(void* addr, size_t size) {
@@ -345,13 +839,29 @@ static inline void do_munmap(void* addr, size_t size) {
 
   inc_cnt_munmap();
   inc_size_munmap(size);
+  hstat_add_size_mapped(-(int64_t)size);
 }
 
 
+#ifndef MADV_FREE
+#define MADV_FREE   8
+#endif
 static inline void do_madvise(void* addr, size_t size) {
-  if (madvise(addr, size, MADV_DONTNEED) == -1) {
-    perror("do_madvise");
-    CRASH("addr=%p size=%lu\n", addr, size);
+#ifdef MALLOC_USE_DECAY_PURGE
+  int advice = g_purge_advice;
+#else
+  int advice = MADV_DONTNEED;
+#endif
+  if (madvise(addr, size, advice) == -1) {
+    // MADV_FREE is not supported before Linux 4.5.
+    if (errno != EINVAL || advice == MADV_DONTNEED ||
+        madvise(addr, size, MADV_DONTNEED) == -1) {
+      perror("do_madvise");
+      CRASH("addr=%p size=%lu\n", addr, size);
+    }
+#ifdef MALLOC_USE_DECAY_PURGE
+    g_purge_advice = MADV_DONTNEED;
+#endif
   }
 
   inc_cnt_madvise();
@@ -359,1023 +869,1225 @@ static inline void do_madvise(void* addr, size_t size) {
 }
 
 
-
+#ifdef MALLOC_USE_NUMA
 ////////////////////////////////////////////////////////////////////////////
-// SizeMap Functions
+// NUMA Functions
 ////////////////////////////////////////////////////////////////////////////
-/* Initialize the mapping arrays */
-static void sizemap_init() {
-  const uint8_t class_array[CLASS_ARRAY_SIZE] = {
-    0,  0,  1,  2,  2,  3,  3,  4,  4,  5, 
-    5,  6,  6,  7,  7,  8,  8,  9,  9, 10, 
-    10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 
-    15, 16, 16, 17, 17, 17, 17, 18, 18, 18, 
-    18, 19, 19, 19, 19, 20, 20, 20, 20, 21, 
-    21, 21, 21, 21, 21, 21, 21, 22, 22, 22, 
-    22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 
-    23, 23, 23, 24, 24, 24, 24, 24, 24, 24, 
-    24, 25, 25, 25, 25, 25, 25, 25, 25, 26, 
-    26, 26, 26, 26, 26, 26, 26, 27, 27, 27, 
-    27, 27, 27, 27, 27, 28, 28, 28, 28, 28, 
-    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 
-    28, 28, 28, 28, 28, 28, 28, 28, 28, 29, 
-    30, 31, 32, 33, 34, 34, 34, 35, 35, 36, 
-    36, 37, 37, 37, 37, 38, 38, 39, 39, 39, 
-    39, 39, 39, 40, 40, 41, 41, 42, 42, 42, 
-    42, 43, 43, 43, 43, 43, 43, 43, 43, 44, 
-    44, 44, 44, 45, 45, 46, 46, 46, 46, 46, 
-    46, 46, 46, 46, 46, 47, 47, 47, 47, 48, 
-    48, 48, 48, 48, 48, 48, 48, 48, 48, 48, 
-    48, 49, 49, 50, 50, 50, 50, 50, 50, 50, 
-    50, 50, 50, 50, 50, 50, 50, 51, 51, 51, 
-    51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 
-    51, 52, 52, 52, 52, 52, 52, 52, 52, 52, 
-    52, 52, 52, 52, 52, 52, 52, 52, 52, 53, 
-    53, 53, 53, 53, 53, 53, 53, 53, 53, 54, 
-    54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 
-    54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 
-    54, 55, 55, 55, 55, 55, 55, 56, 56, 56, 
-    56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 
-    56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 
-    56, 56, 56, 57, 57, 58, 58, 58, 58, 58, 
-    58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 
-    58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 
-    58, 58, 58, 58, 58, 59, 59, 59, 59, 59, 
-    59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 
-    59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 
-    59, 59, 59, 59, 59, 59, 59
-  };
-
-  const uint32_t class_to_size[NUM_CLASSES] = {
-        8,    16,    32,    48,    64,    80,    96,   112,   128,   144, 
-      160,   176,   192,   208,   224,   240,   256,   288,   320,   352, 
-      384,   448,   512,   576,   640,   704,   768,   832,  1024,  1152, 
-     1280,  1408,  1536,  1664,  2048,  2304,  2560,  3072,  3328,  4096, 
-     4352,  4608,  5120,  6144,  6656,  6912,  8192,  8704, 10240, 10496, 
-    12288, 14080, 16384, 17664, 20480, 21248, 24576, 24832, 28672, 32768
-  };
-
-  const uint16_t class_to_pages[NUM_CLASSES] = {
-    1,  1,  1,  1,  1,  1,  1,  1,  1,  1, 
-    1,  1,  1,  1,  1,  1,  1,  1,  1,  1, 
-    1,  1,  1,  1,  1,  2,  1,  2,  1,  2, 
-    1,  3,  2,  3,  1,  3,  2,  3,  5,  1, 
-    6,  5,  4,  3,  5,  7,  2,  7,  5,  8, 
-    3,  7,  4,  9,  5, 11,  6, 13,  7,  8
-  };
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
 
-  const uint16_t num_blocks_per_pbh[NUM_CLASSES] = {
-    512, 256, 128,  85,  64,  51,  42,  36,  32,  28, 
-     25,  23,  21,  19,  18,  17,  16,  14,  12,  11, 
-     10,   9,   8,   7,   6,  11,   5,   9,   4,   7, 
-      3,   8,   5,   7,   2,   5,   3,   4,   6,   1, 
-      5,   4,   3,   2,   3,   4,   1,   3,   2,   3, 
-      1,   2,   1,   2,   1,   2,   1,   2,   1,   1
-  };
+/* Return the node of the CPU the calling thread is running on. */
+static uint32_t numa_get_node() {
+#ifdef MALLOC_NUMA_FAKE_NODES
+  return l_tlh.thread_id % MALLOC_NUMA_FAKE_NODES;
+#else
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) return 0;
+  return node % MAX_NUMA_NODES;
+#endif
+}
 
-  memcpy(g_sizemap.class_array, class_array,
-         sizeof(uint8_t) * CLASS_ARRAY_SIZE);
-  for (int i = 0; i < NUM_CLASSES; ++i) {
-    g_sizemap.info[i].class_to_size = class_to_size[i];
-    g_sizemap.info[i].class_to_pages = class_to_pages[i];
-    g_sizemap.info[i].num_blocks_per_pbh = num_blocks_per_pbh[i];
-  }
 
-#ifdef MALLOC_DEBUG_DETAIL
-  print_sizemap();
+/* Place the pages of the range on node if possible. If mbind() is not
+   available, the first touch by the owner places them. */
+static inline void numa_bind(void* addr, size_t size, uint32_t node) {
+#ifndef MALLOC_NUMA_FAKE_NODES
+  unsigned long mask = 1UL << node;
+  syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
 #endif
 }
+#endif
 
-static inline uint32_t get_logfloor(uint32_t n) {
-  uint32_t log = 0;
-  for (int32_t i = 4; i >= 0; --i) {
-    uint32_t shift = 1 << i;
-    uint32_t x = n >> shift;
-    if (x != 0) {
-      n = x;
-      log += shift;
-    }
-  }
-  assert(n == 1);
-  return log;
-}
 
-/* Compute index of the class_array[] entry for a given size */
-static inline uint32_t get_classindex(uint32_t s) {
-  const bool big = (s > MAX_SMALL_SIZE);
-  const uint32_t add_amount   = big ? (127 + (120 << 7)) : 7;
-  const uint32_t shift_amount = big ? 7 : 3;
-  return (s + add_amount) >> shift_amount;
-}
 
-static inline uint32_t get_sizeclass(uint32_t size) {
-  return g_sizemap.class_array[get_classindex(size)];
+////////////////////////////////////////////////////////////////////////////
+// Purging Functions
+////////////////////////////////////////////////////////////////////////////
+/* Coarse monotonic time in milliseconds. 0 is reserved for "purged". */
+static inline uint32_t get_msec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  uint32_t msec = (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+  return msec ? msec : 1;
 }
 
-/* Get the byte-size for a specified class */
-static inline uint32_t get_size_for_class(uint32_t cl) {
-  return g_sizemap.info[cl].class_to_size;
+
+static inline bool is_decayed(uint32_t free_time, uint32_t now,
+                              uint32_t decay) {
+  return free_time && (now - free_time) >= decay;
 }
 
-static inline uint32_t get_pages_for_class(uint32_t cl) {
-  return g_sizemap.info[cl].class_to_pages;
+
+#ifdef MALLOC_USE_DECAY_PURGE
+/* Called when a page block is freed. Purge at most once per interval. */
+static inline void purge_tick(tlh_t* tlh) {
+  if (!g_purge) return;
+
+  uint32_t now = get_msec();
+  if ((int32_t)(now - tlh->next_purge) >= 0) {
+    tlh->next_purge = now + g_purge_interval;
+    tlh_purge(tlh, now, g_purge_decay);
+#ifndef MALLOC_USE_BG_THREAD
+    sp_list_purge(now, g_purge_decay);
+#endif
+  }
 }
+#endif
 
-static inline uint32_t get_blocks_for_class(uint32_t cl) {
-  return g_sizemap.info[cl].num_blocks_per_pbh;
+
+/* Purge the free page blocks of the TLH that have been free for decay ms.
+   Return the purged size. */
+static size_t tlh_purge(tlh_t* tlh, uint32_t now, uint32_t decay) {
+  size_t total = 0;
+  for (int32_t c = free_pb_list_find(tlh, 0); c >= 0;
+       c = free_pb_list_find(tlh, c + 1)) {
+    pbh_t* list = tlh->free_pb_list[c];
+
+    pbh_t* pbh = list;
+    do {
+      if (is_decayed(pbh->free_time, now, decay)) {
+        pbh->free_time = 0;
+#ifdef MALLOC_USE_HUGETLB
+        // Parts of a hugetlb page cannot be returned.
+        if (pbh_get_superpage(pbh)->hugetlb) {
+          pbh = pbh->next;
+          continue;
+        }
+#endif
+        // Pages outside the dirty range were purged before.
+        size_t size = (size_t)pbh->dirty_len << PAGE_SHIFT;
+        size_t page = pbh->start_page + pbh->dirty_first;
+        do_madvise((void*)(page << PAGE_SHIFT), size);
+        pbh->dirty_len = 0;
+        inc_size_purge_pb(size);
+        total += size;
+      }
+      pbh = pbh->next;
+    } while (pbh != list);
+  }
+  return total;
 }
 
-static uint32_t get_alignment(uint32_t size) {
-  int alignment = ALIGNMENT;
-  if (size > MAX_SIZE) {
-    alignment = PAGE_SIZE;
-  } else if (size >= 2048) {
-    // Cap alignment at 256 for large sizes.
-    alignment = 256;
-  } else if (size >= 128) {
-    // Space wasted due to alignment is at most 1/8, i.e., 12.5%.
-    alignment = (1 << get_logfloor(size)) / 8;
-  } else if (size >= 16) {
-    // We need an alignment of at least 16 bytes to satisfy
-    // requirements for some SSE types.
-    alignment = 16;
-  }
 
-  assert(size < 16 || alignment >= 16);
-  assert((alignment & (alignment - 1)) == 0);
+/* Purge the superpages in the Free Superpage Lists that have been
+   free for decay ms. Only one thread purges at a time; the others skip it.
+   A list is detached only while it is split, not while the pages are
+   madvised, so that sph_alloc() can still reuse the others meanwhile.
+   Return the purged size. */
+static size_t sp_list_purge(uint32_t now, uint32_t decay) {
+  if (atomic_xchg_uint(&g_sp_purge_lock, 1)) return 0;
+
+  size_t total = 0;
+  for (uint32_t node = 0; node < MAX_NUMA_NODES; node++) {
+    if (g_free_sp_list[node] == NULL) continue;
+    sph_t* list = sp_list_pop_all(node);
+    if (list == NULL) continue;
+
+    // Take out the superpages to purge and push the others back at once.
+    sph_t* keep_first  = NULL;
+    sph_t* keep_last   = NULL;
+    sph_t* purge_first = NULL;
+    sph_t* purge_last  = NULL;
+    while (list != NULL) {
+      sph_t* sph = list;
+      list = sph->next;
+      sph->next = NULL;
+
+      if (is_decayed(sph->free_time, now, decay)
+#ifdef MALLOC_USE_HUGETLB
+          && !sph->hugetlb
+#endif
+          ) {
+        if (purge_last) purge_last->next = sph;
+        else purge_first = sph;
+        purge_last = sph;
+      } else {
+        if (keep_last) keep_last->next = sph;
+        else keep_first = sph;
+        keep_last = sph;
+      }
+    }
+    if (keep_first != NULL) sp_list_push(node, keep_first, keep_last);
+    if (purge_first == NULL) continue;
+
+    for (sph_t* sph = purge_first; sph != NULL; sph = sph->next) {
+      // Only data pages are purged. The header may be read by others.
+      do_madvise((void*)(GET_START_PAGE(sph) << PAGE_SHIFT), SUPERPAGE_SIZE);
+      sph->free_time = 0;
+      inc_size_purge_sp(SUPERPAGE_SIZE);
+      total += SUPERPAGE_SIZE;
+    }
 
-  return alignment;
+    // Put the purged superpages behind the dirty ones, which are reused
+    // first.
+    list = sp_list_pop_all(node);
+    if (list != NULL) {
+      sph_t* last_sph = list;
+      while (last_sph->next != NULL) last_sph = last_sph->next;
+      last_sph->next = purge_first;
+      purge_first = list;
+    }
+    sp_list_push(node, purge_first, purge_last);
+  }
+
+  __sync_lock_release(&g_sp_purge_lock);
+  return total;
 }
 
 
-////////////////////////////////////////////////////////////////////////////
-// PageMap Functions
-////////////////////////////////////////////////////////////////////////////
-static void pagemap_init() {
-}
+/* Unmap the superpages in the Free Superpage Lists except for keep_len of
+   them. The most recently freed ones of each list are kept first. Return
+   the unmapped size. */
+static size_t sp_list_trim(uint32_t keep_len) {
+  uint32_t cnt_keep = 0;
+  size_t total = 0;
 
+  for (uint32_t node = 0; node < MAX_NUMA_NODES; node++) {
+    // Pop the whole Free Superpage List.
+    sph_t* sph = sp_list_pop_all(node);
+    if (sph == NULL) continue;
 
-static void pagemap_expand(size_t page_id, size_t n) {
-  for (size_t key = page_id; key < page_id + n; ) {
-    const size_t i1 = key >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
-    const size_t i2 = (key >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
-    assert(i1 < PMAP_INTERIOR_LEN && i2 < PMAP_INTERIOR_LEN);
+    // Recently freed superpages are at the front. Keep them.
+    sph_t* keep_first = NULL;
+    sph_t* keep_last  = NULL;
 
-    // Make 2nd level node if necessary
-    if (g_pagemap.node[i1] == NULL) {
-      size_t node_size = sizeof(pagemap_node_t);
-      pagemap_node_t* new_node = (pagemap_node_t*)do_mmap(node_size);
-      if (!CAS_ptr(&g_pagemap.node[i1], NULL, new_node)) {
-        do_munmap(new_node, node_size);
+    while (sph != NULL) {
+      sph_t* next_sph = sph->next;
+
+      // Orphan-listed superpages are unmapped after they are unlinked.
+      bool keep = (cnt_keep < keep_len) || (sph->orphan_mark != ORPHAN_NONE);
+      if (!keep && sph->hazard_mark) {
+        if (scan_hazard_pointers(sph)) {
+          keep = true;
+        } else {
+          sph->hazard_mark = false;
+        }
       }
-    }
 
-    // Make leaf node if necessary
-    pagemap_node_t* interior = g_pagemap.node[i1];
-    if (interior->leaf[i2] == NULL) {
-      size_t leaf_size = sizeof(pagemap_leaf_t);
-      pagemap_leaf_t* new_leaf = (pagemap_leaf_t*)do_mmap(leaf_size);
-      if (!CAS_ptr(&interior->leaf[i2], NULL, new_leaf)) {
-        do_munmap(new_leaf, leaf_size);
+      if (keep) {
+        sph->next = NULL;
+        if (keep_last) keep_last->next = sph;
+        else keep_first = sph;
+        keep_last = sph;
+        cnt_keep++;
+      } else {
+        atomic_dec_int((volatile int*)&g_free_sp_len);
+        sp_unmap(sph);
+        total += SUPERPAGE_MAP_SIZE;
       }
+
+      sph = next_sph;
     }
 
-    // Advance key past whatever is covered by this leaf node
-    key = ((key >> PMAP_LEAF_BIT) + 1) << PMAP_LEAF_BIT;
+    if (keep_first != NULL) {
+      // Push the kept superpages back to the Free Superpage List.
+      sp_list_push(node, keep_first, keep_last);
+    }
   }
+
+  return total;
 }
 
 
-static inline void* pagemap_get(size_t page_id) {
-#ifdef MALLOC_USE_PAGEMAP_CACHE
-  const size_t tag = page_id >> PMAP_LEAF_BIT;
-  const size_t i3  = page_id & (PMAP_LEAF_LEN - 1);
-  if (UNLIKELY(l_pagemap_tag != tag)) {
-    // new caching
-    const size_t i1 = tag >> PMAP_INTERIOR_BIT;
-    const size_t i2 = tag & (PMAP_INTERIOR_LEN - 1);
-    l_pagemap_tag  = tag;
-    l_pagemap_leaf = g_pagemap.node[i1]->leaf[i2];
-  }
-  return l_pagemap_leaf->val[i3];
-#else
-  const size_t i1 = page_id >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
-  const size_t i2 = (page_id >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
-  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
-  assert((page_id >> PMAP_BITS) == 0);
-  assert(g_pagemap.node[i1] != NULL);
-  assert(g_pagemap.node[i1]->leaf[i2] != NULL);
-  return g_pagemap.node[i1]->leaf[i2]->val[i3];
+
+////////////////////////////////////////////////////////////////////////////
+// Memory Release Functions
+////////////////////////////////////////////////////////////////////////////
+/* Return the fully free pages of the calling thread, the exit heap and the
+   global Free Superpage List to the OS, except for keep_len free superpages,
+   which stay mapped and are not purged. Return the released size in bytes. */
+static size_t release_free_memory(uint32_t keep_len) {
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  // The cached batches are returned with the blocks of this thread.
+  tc_drain();
 #endif
-}
+  size_t total = sf_malloc_thread_flush();
+  total += exit_heap_release();
 
+  // Superpages freed above are also released.
+  total += sp_list_trim(keep_len);
+  if (keep_len == 0) total += sp_list_purge(get_msec(), 0);
 
-static inline void* pagemap_get_checked(size_t page_id) {
-  const size_t i1 = page_id >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
-  const size_t i2 = (page_id >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
-  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
+  return total;
+}
 
-  if (((page_id >> PMAP_BITS) > 0) ||
-      (g_pagemap.node[i1] == NULL) ||
-      (g_pagemap.node[i1]->leaf[i2] == NULL)) return NULL;
 
-  return g_pagemap.node[i1]->leaf[i2]->val[i3];
+size_t sf_malloc_release_free_memory() {
+  return release_free_memory(0);
 }
 
 
-static inline void pagemap_set(size_t page_id, void* val) {
-#ifdef MALLOC_USE_PAGEMAP_CACHE
-  const size_t tag = page_id >> PMAP_LEAF_BIT;
-  const size_t i3  = page_id & (PMAP_LEAF_LEN - 1);
-  if (UNLIKELY(l_pagemap_tag != tag)) {
-    const size_t i1 = tag >> PMAP_INTERIOR_BIT;
-    const size_t i2 = tag & (PMAP_INTERIOR_LEN - 1);
-    l_pagemap_tag  = tag;
-    l_pagemap_leaf = g_pagemap.node[i1]->leaf[i2];
+/* Do what tlh_clear() does at thread exit, except that the superpages are
+   kept. Return the size of the pages purged. */
+size_t sf_malloc_thread_flush() {
+  if (l_tlh.thread_id == DEAD_OWNER) return 0;
+  idle_enter();
+
+#ifdef MALLOC_USE_PERCPU
+  // Only the cache of this CPU can be flushed here.
+  if (g_percpu) {
+    for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+      pcpu_flush(cl, PCPU_SLOTS);
+    }
   }
-  l_pagemap_leaf->val[i3] = val;
-#else
-  assert(page_id >> PMAP_BITS == 0);
-  const size_t i1 = page_id >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
-  const size_t i2 = (page_id >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
-  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
-  g_pagemap.node[i1]->leaf[i2]->val[i3] = val;
 #endif
+#ifdef MALLOC_USE_SHARED_HEAPS
+  if (HEAP_SHARED()) front_flush_all();
+#endif
+
+  tlh_t* tlh = CUR_TLH();
+  HEAP_LOCK();
+  size_t total = tlh_release(tlh);
+  HEAP_UNLOCK();
+
+  idle_leave();
+  return total;
 }
 
 
-static inline void pagemap_set_range(size_t start, size_t len, void* val) {
-  for (size_t page_id = start; page_id < (start + len); page_id++) {
-    pagemap_set(page_id, val);
-  }
+/* Release the free memory of the calling thread now and ask the other
+   threads to do the same at their next malloc(). */
+void sf_malloc_release_free_memory_all() {
+  atomic_inc_uint(&g_release_epoch);
+  l_tlh.release_epoch = g_release_epoch;
+  sf_malloc_release_free_memory();
+}
+
+
+/* pad bytes of free superpages are left to later allocations. */
+int malloc_trim(size_t pad) {
+  size_t keep_len = (pad + SUPERPAGE_SIZE - 1) / SUPERPAGE_SIZE;
+  if (keep_len > UINT32_MAX) keep_len = UINT32_MAX;
+  return release_free_memory((uint32_t)keep_len) > 0;
 }
 
 
+
+
+#ifdef MALLOC_USE_IDLE_FLUSH
 ////////////////////////////////////////////////////////////////////////////
-// Superpage Header Functions
+// Idle Thread Flushing Functions
 ////////////////////////////////////////////////////////////////////////////
-static sph_t* sph_alloc(tlh_t* tlh) {
-  sph_t* sph = g_free_sp_list;
-  if (sph != NULL) {
-    // Pop the whole list.
-    if (CAS_ptr(&g_free_sp_list, sph, NULL)) {
-      // Get the first one and push the remained list.
-      sph_t* next_sph = sph->next;
-      if (next_sph != NULL) {
-        if (!CAS_ptr(&g_free_sp_list, NULL, next_sph)) {
-          // FIXME: Find the last superpage.
-          sph_t* last_sph = next_sph;
-          while (last_sph->next != NULL) {
-            last_sph = last_sph->next;
-          }
+/* Another thread may flush a TLH only while its owner is not in a call.
+   The owner marks its calls in its slot with plain stores, and the flusher
+   makes them visible with membarrier(), which puts a full memory barrier
+   on every running thread of the process. So either the flusher sees the
+   owner in a call, or the owner sees the flusher and waits for it. */
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED            (1 << 3)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED   (1 << 4)
+#endif
+static void idle_init() {
+  g_idle_ok = (syscall(SYS_membarrier,
+                       MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0);
+}
 
-          // Push to the global free superpage list.
-          sph_t* cur_sph;
-          do {
-            cur_sph = g_free_sp_list;
-            last_sph->next = cur_sph;
-          } while (!CAS_ptr(&g_free_sp_list, cur_sph, next_sph));
-        }
-      }
 
-      // Decrease the length of global free superpage list.
-      assert(g_free_sp_len > 0);
-      atomic_dec_int((volatile int*)&g_free_sp_len);
-    } else {
-      // CAS failed.
-      sph = NULL;
-    }
+static bool idle_barrier() {
+  if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0) {
+    return true;
   }
+  // The registration may be lost in a child after fork().
+  return syscall(SYS_membarrier,
+                 MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0 &&
+         syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0;
+}
 
-  if (sph == NULL) {
-    void* mem = do_mmap(SUPERPAGE_SIZE + SPH_SIZE);
-    sph = (sph_t*)mem;
-    sph->start_page = (size_t)(mem + SPH_SIZE) >> PAGE_SHIFT;
 
-    // Expand pagemap.
-    pagemap_expand(sph->start_page, SUPERPAGE_LEN);
+static void idle_register(tlh_t* tlh) {
+  idle_slot_t* slot = NULL;
+
+  // Reuse a slot of an exited thread.
+  for (idle_slot_t* s = g_idle_list; s != NULL; s = s->next) {
+    if (s->active) continue;
+    if (atomic_xchg_uint(&s->active, 1)) continue;
+    slot = s;
+    break;
   }
 
-  // Set the owner of superpage.
-  sph->omark.owner_id = tlh->thread_id;
+  if (slot == NULL) {
+    // Allocate a new page and split it.
+    idle_slot_t* first = (idle_slot_t*)do_mmap(PAGE_SIZE);
+    uint32_t num = PAGE_SIZE / sizeof(idle_slot_t);
+    for (uint32_t i = 0; i < num - 1; i++) {
+      first[i].next = &first[i + 1];
+    }
+    first->active = 1;
 
-  // Prepend the new superpage to the superpage list.
-  sph_list_prepend(&tlh->sp_list, sph);
+    idle_slot_t* top;
+    do {
+      top = g_idle_list;
+      first[num - 1].next = top;
+    } while (!CAS_ptr(&g_idle_list, top, first));
+    slot = first;
+  }
 
-  return sph;
+  // A flusher that has read the slot before sees that calls changed.
+  slot->tlh = tlh;
+  slot->calls++;
+  l_idle = slot;
 }
 
 
-static void sph_free(tlh_t* tlh, sph_t* sph) {
-  // Remove the superpage form the Superpage List.
-  sph_list_remove(&tlh->sp_list, sph);
-
-  // Update pagemap.
-  pagemap_set_range(sph->start_page, SUPERPAGE_LEN, NULL);
+/* Called at the end of sf_malloc_thread_exit() instead of idle_leave(). */
+static void idle_unregister() {
+  idle_slot_t* slot = l_idle;
+  slot->tlh = NULL;
+  slot->depth--;
+  l_idle = NULL;
+  __sync_lock_release(&slot->active);
+}
 
-  // Check the hazard_mark.
-  bool hazardous = false;
-  if (sph->hazard_mark) {
-    if (scan_hazard_pointers(sph)) {
-      hazardous = true;
-    } else {
-      sph->hazard_mark = false;
-    }
-  }
 
-  if (hazardous || g_free_sp_len < FREE_SP_LIST_THRESHOLD) {
-    atomic_inc_uint(&g_free_sp_len);
+static inline void idle_enter() {
+  idle_slot_t* slot = l_idle;
+  if (slot == NULL) return;
 
-    // Push to the global Free Superpage List.
-    sph_t* cur_sph;
-    do {
-      cur_sph = g_free_sp_list;
-      sph->next = cur_sph;
-    } while (!CAS_ptr(&g_free_sp_list, cur_sph, sph));
-  } else {
-    // Return the memory to the OS.
-    do_munmap(sph, SUPERPAGE_SIZE + SPH_SIZE);
-  }
+  slot->calls++;
+  slot->depth++;
+  __asm__ __volatile__ ("" ::: "memory");
+  if (UNLIKELY(slot->flushing)) idle_wait(slot);
 }
 
 
-static void sph_get_remote_pbs(sph_t* sph) {
-  void* remote_pb;
-  do {
-    remote_pb = sph->remote_pb_list;
-  } while (!CAS_ptr(&sph->remote_pb_list, remote_pb, NULL));
-
-  do {
-    size_t page_id = (size_t)remote_pb >> PAGE_SHIFT;
-    pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
-    pbh->status = PBH_ON_FREE_LIST;
-    assert(pbh->sizeclass == NUM_CLASSES);
-    sph_coalesce_pbs(pbh);
+static inline void idle_leave() {
+  idle_slot_t* slot = l_idle;
+  if (slot == NULL) return;
 
-    remote_pb = GET_NEXT(remote_pb);
-  } while (remote_pb);
+  __asm__ __volatile__ ("" ::: "memory");
+  slot->depth--;
+  if (UNLIKELY(l_idle_scan)) idle_scan();
 }
 
 
-static void sph_coalesce_pbs(pbh_t* pbh) {
-  pbh_t* prev_pbh = (pbh_t*)pagemap_get_checked(pbh->start_page - 1);
-  assert(((uintptr_t)prev_pbh & HUGE_MALLOC_MARK) == 0);
+static void idle_wait(idle_slot_t* slot) {
+  while (slot->flushing) sched_yield();
+}
 
-  void*  next_val = pagemap_get_checked(pbh->start_page + pbh->length);
-  pbh_t* next_pbh = ((uintptr_t)next_val & HUGE_MALLOC_MARK)
-                    ? NULL : (pbh_t*)next_val;
 
-  if (prev_pbh && (prev_pbh->status == PBH_ON_FREE_LIST)) {
-    prev_pbh->length += pbh->length;
+/* Count a slow path. A scan is due after each batch of them. */
+static inline void idle_tick() {
+  if (++l_idle_ticks < IDLE_EVENT_BATCH) return;
+  l_idle_ticks = 0;
+  atomic_add_uint(&g_idle_events, IDLE_EVENT_BATCH);
+  l_idle_scan = 1;
+}
 
-    // If the coalesced length is the same as the length of superpage,
-    // we don't need to update more because superpage will be freed.
-    if (prev_pbh->length == SUPERPAGE_LEN) {
-      // Only prev_pbh is free.
-      return;
-    } else if (next_pbh && (next_pbh->status == PBH_ON_FREE_LIST)) {
-      // Both prev_pbh and next_pbh are free. Coalesce together.
-      uint32_t next_len = next_pbh->length;
 
-      prev_pbh->length += next_len;
-      if (prev_pbh->length == SUPERPAGE_LEN) return;
+/* Flush the TLHs of the threads that have been idle long enough. Called
+   outside of malloc() and free() of the calling thread. */
+static void idle_scan() {
+  l_idle_scan = 0;
+  if (!g_idle_ok || (g_idle_flush_ms == 0 && g_idle_flush_events == 0)) {
+    return;
+  }
 
-      // Update the pagemap and deallocate next_pbh.
-      pagemap_set_range(next_pbh->start_page, next_len, prev_pbh);
-      pbh_free(next_pbh);
+  uint32_t now = get_msec();
+  if ((int32_t)(now - g_idle_next_scan) < 0) return;
+  if (atomic_xchg_uint(&g_idle_scan_lock, 1)) return;
+  g_idle_next_scan = now + IDLE_SCAN_MS;
+
+  uint32_t events = g_idle_events;
+  for (idle_slot_t* s = g_idle_list; s != NULL; s = s->next) {
+    tlh_t* tlh = s->tlh;
+    uint32_t calls = s->calls;
+    if (tlh == NULL || s == l_idle) continue;
+
+    if (calls != s->seen_calls || s->depth != 0) {
+      s->seen_calls  = calls;
+      s->seen_time   = now;
+      s->seen_events = events;
+      s->flushed     = 0;
+    } else if (!s->flushed &&
+               ((g_idle_flush_ms &&
+                 now - s->seen_time >= g_idle_flush_ms) ||
+                (g_idle_flush_events &&
+                 events - s->seen_events >= g_idle_flush_events))) {
+      idle_flush(s, tlh, calls);
     }
+  }
 
-    // Update the pagemap and deallocate pbh.
-    pagemap_set_range(pbh->start_page, pbh->length, prev_pbh);
-    pbh_free(pbh);
-  } else if (next_pbh && (next_pbh->status == PBH_ON_FREE_LIST)) {
-    // Only next_pbh is free.
-    uint32_t next_len = next_pbh->length;
+  __sync_lock_release(&g_idle_scan_lock);
+}
 
-    pbh->length += next_len;
-    if (pbh->length == SUPERPAGE_LEN) return;
 
-    // Update the pagemap and deallocate next_pbh.
-    pagemap_set_range(next_pbh->start_page, next_len, pbh);
-    pbh_free(next_pbh);
+static void idle_flush(idle_slot_t* slot, tlh_t* tlh, uint32_t calls) {
+  slot->flushing = 1;
+  if (idle_barrier() && slot->calls == calls && slot->depth == 0 &&
+      slot->tlh == tlh) {
+    tlh_release(tlh);
+    hstat_inc_idle_flush();
   }
+  slot->flushed = 1;
+  __sync_lock_release(&slot->flushing);
 }
+#endif //MALLOC_USE_IDLE_FLUSH
 
 
-static bool take_superpage(tlh_t* tlh, sph_t* sph) {
-  // Try to change the ownership of superpage.
-  if (!CAS32(&sph->omark.owner_id, DEAD_OWNER, tlh->thread_id)) 
-    return false;
 
-  if (sph->remote_pb_list != NULL) {
-    sph_get_remote_pbs(sph);
+
+#ifdef MALLOC_USE_BG_THREAD
+////////////////////////////////////////////////////////////////////////////
+// Background Thread Functions
+////////////////////////////////////////////////////////////////////////////
+/* The background thread only works on the global lists. Free page blocks
+   in TLHs can be touched by their owners only, so they purge them. */
+static void bg_thread_start() {
+  g_bg_thread_stop = 0;
+  if (pthread_create(&g_bg_thread, NULL, bg_thread_main, NULL)) {
+    HANDLE_ERROR("pthread_create");
   }
+  pthread_detach(g_bg_thread);
+}
 
-  // Adopt all pbhs in the superpage.
-  pbh_t* pbh = GET_FIRST_PBH(sph);
-  uint32_t total_len = 0;
-  while (total_len < SUPERPAGE_LEN) {
-    uint32_t len = pbh->length;
-    assert(len > 0);
-    assert(pbh->index == (total_len + 1));
 
-    if (pbh->status == PBH_ON_FREE_LIST) {
-      pbh_list_prepend(&tlh->free_pb_list[len-1], pbh);
-    } else if (pbh->sizeclass < NUM_CLASSES) {
-      uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
-      if (count == get_blocks_for_class(pbh->sizeclass)) {
-        // PBH became totally free.
-        pbh_field_init(pbh);
-        pbh_list_prepend(&tlh->free_pb_list[len-1], pbh);
-      } else {
-        blk_list_t* b_list = &tlh->blk_list[pbh->sizeclass];
-        pbh_list_prepend(&b_list->pbh_list, pbh);
-      }
+static void* bg_thread_main(void* arg) {
+  // The pthread_create() wrapper may have initialized the TLH already.
+  if (l_tlh.thread_id == DEAD_OWNER) sf_malloc_thread_init();
+
+  while (!g_bg_thread_stop) {
+    struct timespec ts;
+    ts.tv_sec  = g_bg_interval / 1000;
+    ts.tv_nsec = (g_bg_interval % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+    inc_cnt_bg_wakeup();
+
+    HEAP_LOCK();
+    bg_reclaim_orphans();
+    HEAP_UNLOCK();
+    exit_heap_tick();
+#ifdef MALLOC_USE_IDLE_FLUSH
+    idle_scan();
+#endif
+    if (g_free_sp_len > FREE_SP_LIST_THRESHOLD) {
+      sp_list_trim(FREE_SP_LIST_THRESHOLD);
     }
+#ifdef MALLOC_USE_DECAY_PURGE
+    if (g_purge) sp_list_purge(get_msec(), g_purge_decay);
+#endif
+    prof_dump_requested();
 
-    // next pbh
-    total_len += len;
-    pbh = pbh + len;
+#ifdef MALLOC_STATS
+    g_bg_stat = l_stat;
+#endif
   }
-  assert(total_len == SUPERPAGE_LEN);
 
-  // Prepend the adopted superpage to the superpage list.
-  sph_list_prepend(&tlh->sp_list, sph);
-
-  return true;
+  return NULL;
 }
 
 
-static void finish_superpages(tlh_t* tlh) {
-  sph_t** sp_list = &tlh->sp_list;
-
-  ownermark_t live_mark, dead_mark;
-  live_mark.owner_id    = (*sp_list)->omark.owner_id;
-  live_mark.finish_mark = NONE;
-  dead_mark.owner_id    = DEAD_OWNER;
-  dead_mark.finish_mark = NONE;
-
+/* Free orphaned superpages whose blocks have all been freed. */
+static void bg_reclaim_orphans() {
+  // Pop the whole Orphan List. Only the background thread pops it.
+  sph_t* list;
   do {
-    sph_t* sph = sph_list_pop(sp_list);
-    assert(sph->omark.owner_id == live_mark.owner_id);
+    list = g_orphan_sp_list;
+    if (list == NULL) return;
+  } while (!cas_stat(CAS_ORPHAN_LIST, CAS_ptr(&g_orphan_sp_list, list, NULL)));
+
+  tlh_t* tlh = CUR_TLH();
+  uint32_t bg_id = tlh->thread_id;
+  sph_t* keep_first = NULL;
+  sph_t* keep_last  = NULL;
+
+  sph_t* sph = list;
+  while (sph != NULL) {
+    sph_t* next_sph = sph->orphan_next;
+
+    if (cas_stat(CAS_OWNER_MARK,
+                 CAS32(&sph->omark.owner_id, DEAD_OWNER, bg_id))) {
+      // We own it. If it still has live blocks, it is listed again.
+      sph->orphan_mark = ORPHAN_NONE;
+#ifdef MALLOC_USE_REMOTE_INBOX
+      sph_set_inbox(tlh, sph, INBOX_FINISH);
+#endif
+      if (finish_superpage(tlh, sph)) {
+        inc_cnt_orphan_free();
+      }
+    } else if (!CAS32(&sph->orphan_mark, ORPHAN_LISTED, ORPHAN_NONE)) {
+      // It was adopted and orphaned again while we were holding it.
+      sph->orphan_mark = ORPHAN_LISTED;
+      sph->orphan_next = NULL;
+      if (keep_last) keep_last->orphan_next = sph;
+      else keep_first = sph;
+      keep_last = sph;
+    }
 
-    while (true) {
-      sph->omark.finish_mark = NONE;
+    sph = next_sph;
+  }
 
-      // Try to clean up the superpage.
-      if (try_to_free_superpage(sph)) {
-        break;
-      }
+  if (keep_first == NULL) return;
 
-      // If the superpage was not freed, make it dead.
-      if (CAS64((uint64_t*)&sph->omark, live_mark.with, dead_mark.with)) {
-        LOG_D("[T%u] DEAD SUPERPAGE\n", tlh->thread_id);
-        break;
-      }
-    } //end while
-  } while (*sp_list != NULL);
+  sph_t* top;
+  do {
+    top = g_orphan_sp_list;
+    keep_last->orphan_next = top;
+  } while (!cas_stat(CAS_ORPHAN_LIST,
+                    CAS_ptr(&g_orphan_sp_list, top, keep_first)));
 }
 
 
-static bool try_to_free_superpage(sph_t* sph) {
-  if (sph->remote_pb_list != NULL) {
-    sph_get_remote_pbs(sph);
+/* Link the superpage that is about to become dead to the Orphan List.
+   orphan_mark keeps it mapped until the background thread unlinks it. */
+static void orphan_list_push(sph_t* sph) {
+  while (true) {
+    uint32_t mark = sph->orphan_mark;
+    if (mark == ORPHAN_RELISTED) return;
+    if (mark == ORPHAN_LISTED) {
+      // Already linked. Tell the background thread to keep it linked.
+      if (CAS32(&sph->orphan_mark, ORPHAN_LISTED, ORPHAN_RELISTED)) return;
+    } else if (CAS32(&sph->orphan_mark, ORPHAN_NONE, ORPHAN_LISTED)) {
+      break;
+    }
   }
 
-  pbh_t* pbh = GET_FIRST_PBH(sph);
-  pbh_t* prev_pbh = NULL;
-
-  uint32_t cnt_inuse = 0;
-  uint32_t total_len = 0;
-  while (total_len < SUPERPAGE_LEN) {
-    uint32_t len = pbh->length;
-    assert(len > 0);
-
-    total_len += len;
+  sph_t* top;
+  do {
+    top = g_orphan_sp_list;
+    sph->orphan_next = top;
+  } while (!cas_stat(CAS_ORPHAN_LIST, CAS_ptr(&g_orphan_sp_list, top, sph)));
+}
+#endif //MALLOC_USE_BG_THREAD
 
-    if (pbh->status != PBH_ON_FREE_LIST && pbh->sizeclass < NUM_CLASSES) {
-      uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
-      if (count == get_blocks_for_class(pbh->sizeclass)) {
-        // PBH became totally free.
-        pbh_field_init(pbh);
 
-        // Try coalescing.
-        pbh_t* next_pbh = (total_len < SUPERPAGE_LEN) ? (pbh + len) : NULL;
-        if (prev_pbh && prev_pbh->status == PBH_ON_FREE_LIST) {
-          pagemap_set_range(pbh->start_page, len, prev_pbh);
-          pbh_free(pbh);
 
-          prev_pbh->length += len;
-          if (next_pbh && next_pbh->status == PBH_ON_FREE_LIST) {
-            uint32_t next_len = next_pbh->length;
-            prev_pbh->length += next_len;
-            pagemap_set_range(next_pbh->start_page, next_len, prev_pbh);
-            pbh_free(next_pbh);
+////////////////////////////////////////////////////////////////////////////
+// SizeMap Functions
+////////////////////////////////////////////////////////////////////////////
+/* Initialize the mapping arrays */
+static void sizemap_init() {
+  const uint8_t class_array[CLASS_ARRAY_SIZE] = {
+    0,  0,  1,  2,  2,  3,  3,  4,  4,  5, 
+    5,  6,  6,  7,  7,  8,  8,  9,  9, 10, 
+    10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 
+    15, 16, 16, 17, 17, 17, 17, 18, 18, 18, 
+    18, 19, 19, 19, 19, 20, 20, 20, 20, 21, 
+    21, 21, 21, 21, 21, 21, 21, 22, 22, 22, 
+    22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 
+    23, 23, 23, 24, 24, 24, 24, 24, 24, 24, 
+    24, 25, 25, 25, 25, 25, 25, 25, 25, 26, 
+    26, 26, 26, 26, 26, 26, 26, 27, 27, 27, 
+    27, 27, 27, 27, 27, 28, 28, 28, 28, 28, 
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 29, 
+    30, 31, 32, 33, 34, 34, 34, 35, 35, 36, 
+    36, 37, 37, 37, 37, 38, 38, 39, 39, 39, 
+    39, 39, 39, 40, 40, 41, 41, 42, 42, 42, 
+    42, 43, 43, 43, 43, 43, 43, 43, 43, 44, 
+    44, 44, 44, 45, 45, 46, 46, 46, 46, 46, 
+    46, 46, 46, 46, 46, 47, 47, 47, 47, 48, 
+    48, 48, 48, 48, 48, 48, 48, 48, 48, 48, 
+    48, 49, 49, 50, 50, 50, 50, 50, 50, 50, 
+    50, 50, 50, 50, 50, 50, 50, 51, 51, 51, 
+    51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 
+    51, 52, 52, 52, 52, 52, 52, 52, 52, 52, 
+    52, 52, 52, 52, 52, 52, 52, 52, 52, 53, 
+    53, 53, 53, 53, 53, 53, 53, 53, 53, 54, 
+    54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 
+    54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 
+    54, 55, 55, 55, 55, 55, 55, 56, 56, 56, 
+    56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 
+    56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 
+    56, 56, 56, 57, 57, 58, 58, 58, 58, 58, 
+    58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 
+    58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 
+    58, 58, 58, 58, 58, 59, 59, 59, 59, 59, 
+    59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 
+    59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 
+    59, 59, 59, 59, 59, 59, 59
+  };
 
-            total_len += next_len;
-            pbh = next_pbh + next_len;
-          } else {
-            pbh = pbh + len;
-          }
-          
-          continue;
-        } else if (next_pbh && next_pbh->status == PBH_ON_FREE_LIST) {
-          uint32_t next_len = next_pbh->length;
-          pbh->length += next_len;
-          pagemap_set_range(next_pbh->start_page, next_len, pbh);
-          pbh_free(next_pbh);
+  const uint32_t class_to_size[NUM_CLASSES] = {
+        8,    16,    32,    48,    64,    80,    96,   112,   128,   144, 
+      160,   176,   192,   208,   224,   240,   256,   288,   320,   352, 
+      384,   448,   512,   576,   640,   704,   768,   832,  1024,  1152, 
+     1280,  1408,  1536,  1664,  2048,  2304,  2560,  3072,  3328,  4096, 
+     4352,  4608,  5120,  6144,  6656,  6912,  8192,  8704, 10240, 10496, 
+    12288, 14080, 16384, 17664, 20480, 21248, 24576, 24832, 28672, 32768
+  };
 
-          total_len += next_len;
-          prev_pbh = pbh;
-          pbh = next_pbh + next_len;
+  const uint16_t class_to_pages[NUM_CLASSES] = {
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1, 
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1, 
+    1,  1,  1,  1,  1,  2,  1,  2,  1,  2, 
+    1,  3,  2,  3,  1,  3,  2,  3,  5,  1, 
+    6,  5,  4,  3,  5,  7,  2,  7,  5,  8, 
+    3,  7,  4,  9,  5, 11,  6, 13,  7,  8
+  };
 
-          continue;
-        }
-      } else {
-        cnt_inuse++;
-      }
-    }
+  const uint16_t num_blocks_per_pbh[NUM_CLASSES] = {
+    512, 256, 128,  85,  64,  51,  42,  36,  32,  28, 
+     25,  23,  21,  19,  18,  17,  16,  14,  12,  11, 
+     10,   9,   8,   7,   6,  11,   5,   9,   4,   7, 
+      3,   8,   5,   7,   2,   5,   3,   4,   6,   1, 
+      5,   4,   3,   2,   3,   4,   1,   3,   2,   3, 
+      1,   2,   1,   2,   1,   2,   1,   2,   1,   1
+  };
 
-    // next pbh
-    prev_pbh = pbh;
-    pbh = pbh + len;
+  memcpy(g_sizemap.class_array, class_array,
+         sizeof(uint8_t) * CLASS_ARRAY_SIZE);
+  for (int i = 0; i < NUM_CLASSES; ++i) {
+    g_sizemap.info[i].class_to_size = class_to_size[i];
+    g_sizemap.info[i].class_to_pages = class_to_pages[i];
+    g_sizemap.info[i].num_blocks_per_pbh = num_blocks_per_pbh[i];
   }
-  assert(total_len == SUPERPAGE_LEN);
-
-  if (cnt_inuse == 0) {
-    // Superpage became totall free.
-    LOG_D("[T%u] EMPTY: %p\n", TID(), sph);
-    sph->hazard_mark = true;
-
-    // Link the superpage to g_free_sp_list
-    atomic_inc_uint(&g_free_sp_len);
-    sph_t* global_list;
-    do {
-      global_list = g_free_sp_list;
-      sph->next = global_list;
-    } while (!CAS_ptr(&g_free_sp_list, global_list, sph));
 
-    // Update pagemap.
-    pagemap_set_range(sph->start_page, SUPERPAGE_LEN, NULL);
+#ifdef MALLOC_DEBUG_DETAIL
+  print_sizemap();
+#endif
+}
 
-    return true;
+static inline uint32_t get_logfloor(uint32_t n) {
+  uint32_t log = 0;
+  for (int32_t i = 4; i >= 0; --i) {
+    uint32_t shift = 1 << i;
+    uint32_t x = n >> shift;
+    if (x != 0) {
+      n = x;
+      log += shift;
+    }
   }
-
-  return false;
+  assert(n == 1);
+  return log;
 }
 
-
-static inline void sph_link_init(sph_t* sph) {
-  sph->next = sph;
-  sph->prev = sph;
+/* Compute index of the class_array[] entry for a given size */
+static inline uint32_t get_classindex(uint32_t s) {
+  const bool big = (s > MAX_SMALL_SIZE);
+  const uint32_t add_amount   = big ? (127 + (120 << 7)) : 7;
+  const uint32_t shift_amount = big ? 7 : 3;
+  return (s + add_amount) >> shift_amount;
 }
 
+static inline uint32_t get_sizeclass(uint32_t size) {
+  return g_sizemap.class_array[get_classindex(size)];
+}
 
-static inline void sph_list_prepend(sph_t** list, sph_t* sph) {
-  if (*list != NULL) {
-    sph_t* top = *list;
-    sph->next = top;
-    sph->prev = top->prev;
-    top->prev->next = sph;
-    top->prev = sph;
-  } else {
-    sph_link_init(sph);
-  }
-  *list = sph;
+/* Get the byte-size for a specified class */
+static inline uint32_t get_size_for_class(uint32_t cl) {
+  return g_sizemap.info[cl].class_to_size;
 }
 
+static inline uint32_t get_pages_for_class(uint32_t cl) {
+  return g_sizemap.info[cl].class_to_pages;
+}
 
-static inline sph_t* sph_list_pop(sph_t** list) {
-  assert(*list != NULL);
+static inline uint32_t get_blocks_for_class(uint32_t cl) {
+  return g_sizemap.info[cl].num_blocks_per_pbh;
+}
 
-  sph_t* sph = *list;
-  *list = (sph != sph->next) ? sph->next : NULL;
+static uint32_t get_alignment(uint32_t size) {
+  int alignment = ALIGNMENT;
+  if (size > MAX_SIZE) {
+    alignment = PAGE_SIZE;
+  } else if (size >= 2048) {
+    // Cap alignment at 256 for large sizes.
+    alignment = 256;
+  } else if (size >= 128) {
+    // Space wasted due to alignment is at most 1/8, i.e., 12.5%.
+    alignment = (1 << get_logfloor(size)) / 8;
+  } else if (size >= 16) {
+    // We need an alignment of at least 16 bytes to satisfy
+    // requirements for some SSE types.
+    alignment = 16;
+  }
 
-  // Remove the superpage from the list.
-  sph->prev->next = sph->next;
-  sph->next->prev = sph->prev;
-  sph_link_init(sph);
+  assert(size < 16 || alignment >= 16);
+  assert((alignment & (alignment - 1)) == 0);
 
-  return sph;
+  return alignment;
 }
 
 
-static inline void sph_list_remove(sph_t** list, sph_t* sph) {
-  if (sph == sph->next) {
-    assert(*list == sph);
-    *list = NULL;
-  } else {
-    if (*list == sph) *list = sph->next;
-    sph->prev->next = sph->next;
-    sph->next->prev = sph->prev;
-    sph_link_init(sph);
-  }
+////////////////////////////////////////////////////////////////////////////
+// PageMap Functions
+////////////////////////////////////////////////////////////////////////////
+static void pagemap_init() {
+#ifdef MALLOC_USE_ARENA
+  arena_init();
+#endif
 }
 
 
+static void pagemap_expand(size_t page_id, size_t n) {
+#ifdef MALLOC_USE_ARENA
+  // A superpage does not cross the bounds of the arena.
+  if (arena_has_page(page_id)) return;
+#endif
+  for (size_t key = page_id; key < page_id + n; ) {
+    const size_t i1 = key >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
+    const size_t i2 = (key >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
+    assert(i1 < PMAP_INTERIOR_LEN && i2 < PMAP_INTERIOR_LEN);
 
-////////////////////////////////////////////////////////////////////////////
-// Hazard Pointer List Functions
-////////////////////////////////////////////////////////////////////////////
-static hazard_ptr_t* hazard_ptr_alloc() {
-  // Allocate from the current list.
-  if (g_hazard_ptr_free_num > 0) {
-    for (hazard_ptr_t* hp = g_hazard_ptr_list; hp != NULL; hp = hp->next) {
-      if (hp->active) continue;
-      if (atomic_xchg_uint(&hp->active, 1)) continue;
-      atomic_dec_int((int32_t*)&g_hazard_ptr_free_num);
-      return hp;
+    // Make 2nd level node if necessary
+    if (g_pagemap.node[i1] == NULL) {
+      size_t node_size = sizeof(pagemap_node_t);
+      pagemap_node_t* new_node = (pagemap_node_t*)do_mmap(node_size);
+      if (!CAS_ptr(&g_pagemap.node[i1], NULL, new_node)) {
+        do_munmap(new_node, node_size);
+      }
     }
-  }
 
-  // Allocate a new page and split it.
-  hazard_ptr_t* first_hptr = (hazard_ptr_t*)do_mmap(PAGE_SIZE);
-  first_hptr->active = 1;
-
-  uint32_t rem_len = (PAGE_SIZE / sizeof(hazard_ptr_t)) - 1;
+    // Make leaf node if necessary
+    pagemap_node_t* interior = g_pagemap.node[i1];
+    if (interior->leaf[i2] == NULL) {
+      size_t leaf_size = sizeof(pagemap_leaf_t);
+      pagemap_leaf_t* new_leaf = (pagemap_leaf_t*)do_mmap(leaf_size);
+      if (!CAS_ptr(&interior->leaf[i2], NULL, new_leaf)) {
+        do_munmap(new_leaf, leaf_size);
+      }
+    }
 
-  hazard_ptr_t* last_hptr = first_hptr;
-  for (uint32_t i = 0; i < rem_len; i++) {
-    hazard_ptr_t* next_hptr = last_hptr + 1;
-    last_hptr->next = next_hptr;
-    last_hptr = next_hptr;
+    // Advance key past whatever is covered by this leaf node
+    key = ((key >> PMAP_LEAF_BIT) + 1) << PMAP_LEAF_BIT;
   }
+}
 
-  hazard_ptr_t* top;
-  do {
-    top = g_hazard_ptr_list;
-    last_hptr->next = top;
-  } while (!CAS_ptr(&g_hazard_ptr_list, top, first_hptr));
-  atomic_add_uint(&g_hazard_ptr_free_num, rem_len);
 
-  return first_hptr;
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+/* Return the leaf of tag if the thread has it cached, or NULL. */
+static inline pagemap_leaf_t* pagemap_cache_find(size_t tag) {
+  const uint32_t w = tag & (PMAP_CACHE_LEN - 1);
+  if (LIKELY(l_pagemap_cache.tag[w] == tag + 1)) {
+    hstat_inc_pmap_cache_hit();
+    return l_pagemap_cache.leaf[w];
+  }
+  hstat_inc_pmap_cache_miss();
+  return NULL;
 }
 
 
-static void hazard_ptr_free(hazard_ptr_t* hptr) {
-  hptr->active = 0;
-  atomic_inc_uint(&g_hazard_ptr_free_num);
+/* Cache the leaf of tag in place of the one with the same low tag bits. */
+static inline void pagemap_cache_insert(size_t tag, pagemap_leaf_t* leaf) {
+  const uint32_t w = tag & (PMAP_CACHE_LEN - 1);
+  l_pagemap_cache.tag[w]  = tag + 1;
+  l_pagemap_cache.leaf[w] = leaf;
 }
 
 
-static bool scan_hazard_pointers(sph_t* sph) {
-  for (hazard_ptr_t* hp = g_hazard_ptr_list; hp != NULL; hp = hp->next) {
-    if (hp->node == sph) return true;
+/* Return the leaf of tag, which should exist. */
+static inline pagemap_leaf_t* pagemap_leaf(size_t tag) {
+  pagemap_leaf_t* leaf = pagemap_cache_find(tag);
+  if (UNLIKELY(leaf == NULL)) {
+    const size_t i1 = tag >> PMAP_INTERIOR_BIT;
+    const size_t i2 = tag & (PMAP_INTERIOR_LEN - 1);
+    leaf = g_pagemap.node[i1]->leaf[i2];
+    pagemap_cache_insert(tag, leaf);
   }
-  return false;
+  return leaf;
 }
+#endif
 
 
+static inline void* pagemap_get(size_t page_id) {
+#ifdef MALLOC_USE_ARENA
+  if (LIKELY(arena_has_page(page_id))) return arena_map_get(page_id);
+#endif
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
+  assert((page_id >> PMAP_BITS) == 0);
+  return pagemap_leaf(page_id >> PMAP_LEAF_BIT)->val[i3];
+#else
+  const size_t i1 = page_id >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
+  const size_t i2 = (page_id >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
+  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
+  assert((page_id >> PMAP_BITS) == 0);
+  assert(g_pagemap.node[i1] != NULL);
+  assert(g_pagemap.node[i1]->leaf[i2] != NULL);
+  return g_pagemap.node[i1]->leaf[i2]->val[i3];
+#endif
+}
 
-////////////////////////////////////////////////////////////////////////////
-// PBH Functions
-////////////////////////////////////////////////////////////////////////////
-/* Allocate a new pbh from the superpage. */
-static inline pbh_t* pbh_alloc(sph_t* sph, size_t page_id, size_t len) {
-  uint32_t pbh_idx = page_id - sph->start_page + 1;
-  assert(pbh_idx > 0 && pbh_idx <= SUPERPAGE_LEN);
 
-  pbh_t* new_pbh = (pbh_t*)sph + pbh_idx;
-  memset((void*)new_pbh, 0, sizeof(pbh_t));
-  new_pbh->start_page = page_id;
-  new_pbh->length     = len;
-  new_pbh->index      = pbh_idx;
+static inline void* pagemap_get_checked(size_t page_id) {
+#ifdef MALLOC_USE_ARENA
+  if (arena_has_page(page_id)) return arena_map_get(page_id);
+#endif
+  const size_t i1 = page_id >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
+  const size_t i2 = (page_id >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
+  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
+  if ((page_id >> PMAP_BITS) > 0) return NULL;
 
-  return new_pbh;
-}
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+  const size_t tag = page_id >> PMAP_LEAF_BIT;
+  pagemap_leaf_t* leaf = pagemap_cache_find(tag);
+  if (leaf != NULL) return leaf->val[i3];
+#endif
 
+  if ((g_pagemap.node[i1] == NULL) ||
+      (g_pagemap.node[i1]->leaf[i2] == NULL)) return NULL;
 
-/* Deallocate the pbh. */
-static inline void pbh_free(pbh_t* pbh) {
-  // Do nothing...
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+  pagemap_cache_insert(tag, g_pagemap.node[i1]->leaf[i2]);
+#endif
+  return g_pagemap.node[i1]->leaf[i2]->val[i3];
 }
 
 
-static inline void pbh_add_blocks(tlh_t* tlh, pbh_t* pbh,
-                                 void* start_blk, void* end_blk, uint32_t N) {
-  sph_t* sph = pbh_get_superpage(pbh);
-  if (UNLIKELY(sph->omark.owner_id != tlh->thread_id)) {
-    // Try to free blocks to the owner.
-    if (remote_free(tlh, pbh, start_blk, end_blk, N))
-      return;
+static inline void pagemap_set(size_t page_id, void* val) {
+#ifdef MALLOC_USE_ARENA
+  if (LIKELY(arena_has_page(page_id))) {
+    arena_map_set(page_id, val);
+    return;
   }
+#endif
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
+  assert((page_id >> PMAP_BITS) == 0);
+  pagemap_leaf(page_id >> PMAP_LEAF_BIT)->val[i3] = val;
+#else
+  assert(page_id >> PMAP_BITS == 0);
+  const size_t i1 = page_id >> (PMAP_LEAF_BIT + PMAP_INTERIOR_BIT);
+  const size_t i2 = (page_id >> PMAP_LEAF_BIT) & (PMAP_INTERIOR_LEN - 1);
+  const size_t i3 = page_id & (PMAP_LEAF_LEN - 1);
+  g_pagemap.node[i1]->leaf[i2]->val[i3] = val;
+#endif
+}
 
-  // Return to the local pbh.
-  uint32_t cl = pbh->sizeclass;
-  blk_list_t* b_list = &tlh->blk_list[cl];
 
-  uint32_t cnt_ref = get_blocks_for_class(cl) - 
-                     (pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt);
-  if (cnt_ref == N) {
-    // PBH becomes totally free.
-    pbh_list_remove(&b_list->pbh_list, pbh);
-    pb_free(tlh, pbh);
-  } else {
-    // Move this pbh to the first of pbh list.
-    if (b_list->pbh_list != pbh) {
-      pbh_list_move_to_first(&b_list->pbh_list, pbh);
+static inline void pagemap_set_range(size_t start, size_t len, void* val) {
+#ifdef MALLOC_USE_ARENA
+  if (LIKELY(arena_has_page(start))) {
+    arena_map_set(start, val);
+    uint16_t* map = &g_arena_map[start - g_arena_start_page];
+    for (size_t i = 1; i < len; i++) map[i] = map[0];
+    return;
+  }
+#endif
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+  // Look up each leaf in the range once.
+  const size_t end = start + len;
+  for (size_t page_id = start; page_id < end; ) {
+    const size_t tag = page_id >> PMAP_LEAF_BIT;
+    const size_t leaf_end = MIN(end, (tag + 1) << PMAP_LEAF_BIT);
+    pagemap_leaf_t* leaf = pagemap_leaf(tag);
+    for (; page_id < leaf_end; page_id++) {
+      leaf->val[page_id & (PMAP_LEAF_LEN - 1)] = val;
     }
-
-    // Prepend to the the free list of pbh.
-    SET_NEXT(end_blk, pbh->free_list);
-    pbh->free_list = start_blk;
-    pbh->cnt_free += N;
   }
+#else
+  for (size_t page_id = start; page_id < (start + len); page_id++) {
+    pagemap_set(page_id, val);
+  }
+#endif
 }
 
 
-static void pbh_add_unused(tlh_t* tlh, pbh_t* pbh, void* unused, uint32_t N) {
-  uint32_t cl = pbh->sizeclass;
-  blk_list_t* b_list = &tlh->blk_list[cl];
-
-  uint32_t cnt_ref = get_blocks_for_class(cl) - 
-                     (pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt);
-  if (cnt_ref == N) {
-    // PBH becomes totally free.
-    pbh_list_remove(&b_list->pbh_list, pbh);
-    pb_free(tlh, pbh);
-  } else {
-    // Move this pbh to the first of pbh list.
-    if (b_list->pbh_list != pbh) {
-      pbh_list_move_to_first(&b_list->pbh_list, pbh);
-    }
+#ifdef MALLOC_USE_ARENA
+////////////////////////////////////////////////////////////////////////////
+// Superpage Arena Functions
+////////////////////////////////////////////////////////////////////////////
+/* Reserve the arena and its page index. Without them, superpages are
+   mapped one by one and kept in the radix pagemap. */
+static void arena_init() {
+  if (!g_arena) return;
+
+  int flags = MMAP_FLAGS | MAP_NORESERVE;
+  size_t size = ARENA_SIZE + SUPERPAGE_MAP_SIZE;
+  void* mem = mmap(0, size, MMAP_PROT, flags, -1, 0);
+  if (mem == MAP_FAILED) return;
+
+  // The page index is followed by the stack of released superpages.
+  size_t map_size = (ARENA_SIZE >> PAGE_SHIFT) * sizeof(uint16_t) +
+                    ARENA_SUPERPAGES * sizeof(uint32_t);
+  void* map = mmap(0, map_size, MMAP_PROT, flags, -1, 0);
+  if (map == MAP_FAILED) {
+    munmap(mem, size);
+    return;
+  }
 
-    // Add the unallocateed chunk to pbh.
-    if (pbh->cnt_unused == 0) {
-      pbh->unallocated = unused;
-      pbh->cnt_unused  = N;
-      return;
-    } 
+  // Align the arena to the superpage size and unmap the rest.
+  uintptr_t start = (uintptr_t)mem;
+  uintptr_t base = (start + SUPERPAGE_MAP_SIZE - 1) &
+                   ~(uintptr_t)(SUPERPAGE_MAP_SIZE - 1);
+  size_t head = base - start;
+  if (head > 0) munmap(mem, head);
+  munmap((void*)(base + ARENA_SIZE), SUPERPAGE_MAP_SIZE - head);
+
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+  // THP may be enabled only for madvised regions. Ignore the failure.
+  if (g_use_thp) madvise((void*)base, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
 
-    // PBH already has a unallocated chunk. This may be due to block coloring.
-    // We split the smaller chunk between two unallocated chunks.
-    void* start_blk;
-    void* end_blk;
-    uint32_t block_num, blk_size;
-    if (pbh->cnt_unused < N) {
-      start_blk = pbh->unallocated;
-      block_num = pbh->cnt_unused;
+  g_arena_base = base;
+  g_arena_map = (uint16_t*)map;
+  g_arena_free = (uint32_t*)(g_arena_map + (ARENA_SIZE >> PAGE_SHIFT));
+  g_arena_start_page = base >> PAGE_SHIFT;
+  g_arena_pages = ARENA_SIZE >> PAGE_SHIFT;
+}
 
-      pbh->unallocated  = unused;
-      pbh->cnt_unused = N;
-    } else {
-      start_blk = unused;
-      block_num = N;
-    }
 
-    // Split and prepend split blocks to the free list of pbh.
-    end_blk  = start_blk;
-    blk_size = get_size_for_class(cl);
-    for (uint32_t i = 1; i < block_num; i++) {
-      void* next_blk = end_blk + blk_size;
-      SET_NEXT(end_blk, next_blk);
-      end_blk = next_blk;
-    }
-    SET_NEXT(end_blk, pbh->free_list);
-    pbh->free_list = start_blk;
-    pbh->cnt_free += block_num;
-  }
+static inline bool arena_has_page(size_t page_id) {
+  return (page_id - g_arena_start_page) < g_arena_pages;
 }
 
 
-static inline sph_t* pbh_get_superpage(pbh_t* pbh) {
-  assert(pbh->index > 0 && pbh->index <= SUPERPAGE_LEN);
-  return (sph_t*)(pbh - pbh->index);
+/* The superpage of an arena page is found by masking its address, and the
+   pbh by the index kept for the page. Index 0 is the superpage header. */
+static inline void* arena_map_get(size_t page_id) {
+  uint32_t pbh_idx = g_arena_map[page_id - g_arena_start_page];
+  if (pbh_idx == 0) return NULL;
+
+  uintptr_t sph = (page_id << PAGE_SHIFT) &
+                  ~(uintptr_t)(SUPERPAGE_MAP_SIZE - 1);
+  return (pbh_t*)sph + pbh_idx;
 }
 
 
-static inline void pbh_link_init(pbh_t* pbh) {
-  pbh->next = pbh;
-  pbh->prev = pbh;
+/* val should be NULL or a pbh of the superpage of the page. */
+static inline void arena_map_set(size_t page_id, void* val) {
+  uintptr_t offset = (uintptr_t)val & (SUPERPAGE_MAP_SIZE - 1);
+  assert(val == NULL ||
+         (uintptr_t)val - offset ==
+         ((page_id << PAGE_SHIFT) & ~(uintptr_t)(SUPERPAGE_MAP_SIZE - 1)));
+  g_arena_map[page_id - g_arena_start_page] = offset / PBH_SIZE;
 }
 
 
-static inline void pbh_field_init(pbh_t* pbh) {
-  pbh->status      = PBH_ON_FREE_LIST;
-  pbh->cnt_free    = 0;
-  pbh->cnt_unused  = 0;
-  pbh->free_list   = NULL;
-  pbh->unallocated = NULL;
-  pbh->remote_list.together = 0;
-}
+/* Take a released superpage or carve a new one. Return NULL if the arena
+   is used up. */
+static sph_t* arena_alloc() {
+  if (g_arena_pages == 0) return NULL;
 
+  uint32_t idx = ARENA_SUPERPAGES;
+  if (g_arena_free_num > 0) {
+    while (atomic_xchg_uint(&g_arena_lock, 1)) __builtin_ia32_pause();
+    if (g_arena_free_num > 0) idx = g_arena_free[--g_arena_free_num];
+    __sync_lock_release(&g_arena_lock);
+  }
 
-static inline void pbh_list_prepend(pbh_t** list, pbh_t* pbh) {
-  if (*list != NULL) {
-    pbh_t* top = *list;
-    pbh->next = top;
-    pbh->prev = top->prev;
-    top->prev->next = pbh;
-    top->prev = pbh;
-  } else {
-    pbh_link_init(pbh);
+  if (idx == ARENA_SUPERPAGES) {
+    if (g_arena_next >= ARENA_SUPERPAGES) return NULL;
+    idx = atomic_inc_uint(&g_arena_next);
+    if (idx >= ARENA_SUPERPAGES) return NULL;
   }
-  *list = pbh;
+  sph_t* sph = (sph_t*)(g_arena_base + (uintptr_t)idx * SUPERPAGE_MAP_SIZE);
+
+  inc_size_mmap(SUPERPAGE_MAP_SIZE);
+  update_size_mmap_max();
+  hstat_add_size_mapped(SUPERPAGE_MAP_SIZE);
+  return sph;
 }
 
 
-static inline void pbh_list_append(pbh_t** list, pbh_t* pbh) {
-  if (*list != NULL) {
-    pbh_t* top = *list;
-    pbh->next = top;
-    pbh->prev = top->prev;
-    top->prev->next = pbh;
-    top->prev = pbh;
-  } else {
-    pbh_link_init(pbh);
-    *list = pbh;
+/* Return the pages of the superpage to the OS, header included, and keep
+   its address range for arena_alloc(). */
+static void arena_free(sph_t* sph) {
+  // Unlike MADV_FREE, the pages read as zero from now on, like new ones.
+  if (madvise(sph, SUPERPAGE_MAP_SIZE, MADV_DONTNEED) == -1) {
+    perror("arena_free");
+    CRASH("addr=%p\n", sph);
   }
-}
 
+  uint32_t idx = ((uintptr_t)sph - g_arena_base) / SUPERPAGE_MAP_SIZE;
+  while (atomic_xchg_uint(&g_arena_lock, 1)) __builtin_ia32_pause();
+  g_arena_free[g_arena_free_num++] = idx;
+  __sync_lock_release(&g_arena_lock);
 
-static inline pbh_t* pbh_list_pop(pbh_t** list) {
-  assert(*list != NULL);
+  inc_size_munmap(SUPERPAGE_MAP_SIZE);
+  hstat_add_size_mapped(-(int64_t)SUPERPAGE_MAP_SIZE);
+}
+#endif
 
-  pbh_t* pbh = *list;
-  *list = (pbh != pbh->next) ? pbh->next : NULL;
 
-  // Remove the pbh from the list.
-  pbh->prev->next = pbh->next;
-  pbh->next->prev = pbh->prev;
-  pbh_link_init(pbh);
-
-  return pbh;
-}
-
-
-static inline void pbh_list_remove(pbh_t** list, pbh_t* pbh) {
-  if (pbh == pbh->next) {
-    assert(*list == pbh);
-    *list = NULL;
-  } else {
-    if (*list == pbh) *list = pbh->next;
-    pbh->prev->next = pbh->next;
-    pbh->next->prev = pbh->prev;
-    pbh_link_init(pbh);
+/* Return the memory of a superpage to the OS. */
+static void sp_unmap(sph_t* sph) {
+#ifdef MALLOC_USE_ARENA
+  if (arena_has_page((size_t)sph >> PAGE_SHIFT)) {
+    arena_free(sph);
+    return;
   }
+#endif
+  do_munmap(sph, SUPERPAGE_MAP_SIZE);
 }
 
 
-static inline void pbh_list_move_to_first(pbh_t** list, pbh_t* pbh) {
-  assert(pbh != pbh->next);
-
-  // First remove the pbh.
-  pbh->prev->next = pbh->next;
-  pbh->next->prev = pbh->prev;
-
-  // Prepend it.
-  pbh_t* top = *list;
-  pbh->next = top;
-  pbh->prev = top->prev;
-  top->prev->next = pbh;
-  top->prev = pbh;
-
-  // Make it the first.
-  *list = pbh;
-}
-
-
-
 ////////////////////////////////////////////////////////////////////////////
-// Page Block Functions
+// Superpage Header Functions
 ////////////////////////////////////////////////////////////////////////////
-/* Page block is allocated from Free Page Block List, global Free Superpage
-   List, or the OS. */
-static pbh_t* pb_alloc(tlh_t* tlh, size_t page_len) {
-  assert(page_len > 0 && page_len <= NUM_PAGE_CLASSES);
+static sph_t* sph_alloc(tlh_t* tlh) {
+  lat_path(LAT_SPH_ALLOC);
 
-  // Allocate a page block from TLH.
-  pbh_t* pbh = pb_alloc_from_tlh(tlh, page_len);
-  if (pbh) return pbh;
+  // Only superpages of the local node are reused.
+  uint32_t node = tlh->numa_node;
+  sph_t* sph = g_free_sp_list[node];
+  if (sph != NULL) {
+    // Pop the whole list.
+    if (cas_stat(CAS_FREE_SP_LIST,
+                 CAS_ptr(&g_free_sp_list[node], sph, NULL))) {
+      // Get the first one and push the remained list.
+      sph_t* next_sph = sph->next;
+      if (next_sph != NULL) {
+        if (!cas_stat(CAS_FREE_SP_LIST,
+                      CAS_ptr(&g_free_sp_list[node], NULL, next_sph))) {
+          // FIXME: Find the last superpage.
+          sph_t* last_sph = next_sph;
+          while (last_sph->next != NULL) {
+            last_sph = last_sph->next;
+          }
 
-  // Check the Remote PB List of the first superpage in Superpage List
-  sph_t* first_sph = tlh->sp_list;
-  if (first_sph) {
-    if (first_sph->remote_pb_list) {
-      sph_get_remote_pbs(first_sph);
-      tlh->sp_list = first_sph->next;
+          // Push to the global free superpage list.
+          sp_list_push(node, next_sph, last_sph);
+        }
+      }
 
-      pbh = pb_alloc_from_tlh(tlh, page_len);
-      if (pbh) return pbh;
+      // Decrease the length of global free superpage list.
+      assert(g_free_sp_len > 0);
+      atomic_dec_int((volatile int*)&g_free_sp_len);
+    } else {
+      // CAS failed.
+      sph = NULL;
     }
   }
 
-  // Request memory from the global Free Superpage List or the OS.
-  sph_t* sph = sph_alloc(tlh);
-  size_t new_page_id = sph->start_page;
-  pbh = pbh_alloc(sph, new_page_id, page_len);
-  pbh->status = PBH_IN_USE;
-  pagemap_set_range(new_page_id, page_len, pbh);
+  if (sph == NULL) {
+    lat_path(LAT_SPH_MMAP);
+    void* mem = NULL;
+#if defined(MALLOC_USE_HUGE_SUPERPAGE) && defined(MALLOC_USE_HUGETLB)
+    if (g_use_hugetlb) {
+      mem = do_mmap_hugetlb(SUPERPAGE_MAP_SIZE, HUGE_PAGE_SHIFT);
+      if (mem != NULL) ((sph_t*)mem)->hugetlb = 1;
+    }
+#endif
+#ifdef MALLOC_USE_ARENA
+    if (mem == NULL) mem = arena_alloc();
+#endif
+    if (mem == NULL) {
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+      mem = do_mmap_aligned(SUPERPAGE_MAP_SIZE, HUGE_PAGE_SIZE);
+      // THP may be enabled only for madvised regions. Ignore the failure.
+      if (g_use_thp) madvise(mem, SUPERPAGE_MAP_SIZE, MADV_HUGEPAGE);
+#else
+      mem = do_mmap(SUPERPAGE_MAP_SIZE);
+#endif
+    }
+    sph = (sph_t*)mem;
+    sph->numa_node = node;
+#ifdef MALLOC_USE_NUMA
+    numa_bind(mem, SUPERPAGE_MAP_SIZE, node);
+#endif
 
-  // remained pages
-  assert(page_len < SUPERPAGE_LEN);
-  size_t rem_start = new_page_id + page_len;
-  size_t rem_len   = SUPERPAGE_LEN - page_len;
-  pbh_t* rem_pbh  = pbh_alloc(sph, rem_start, rem_len);
-  rem_pbh->status = PBH_ON_FREE_LIST;
-  pbh_list_prepend(&tlh->free_pb_list[rem_len-1], rem_pbh);
-  pagemap_set_range(rem_start, rem_len, rem_pbh);
+    // Expand pagemap.
+    pagemap_expand(GET_START_PAGE(sph), SUPERPAGE_LEN);
+  }
 
-  return pbh;
-}
+  // Set the owner of superpage.
+  sph->omark.owner_id = tlh->thread_id;
+#ifdef MALLOC_USE_REMOTE_INBOX
+  sph->inbox = tlh->inbox;
+#endif
+
+  // Prepend the new superpage to the superpage list.
+  sph_list_prepend(&tlh->sp_list, sph);
 
+  return sph;
+}
 
-static pbh_t* pb_alloc_from_tlh(tlh_t* tlh, size_t page_len) {
-  // Page class index is one less than page_len.
-  int32_t pcl = page_len - 1;
 
-  for (int32_t c = pcl; c < NUM_PAGE_CLASSES; c++) {
-    if (tlh->free_pb_list[c] != NULL) {
-      // Pop the first pbh.
-      pbh_t* pbh = pbh_list_pop(&tlh->free_pb_list[c]);
-      assert((pbh->length - 1) == c);
+static void sph_free(tlh_t* tlh, sph_t* sph) {
+  // Remove the superpage form the Superpage List.
+  sph_list_remove(&tlh->sp_list, sph);
 
-      // Make this pbh in-use, and if necessary, split it.
-      pbh->status = PBH_IN_USE;
-      if (c > pcl) pb_split(tlh, pbh, page_len);
+  // Update pagemap.
+  pagemap_set_range(GET_START_PAGE(sph), SUPERPAGE_LEN, NULL);
 
-      return pbh;
+#ifdef MALLOC_USE_BG_THREAD
+  // The background thread returns the excess superpages to the OS.
+  bool hazardous = true;
+#else
+  // Check the hazard_mark.
+  bool hazardous = false;
+  if (sph->hazard_mark) {
+    if (scan_hazard_pointers(sph)) {
+      hazardous = true;
+    } else {
+      sph->hazard_mark = false;
     }
   }
+#endif
 
-  return NULL;
-}
-
-
-static void pb_free(tlh_t* tlh, pbh_t* pbh) {
-  assert(pbh->length <= SUPERPAGE_LEN);
+  if (hazardous || g_free_sp_len < FREE_SP_LIST_THRESHOLD) {
+    atomic_inc_uint(&g_free_sp_len);
+    sph->free_time = FREE_TIME_NOW();
 
-  if (pbh->length < SUPERPAGE_LEN) {
-    pbh = pb_coalesce(tlh, pbh);
+    // Push to the global Free Superpage List.
+    sp_list_push(sph->numa_node, sph, sph);
+  } else {
+    // Return the memory to the OS.
+    sp_unmap(sph);
   }
+}
 
-  // If the freed pbh makes superpage totally empty, release superpage.
-  if (pbh->length == SUPERPAGE_LEN) {
-    // Release the superpage.
-    sph_free(tlh, pbh_get_superpage(pbh));
-  } else {
-    // Update the pbh status.
-    pbh_field_init(pbh);
 
-    // Insert it into the Free Page Block List.
-    pbh_list_prepend(&tlh->free_pb_list[pbh->length-1], pbh);
-  }
+/* Pop the whole Free Superpage List of node. */
+static inline sph_t* sp_list_pop_all(uint32_t node) {
+  sph_t* list;
+  do {
+    list = g_free_sp_list[node];
+    if (list == NULL) return NULL;
+  } while (!cas_stat(CAS_FREE_SP_LIST, CAS_ptr(&g_free_sp_list[node], list, NULL)));
+  return list;
 }
 
 
-static void pb_remote_free(tlh_t* tlh, void* pb, pbh_t* pbh) {
-  sph_t* sph = pbh_get_superpage(pbh);
-  tlh->hazard_ptr->node = sph;
+/* Push the chain from first to last to the Free Superpage List of node. */
+static inline void sp_list_push(uint32_t node, sph_t* first, sph_t* last) {
+  sph_t* cur_sph;
+  do {
+    cur_sph = g_free_sp_list[node];
+    last->next = cur_sph;
+  } while (!cas_stat(CAS_FREE_SP_LIST,
+                     CAS_ptr(&g_free_sp_list[node], cur_sph, first)));
+}
 
-  while (1) {
-    if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
-      if (take_superpage(tlh, sph)) {
-        tlh->hazard_ptr->node = NULL;
-        pb_free(tlh, pbh);
-        return;
-      }
-    }
 
-    void* top = sph->remote_pb_list;
-    SET_NEXT(pb, top);
-    if (CAS_ptr(&sph->remote_pb_list, top, pb)) {
-      sph->omark.finish_mark = DO_NOT_FINISH;
-      break;
-    }
-  }
+static void sph_get_remote_pbs(sph_t* sph) {
+  void* remote_pb;
+  do {
+    remote_pb = sph->remote_pb_list;
+  } while (!cas_stat(CAS_REMOTE_PB_LIST,
+                     CAS_ptr(&sph->remote_pb_list, remote_pb, NULL)));
 
-  if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
-    take_superpage(tlh, sph);
-  }
-  tlh->hazard_ptr->node = NULL;
+  do {
+    size_t page_id = (size_t)remote_pb >> PAGE_SHIFT;
+    pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
+    pbh->status = PBH_ON_FREE_LIST;
+    pbh->free_time = FREE_TIME_NOW();
+    pbh->dirty_first = 0;
+    pbh->dirty_len = pbh->length;
+    assert(pbh->sizeclass == NUM_CLASSES);
+    sph_coalesce_pbs(pbh);
+
+    remote_pb = GET_NEXT(remote_pb);
+  } while (remote_pb);
 }
 
 
-/*
-   Split the pbh into two pbhs.
-   The first pbh has len length and it will be used.
-   The second pbh has remaning length and it is inserted into the appropriate
-   free page block list.
- */
-static inline void pb_split(tlh_t* tlh, pbh_t* pbh, size_t len) {
-  assert(pbh->length > len);
-  size_t rem_len = pbh->length - len;
+/* Free large blocks remotely freed to the superpage that tlh owns. Unlike
+   sph_get_remote_pbs(), this keeps the Free Page Block Lists consistent. */
+static void sph_free_remote_pbs(tlh_t* tlh, sph_t* sph) {
+  void* remote_pb;
+  do {
+    remote_pb = sph->remote_pb_list;
+  } while (!cas_stat(CAS_REMOTE_PB_LIST,
+                     CAS_ptr(&sph->remote_pb_list, remote_pb, NULL)));
 
-  // Update the original pbh.
-  pbh->length = len;
+  while (remote_pb != NULL) {
+    void* next_pb = GET_NEXT(remote_pb);
+    size_t page_id = (size_t)remote_pb >> PAGE_SHIFT;
+    pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
+    assert(pbh->sizeclass == NUM_CLASSES);
 
-  // Make a pbh for a remaining run of pages and update free list.
-  size_t rem_start = pbh->start_page + len;
-  pbh_t* rem_pbh   = pbh_alloc(pbh_get_superpage(pbh), rem_start, rem_len);
-  rem_pbh->status  = PBH_ON_FREE_LIST;
-  pbh_list_prepend(&tlh->free_pb_list[rem_len-1], rem_pbh);
+    // The superpage cannot be freed before its last remote pb is freed.
+    pb_free(tlh, pbh);
 
-  // Update the pagemap.
-  pagemap_set_range(rem_start, rem_len, rem_pbh);
+    remote_pb = next_pb;
+  }
 }
 
 
-static inline pbh_t* pb_coalesce(tlh_t* tlh, pbh_t* pbh) {
+static void sph_coalesce_pbs(pbh_t* pbh) {
   pbh_t* prev_pbh = (pbh_t*)pagemap_get_checked(pbh->start_page - 1);
   assert(((uintptr_t)prev_pbh & HUGE_MALLOC_MARK) == 0);
 
@@ -1384,24 +2096,21 @@ static inline pbh_t* pb_coalesce(tlh_t* tlh, pbh_t* pbh) {
                     ? NULL : (pbh_t*)next_val;
 
   if (prev_pbh && (prev_pbh->status == PBH_ON_FREE_LIST)) {
-    // Remove prev_pbh form the page list.
-    uint32_t prev_len = prev_pbh->length;
-    pbh_list_remove(&tlh->free_pb_list[prev_len-1], prev_pbh);
-
+    pbh_merge_dirty(prev_pbh, pbh);
     prev_pbh->length += pbh->length;
 
-    // If the coalesced length is same as the length of superpage,
+    // If the coalesced length is the same as the length of superpage,
     // we don't need to update more because superpage will be freed.
     if (prev_pbh->length == SUPERPAGE_LEN) {
       // Only prev_pbh is free.
-      return prev_pbh;
+      return;
     } else if (next_pbh && (next_pbh->status == PBH_ON_FREE_LIST)) {
       // Both prev_pbh and next_pbh are free. Coalesce together.
       uint32_t next_len = next_pbh->length;
-      pbh_list_remove(&tlh->free_pb_list[next_len-1], next_pbh);
 
+      pbh_merge_dirty(prev_pbh, next_pbh);
       prev_pbh->length += next_len;
-      if (prev_pbh->length == SUPERPAGE_LEN) return prev_pbh;
+      if (prev_pbh->length == SUPERPAGE_LEN) return;
 
       // Update the pagemap and deallocate next_pbh.
       pagemap_set_range(next_pbh->start_page, next_len, prev_pbh);
@@ -1411,996 +2120,3915 @@ static inline pbh_t* pb_coalesce(tlh_t* tlh, pbh_t* pbh) {
     // Update the pagemap and deallocate pbh.
     pagemap_set_range(pbh->start_page, pbh->length, prev_pbh);
     pbh_free(pbh);
-
-    return prev_pbh;
   } else if (next_pbh && (next_pbh->status == PBH_ON_FREE_LIST)) {
     // Only next_pbh is free.
     uint32_t next_len = next_pbh->length;
-    pbh_list_remove(&tlh->free_pb_list[next_len-1], next_pbh);
 
+    pbh_merge_dirty(pbh, next_pbh);
     pbh->length += next_len;
-    if (pbh->length == SUPERPAGE_LEN) return pbh;
+    if (pbh->length == SUPERPAGE_LEN) return;
 
     // Update the pagemap and deallocate next_pbh.
     pagemap_set_range(next_pbh->start_page, next_len, pbh);
     pbh_free(next_pbh);
   }
-
-  return pbh;
 }
 
 
+static bool take_superpage(tlh_t* tlh, sph_t* sph) {
+  // Try to change the ownership of superpage.
+  if (!cas_stat(CAS_OWNER_MARK,
+                CAS32(&sph->omark.owner_id, DEAD_OWNER, tlh->thread_id)))
+    return false;
+  hstat_inc_sp_adopt(tlh);
 
-////////////////////////////////////////////////////////////////////////////
-// Thread Local Heap Functions
-////////////////////////////////////////////////////////////////////////////
-static void tlh_init() {
-  // Set the thread ID
-  uint32_t tid = atomic_inc_uint(&g_id);
-  if (tid == MAX_NUM_THREADS) {
-    HANDLE_ERROR("Too many threads are created...\n");
+  if (sph->remote_pb_list != NULL) {
+    sph_get_remote_pbs(sph);
   }
 
-  // Increase the number of currently running threads.
-  atomic_inc_uint(&g_thread_num);
-
-  tlh_t* tlh = &l_tlh;
-  tlh->thread_id = tid;
-
-  // Allocate a hazard pointer.
-  tlh->hazard_ptr = hazard_ptr_alloc();
-}
-
+  // Adopt all pbhs in the superpage.
+  pbh_t* pbh = GET_FIRST_PBH(sph);
+  uint32_t total_len = 0;
+  while (total_len < SUPERPAGE_LEN) {
+    uint32_t len = pbh->length;
+    assert(len > 0);
+    assert(pbh->index == (total_len + 1));
 
-static void tlh_clear(tlh_t* tlh) {
-#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
-  pb_cache_t* pb_cache = &tlh->pb_cache;
-  for (int w = 0; w < NUM_PB_CACHE_WAY; w++) {
-    pb_cache_block_t* block = &pb_cache->block[w];
-    if (block->data) {
-      pb_cache_return(tlh, block->data);
-      block->data = NULL;
-      block->length = 0;
+    if (pbh->status == PBH_ON_FREE_LIST) {
+      free_pb_list_push(tlh, pbh);
+      hstat_add_free_pb(tlh, len);
+    } else if (pbh->sizeclass < NUM_CLASSES) {
+      uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
+      if (count == get_blocks_for_class(pbh->sizeclass)) {
+        // PBH became totally free.
+        pbh_field_init(pbh);
+        free_pb_list_push(tlh, pbh);
+        hstat_add_free_pb(tlh, len);
+      } else {
+        blk_list_t* b_list = &tlh->blk_list[pbh->sizeclass];
+        pbh_list_prepend(&b_list->pbh_list, pbh);
+      }
     }
+
+    // next pbh
+    total_len += len;
+    pbh = pbh + len;
   }
+  assert(total_len == SUPERPAGE_LEN);
+
+  // Prepend the adopted superpage to the superpage list.
+  sph_list_prepend(&tlh->sp_list, sph);
+
+#ifdef MALLOC_USE_REMOTE_INBOX
+  sph_set_inbox(tlh, sph, INBOX_REUSE);
 #endif
 
-  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
-    blk_list_t* b_list = &tlh->blk_list[cl];
+  return true;
+}
 
-    if (b_list->free_blk_list != NULL) {
-      assert(b_list->cnt_free > 0);
-      tlh_return_list(tlh, cl);
+
+static void finish_superpages(tlh_t* tlh) {
+  sph_t** sp_list = &tlh->sp_list;
+
+  do {
+    sph_t* sph = sph_list_pop(sp_list);
+    assert(sph->omark.owner_id == tlh->thread_id);
+
+    if (!finish_superpage(tlh, sph)) {
+      LOG_D("[T%u] DEAD SUPERPAGE\n", tlh->thread_id);
     }
-    
-    if (b_list->ptr_to_unused != NULL) {
-      assert(b_list->cnt_unused > 0);
-      tlh_return_unused(tlh, cl);
+  } while (*sp_list != NULL);
+}
+
+
+/* Free the superpage or make it dead. Return true if it was freed. */
+static bool finish_superpage(tlh_t* tlh, sph_t* sph) {
+  ownermark_t live_mark, dead_mark;
+  live_mark.owner_id    = tlh->thread_id;
+  live_mark.finish_mark = NONE;
+  dead_mark.owner_id    = DEAD_OWNER;
+  dead_mark.finish_mark = NONE;
+
+  while (true) {
+    sph->omark.finish_mark = NONE;
+
+#ifdef MALLOC_USE_REMOTE_INBOX
+    // Blocks pushed to the inbox must be counted as free below.
+    if (tlh->inbox->head != NULL) {
+      inbox_drain(tlh, tlh->inbox, INBOX_FINISH);
     }
+#endif
 
-    if (b_list->pbh_list != NULL) {
-      tlh_return_pbhs(tlh, cl);
+    // Try to clean up the superpage.
+    if (try_to_free_superpage(sph)) {
+      return true;
+    }
+
+#ifdef MALLOC_USE_BG_THREAD
+    // Others may adopt and free it as soon as it is dead.
+    orphan_list_push(sph);
+#endif
+
+    // If the superpage was not freed, make it dead.
+    if (cas_stat(CAS_OWNER_MARK, CAS64((uint64_t*)&sph->omark,
+                                       live_mark.with, dead_mark.with))) {
+      return false;
     }
   }
+}
 
-  // If there remains superpages, make them orphaned.
-  if (tlh->sp_list != NULL) {
-    finish_superpages(tlh);
+
+static bool try_to_free_superpage(sph_t* sph) {
+  if (sph->remote_pb_list != NULL) {
+    sph_get_remote_pbs(sph);
   }
 
-  // Deallocate the hazard pointer.
-  hazard_ptr_free(tlh->hazard_ptr);
-  tlh->hazard_ptr = NULL;
-}
+  pbh_t* pbh = GET_FIRST_PBH(sph);
+  pbh_t* prev_pbh = NULL;
 
+  uint32_t cnt_inuse = 0;
+  uint32_t total_len = 0;
+  while (total_len < SUPERPAGE_LEN) {
+    uint32_t len = pbh->length;
+    assert(len > 0);
 
-static void tlh_return_list(tlh_t* tlh, uint32_t cl) {
-  blk_list_t* b_list = &tlh->blk_list[cl];
+    total_len += len;
 
-  void* list = b_list->free_blk_list;
-  assert(list != NULL);
+    if (pbh->status != PBH_ON_FREE_LIST && pbh->sizeclass < NUM_CLASSES) {
+      uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
+      if (count == get_blocks_for_class(pbh->sizeclass)) {
+        // PBH became totally free.
+        pbh_field_init(pbh);
 
-  void* prev_blk = list;
-  void* curr_blk = GET_NEXT(list);
-  void* blk_list = list;
-  size_t prev_page_id = (size_t)list >> PAGE_SHIFT;
-  pbh_t* blk_pbh = (pbh_t*)pagemap_get(prev_page_id);
-  uint32_t cont_num = 1;
+        // Try coalescing.
+        pbh_t* next_pbh = (total_len < SUPERPAGE_LEN) ? (pbh + len) : NULL;
+        if (prev_pbh && prev_pbh->status == PBH_ON_FREE_LIST) {
+          pbh_merge_dirty(prev_pbh, pbh);
+          pagemap_set_range(pbh->start_page, len, prev_pbh);
+          pbh_free(pbh);
 
-  // If contiguous blocks are in the same pbh, we will return them together.
-  while (curr_blk != NULL) {
-    size_t curr_page_id = (size_t)curr_blk >> PAGE_SHIFT;
+          prev_pbh->length += len;
+          if (next_pbh && next_pbh->status == PBH_ON_FREE_LIST) {
+            uint32_t next_len = next_pbh->length;
+            pbh_merge_dirty(prev_pbh, next_pbh);
+            prev_pbh->length += next_len;
+            pagemap_set_range(next_pbh->start_page, next_len, prev_pbh);
+            pbh_free(next_pbh);
 
-    // Check curr_blk is in the same pbh with the previous block.
-    if (curr_page_id == prev_page_id) {
-      // Same --> continue
-      cont_num++;
-    } else {
-      pbh_t* pbh = (pbh_t*)pagemap_get(curr_page_id);
-      if (pbh == blk_pbh) {
-        // Same --> continue
-        prev_page_id = curr_page_id;
-        cont_num++;
-      } else {
-        // Different --> Return to the pbh.
-        pbh_add_blocks(tlh, blk_pbh, blk_list, prev_blk, cont_num);
+            total_len += next_len;
+            pbh = next_pbh + next_len;
+          } else {
+            pbh = pbh + len;
+          }
+          
+          continue;
+        } else if (next_pbh && next_pbh->status == PBH_ON_FREE_LIST) {
+          uint32_t next_len = next_pbh->length;
+          pbh_merge_dirty(pbh, next_pbh);
+          pbh->length += next_len;
+          pagemap_set_range(next_pbh->start_page, next_len, pbh);
+          pbh_free(next_pbh);
 
-        // Renew the start block.
-        blk_list = curr_blk;
-        blk_pbh = pbh;
-        prev_page_id = curr_page_id;
-        cont_num = 1;
+          total_len += next_len;
+          prev_pbh = pbh;
+          pbh = next_pbh + next_len;
+
+          continue;
+        }
+      } else {
+        cnt_inuse++;
       }
+    } else if (pbh->status != PBH_ON_FREE_LIST) {
+      // Large block in use
+      cnt_inuse++;
     }
 
-    // Move to the next block.
-    prev_blk = curr_blk;
-    curr_blk = GET_NEXT(curr_blk);
+    // next pbh
+    prev_pbh = pbh;
+    pbh = pbh + len;
   }
+  assert(total_len == SUPERPAGE_LEN);
 
-  // Return remained blocks.
-  pbh_add_blocks(tlh, blk_pbh, blk_list, prev_blk, cont_num);
-
-  b_list->free_blk_list = NULL;
-  b_list->cnt_free  = 0;
-}
+  if (cnt_inuse == 0) {
+    // Superpage became totall free.
+    LOG_D("[T%u] EMPTY: %p\n", TID(), sph);
+    sph->hazard_mark = true;
+    sph->free_time = FREE_TIME_NOW();
 
+    // Update pagemap before others can reuse the superpage.
+    pagemap_set_range(GET_START_PAGE(sph), SUPERPAGE_LEN, NULL);
 
-static void tlh_return_unused(tlh_t* tlh, uint32_t cl) {
-  blk_list_t* b_list = &tlh->blk_list[cl];
-  
-  void* unallocated = b_list->ptr_to_unused;
-  size_t page_id = (size_t)unallocated >> PAGE_SHIFT;
-  pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
+    // Link the superpage to g_free_sp_list
+    atomic_inc_uint(&g_free_sp_len);
+    sp_list_push(sph->numa_node, sph, sph);
 
-  pbh_add_unused(tlh, pbh, unallocated, b_list->cnt_unused);
+    return true;
+  }
 
-  b_list->ptr_to_unused = NULL;
-  b_list->cnt_unused = 0;
+  return false;
 }
 
 
-static void tlh_return_pbhs(tlh_t* tlh, uint32_t cl) {
-  blk_list_t* b_list = &tlh->blk_list[cl];
-
-  uint32_t blks_per_pbh = get_blocks_for_class(cl);
-  do {
-    pbh_t* pbh = pbh_list_pop(&b_list->pbh_list);
+static inline void sph_link_init(sph_t* sph) {
+  sph->next = sph;
+  sph->prev = sph;
+}
 
-    // Try again if we can free the pbh.
-    uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
-    if (count == blks_per_pbh) {
-      pb_free(tlh, pbh);
-    }
 
-    // If pbh has some unfreed blocks, just keep it in the superpage.
-    // This is safe because superpage will not be freed.
-    // Another thread will adopt the superpage itself.
-  } while (b_list->pbh_list != NULL);
+static inline void sph_list_prepend(sph_t** list, sph_t* sph) {
+  if (*list != NULL) {
+    sph_t* top = *list;
+    sph->next = top;
+    sph->prev = top->prev;
+    top->prev->next = sph;
+    top->prev = sph;
+  } else {
+    sph_link_init(sph);
+  }
+  *list = sph;
 }
 
 
+static inline sph_t* sph_list_pop(sph_t** list) {
+  assert(*list != NULL);
 
-////////////////////////////////////////////////////////////////////////////
-// Page Block Cache Functions
-////////////////////////////////////////////////////////////////////////////
-static inline int bit_pos(int v) {
-  int pos;
-  __asm__ __volatile__ (
-      "bsf %1, %0"
-      : "=r" (pos)
-      : "r" (v)
-      );
-  return pos;
-}
+  sph_t* sph = *list;
+  *list = (sph != sph->next) ? sph->next : NULL;
 
+  // Remove the superpage from the list.
+  sph->prev->next = sph->next;
+  sph->next->prev = sph->prev;
+  sph_link_init(sph);
 
-static inline int get_cache_hit_index(v8qi val) {
-  int mask = __builtin_ia32_pmovmskb(val);
-  return bit_pos(mask);
+  return sph;
 }
 
 
-static inline void pb_cache_return(tlh_t* tlh, void* pb) {
-  do {
-    size_t page_id = (size_t)pb >> PAGE_SHIFT;
-    pbh_t* pbh = pagemap_get(page_id);
-    void* next_pb = GET_NEXT(pb);
-
-    sph_t* sph = pbh_get_superpage(pbh);
-    if (sph->omark.owner_id == tlh->thread_id) {
-      pb_free(tlh, pbh);
-    } else {
-      pb_remote_free(tlh, pb, pbh);
-    }
-
-    pb = next_pb;
-  } while (pb != NULL);
+static inline void sph_list_remove(sph_t** list, sph_t* sph) {
+  if (sph == sph->next) {
+    assert(*list == sph);
+    *list = NULL;
+  } else {
+    if (*list == sph) *list = sph->next;
+    sph->prev->next = sph->next;
+    sph->next->prev = sph->prev;
+    sph_link_init(sph);
+  }
 }
 
 
 
 ////////////////////////////////////////////////////////////////////////////
-// Allocation/Deallocation Functions
+// Hazard Pointer List Functions
 ////////////////////////////////////////////////////////////////////////////
-static inline void* bump_alloc(size_t size, blk_list_t* b_list) {
-  void* ret = b_list->ptr_to_unused;
-
-  // If size is smaller than the half of cache line size, 
-  // split all blocks in a cache line.
-  if (size <= (CACHE_LINE_SIZE / 2)) {
-    uint32_t blks_per_line = CACHE_LINE_SIZE / size;
+static hazard_ptr_t* hazard_ptr_alloc() {
+  // Allocate from the current list.
+  if (g_hazard_ptr_free_num > 0) {
+    for (hazard_ptr_t* hp = g_hazard_ptr_list; hp != NULL; hp = hp->next) {
+      if (hp->active) continue;
+      if (!cas_stat(CAS_HAZARD_LIST, !atomic_xchg_uint(&hp->active, 1)))
+        continue;
+      atomic_dec_int((int32_t*)&g_hazard_ptr_free_num);
+      return hp;
+    }
+  }
 
-    // Update the Free Block List.
-    b_list->free_blk_list = ret + size;
-    b_list->cnt_free = blks_per_line - 1;
+  // Allocate a new page and split it.
+  hazard_ptr_t* first_hptr = (hazard_ptr_t*)do_mmap(PAGE_SIZE);
+  first_hptr->active = 1;
 
-    void* free_blk = b_list->free_blk_list;
-    for (int i = 2; i < blks_per_line; i++) {
-      void* next_blk = free_blk + size;
-      SET_NEXT(free_blk, next_blk);
-      free_blk = next_blk;
-    }
-    SET_NEXT(free_blk, NULL);
+  uint32_t rem_len = (PAGE_SIZE / sizeof(hazard_ptr_t)) - 1;
 
-    // Update the unallocated pointer.
-    b_list->cnt_unused -= blks_per_line;
-    b_list->ptr_to_unused = (b_list->cnt_unused > 0) ? (free_blk+size) : NULL;
-  } else {
-    // Update the unallocated pointer.
-    b_list->cnt_unused--;
-    b_list->ptr_to_unused = (b_list->cnt_unused > 0) ? (ret + size) : NULL;
+  hazard_ptr_t* last_hptr = first_hptr;
+  for (uint32_t i = 0; i < rem_len; i++) {
+    hazard_ptr_t* next_hptr = last_hptr + 1;
+    last_hptr->next = next_hptr;
+    last_hptr = next_hptr;
   }
 
-  return ret;
-}
+  hazard_ptr_t* top;
+  do {
+    top = g_hazard_ptr_list;
+    last_hptr->next = top;
+  } while (!cas_stat(CAS_HAZARD_LIST,
+                     CAS_ptr(&g_hazard_ptr_list, top, first_hptr)));
+  atomic_add_uint(&g_hazard_ptr_free_num, rem_len);
 
+  return first_hptr;
+}
 
-/*
-   Allocate a memory for small sizes.
-   - size: byte size corresponding to the class cl
-   - cl: size-class
- */
-static inline void* small_malloc(uint32_t cl) {
-  tlh_t* tlh = &l_tlh;
-  blk_list_t* b_list = &tlh->blk_list[cl];
 
-  ////////////////////////////////////////////////////////////////////////
-  // Case 1: When we have thread-local free list.
-  ////////////////////////////////////////////////////////////////////////
-  if (LIKELY(b_list->free_blk_list != NULL)) {
-    assert(b_list->cnt_free > 0);
+static void hazard_ptr_free(hazard_ptr_t* hptr) {
+  hptr->active = 0;
+  atomic_inc_uint(&g_hazard_ptr_free_num);
+}
 
-    // Pop the first free block.
-    void* ret = b_list->free_blk_list;
-    b_list->free_blk_list = GET_NEXT(ret);
-    b_list->cnt_free--;
 
-    return ret;
+static bool scan_hazard_pointers(sph_t* sph) {
+  for (hazard_ptr_t* hp = g_hazard_ptr_list; hp != NULL; hp = hp->next) {
+    if (hp->node == sph) return true;
   }
+  return false;
+}
 
-  ////////////////////////////////////////////////////////////////////////
-  // Case 2: When we have the unallocated chunk
-  ////////////////////////////////////////////////////////////////////////
-  size_t size = get_size_for_class(cl);
-  if (b_list->ptr_to_unused != NULL) {
-    assert(b_list->cnt_unused > 0);
-    // Use pointer-bumping allocation.
-    return bump_alloc(size, b_list);
+
+
+#ifdef MALLOC_USE_REMOTE_INBOX
+////////////////////////////////////////////////////////////////////////////
+// Remote Free Inbox Functions
+////////////////////////////////////////////////////////////////////////////
+static inbox_t* inbox_alloc() {
+  // Reuse a slot of an exited thread.
+  for (inbox_t* ib = g_inbox_list; ib != NULL; ib = ib->next) {
+    if (ib->active) continue;
+    if (atomic_xchg_uint(&ib->active, 1)) continue;
+    return ib;
   }
 
-  ////////////////////////////////////////////////////////////////////////
-  // Case 3: Allocate from the pbh list.
-  ////////////////////////////////////////////////////////////////////////
-  if (b_list->pbh_list != NULL) {
-    pbh_t* pbh = b_list->pbh_list;
+  // Allocate a new page and split it.
+  inbox_t* first_ib = (inbox_t*)do_mmap(PAGE_SIZE);
+  first_ib->active = 1;
 
-    if (pbh->cnt_free > 0) {
-      // PBH has the free list.
-      assert(pbh->free_list != NULL);
-      void* ret = pbh->free_list;
-      
-      b_list->free_blk_list = GET_NEXT(pbh->free_list);
-      b_list->ptr_to_unused = pbh->unallocated;
-      b_list->cnt_free   = pbh->cnt_free - 1;
-      b_list->cnt_unused = pbh->cnt_unused;
+  uint32_t rem_len = (PAGE_SIZE / sizeof(inbox_t)) - 1;
 
-      pbh->cnt_free    = 0;
-      pbh->cnt_unused  = 0;
-      pbh->free_list   = NULL;
-      pbh->unallocated = NULL;
+  inbox_t* last_ib = first_ib;
+  for (uint32_t i = 0; i < rem_len; i++) {
+    inbox_t* next_ib = last_ib + 1;
+    last_ib->next = next_ib;
+    last_ib = next_ib;
+  }
 
-      if (pbh->remote_list.cnt == 0) {
-        // Move this pbh to the last of pbh_list.
-        b_list->pbh_list = pbh->next;
-      }
+  inbox_t* top;
+  do {
+    top = g_inbox_list;
+    last_ib->next = top;
+  } while (!CAS_ptr(&g_inbox_list, top, first_ib));
 
-      return ret;
-    } else if (pbh->cnt_unused > 0) {
-      // PBH has only the unallocated chunk.
-      assert(pbh->unallocated != NULL);
+  return first_ib;
+}
 
-      b_list->ptr_to_unused = pbh->unallocated;
-      b_list->cnt_unused = pbh->cnt_unused;
 
-      pbh->unallocated = NULL;
-      pbh->cnt_unused  = 0;
+static void inbox_free(inbox_t* ib) {
+  ib->active = 0;
+}
 
-      if (pbh->remote_list.cnt == 0) {
-        // Move this pbh to the last of pbh_list.
-        b_list->pbh_list = pbh->next;
-      }
 
-      return bump_alloc(size, b_list);
-    } else if (pbh->remote_list.cnt > 0) {
-      // If there exists a remote list, get it.
-      remote_list_t top;
-      do {
-        top = pbh->remote_list;
-      } while (!CAS64((uint64_t*)&pbh->remote_list, top.together, 0));
+/* Push the chain of blocks from first to last. Pushing only to the top is
+   safe from ABA because the inbox is only emptied as a whole. */
+static inline void inbox_push(tlh_t* tlh, inbox_t* ib,
+                              void* first, void* last) {
+  while (1) {
+    void* top = ib->head;
+    SET_NEXT(last, top);
+    if (cas_stat(CAS_INBOX, CAS_ptr(&ib->head, top, first))) break;
+    hstat_inc_remote_retry(tlh);
+  }
+}
 
-      void* page_addr = (void*)(pbh->start_page << PAGE_SHIFT);
-      void* ret = page_addr + size * top.head;
 
-      b_list->free_blk_list = GET_NEXT(ret);
-      b_list->cnt_free = top.cnt - 1;
+/*
+   Take all blocks in the inbox ib and free the blocks of each pbh together.
+   ib may be the inbox of another thread, so blocks of other owners are
+   freed remotely again.
+   - INBOX_REUSE: Blocks are kept in their pbhs, which are moved to the
+     first of pbh lists, even if the pbhs become totally free.
+   - INBOX_RELEASE: Totally free pbhs are freed to the free PB lists.
+   - INBOX_FINISH: While superpages are finished, pbhs must not be linked
+     to the TLH. Blocks are pushed to the remote lists of their pbhs,
+     where try_to_free_superpage() and adopters count them, and a dead
+     superpage is finished here like the background thread does.
+ */
+static void inbox_drain(tlh_t* tlh, inbox_t* ib, uint32_t mode) {
+  void* blk;
+  do {
+    blk = ib->head;
+    if (blk == NULL) return;
+  } while (!cas_stat(CAS_INBOX, CAS_ptr(&ib->head, blk, NULL)));
+
+  uint64_t depth = 0;
+  while (blk != NULL) {
+    pbh_t* pbh = (pbh_t*)pagemap_get((size_t)blk >> PAGE_SHIFT);
+    void* first = blk;
+    void* last  = blk;
+    uint32_t N  = 1;
+
+    // Take the following blocks of the same pbh.
+    blk = GET_NEXT(blk);
+    while (blk != NULL &&
+           ((size_t)blk >> PAGE_SHIFT) - pbh->start_page < pbh->length) {
+      last = blk;
+      N++;
+      blk = GET_NEXT(blk);
+    }
+    depth += N;
 
-      // Move this pbh to the last of pbh_list.
-      b_list->pbh_list = pbh->next;
+    sph_t* sph = pbh_get_superpage(pbh);
+    if (mode == INBOX_REUSE && sph->omark.owner_id == tlh->thread_id) {
+      blk_list_t* b_list = &tlh->blk_list[pbh->sizeclass];
+      if (b_list->pbh_list != pbh) {
+        pbh_list_move_to_first(&b_list->pbh_list, pbh);
+      }
+      SET_NEXT(last, pbh->free_list);
+      pbh->free_list = first;
+      pbh->cnt_free += N;
+      continue;
+    } else if (mode != INBOX_FINISH) {
+      pbh_add_blocks(tlh, pbh, first, last, N);
+      continue;
+    }
 
-      return ret;
+    tlh->hazard_ptr->node = sph;
+    pbh_remote_push(pbh, first, last, N);
+    sph->omark.finish_mark = DO_NOT_FINISH;
+    bool adopted = (sph->omark.owner_id == DEAD_OWNER &&
+                    CAS32(&sph->omark.owner_id, DEAD_OWNER, tlh->thread_id));
+    tlh->hazard_ptr->node = NULL;
+
+    if (adopted) {
+      sph_set_inbox(tlh, sph, INBOX_FINISH);
+      finish_superpage(tlh, sph);
     }
   }
+  hstat_inbox_drain(tlh, depth);
+}
 
-  ////////////////////////////////////////////////////////////////////////
-  // Case 4: Otherwise, allocate a new pbh.
-  ////////////////////////////////////////////////////////////////////////
-  uint32_t page_num = get_pages_for_class(cl);
-  pbh_t* pbh = pb_alloc(tlh, page_num);
-  pbh_list_append(&b_list->pbh_list, pbh);
 
-  pbh->sizeclass = cl;
-  pbh->cnt_free  = 0;
-  pbh->free_list = NULL;
-  if (size & (CACHE_LINE_SIZE - 1)) {
-    pbh->status = PBH_AGAINST_FALSE_SHARING;
+/* Make the inbox of tlh receive the remote frees to sph, which tlh has
+   just come to own. Blocks pushed to the previous inbox are drained. */
+static void sph_set_inbox(tlh_t* tlh, sph_t* sph, uint32_t mode) {
+  inbox_t* old = sph->inbox;
+  sph->inbox = tlh->inbox;
+  __sync_synchronize();
+  if (old != NULL && old != tlh->inbox && old->head != NULL) {
+    inbox_drain(tlh, old, mode);
   }
-  pbh->remote_list.together = 0;
+}
 
-  uint32_t blks_per_pbh = get_blocks_for_class(cl);
+
+static inline void pbh_remote_push(pbh_t* pbh, void* first, void* last,
+                                   uint32_t N) {
   void* start_addr = (void*)(pbh->start_page << PAGE_SHIFT);
-  
-  pbh->unallocated = NULL;
-  pbh->cnt_unused  = 0;
+  uint32_t size = get_size_for_class(pbh->sizeclass);
 
-  b_list->ptr_to_unused = start_addr;
-  b_list->cnt_unused = blks_per_pbh;
+  remote_list_t new_top;
+  new_top.head = (uintptr_t)(first - start_addr) / size;
 
-  return bump_alloc(size, b_list);
+  remote_list_t top;
+  do {
+    top = pbh->remote_list;
+    if (top.cnt == 0) {
+      SET_NEXT(last, NULL);
+    } else {
+      SET_NEXT(last, start_addr + (size * top.head));
+    }
+    new_top.cnt = top.cnt + N;
+  } while (!cas_stat(CAS_REMOTE_LIST, CAS64((uint64_t*)&pbh->remote_list,
+                                            top.together, new_top.together)));
 }
+#endif //MALLOC_USE_REMOTE_INBOX
 
 
-#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
-static inline void pcache_check_sanity(pb_cache_t* pb_cache) {
-  for (int i = 0; i < NUM_PB_CACHE_WAY; i++) {
-    unsigned pb_len = (uint8_t)pb_cache->tag.e[i];
-    void*    pb     = pb_cache->block[i].data;
-    size_t list_len = pb_cache->block[i].length;
-    size_t cnt = 0;
-    while (pb != NULL) {
-      size_t page_id = (size_t)pb >> PAGE_SHIFT;
-      pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
-      if (pbh == NULL) {
-        CRASH("ERROR: i=%u pb_len=%u pbh is NULL\n", i, pb_len);
-      } else if (pbh->length != pb_len) {
-        CRASH("ERROR: i=%u pb_len=%u pbh->length=%u\n",i,pb_len, pbh->length);
-      }
 
-      pb = GET_NEXT(pb);
-      cnt++;
-    }
-    if (cnt != list_len) {
-      CRASH("ERROR: i=%u pb_len=%u list_len=%lu cnt=%lu\n",
-            i, pb_len, list_len, cnt);
-    }
-  }
-}
+////////////////////////////////////////////////////////////////////////////
+// PBH Functions
+////////////////////////////////////////////////////////////////////////////
+/* Allocate a new pbh from the superpage. */
+static inline pbh_t* pbh_alloc(sph_t* sph, size_t page_id, size_t len) {
+  uint32_t pbh_idx = page_id - GET_START_PAGE(sph) + 1;
+  assert(pbh_idx > 0 && pbh_idx <= SUPERPAGE_LEN);
 
+  pbh_t* new_pbh = (pbh_t*)sph + pbh_idx;
+  memset((void*)new_pbh, 0, sizeof(pbh_t));
+  new_pbh->start_page = page_id;
+  new_pbh->length     = len;
+  new_pbh->index      = pbh_idx;
 
-static inline void print_char8(char8_t v) {
-  printf("{ ");
-  for (int i = 7; i >= 0; i--) {
-    printf("%u", (uint8_t)v.e[i]);
-    if (i > 0) printf(", ");
-  }
-  printf(" }");
+  return new_pbh;
 }
-#endif
 
 
-/* malloc for MAX_SIZE < size <= NUM_PAGE_CLASSES pages. */
-static inline void* large_malloc(size_t page_len) {
-  tlh_t* tlh = &l_tlh;
-#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
-  pb_cache_t* pb_cache = &tlh->pb_cache;
-  
-  char in = (char)page_len;
-  char8_t v_in = {.v = (v8qi){in, in, in, in, in, in, in, in}};
+/* Deallocate the pbh. */
+static inline void pbh_free(pbh_t* pbh) {
+  // Do nothing...
+}
 
-  // Compare with cache
-  int pos;
-  char8_t v_cmp;
-  v_cmp.v = __builtin_ia32_pcmpeqb(pb_cache->tag.v, v_in.v);
-  if (*(uint64_t*)&v_cmp) {
-    inc_pcache_malloc_hit();
 
-    // Hit
-    pos = get_cache_hit_index(v_cmp.v);
+static inline void pbh_add_blocks(tlh_t* tlh, pbh_t* pbh,
+                                 void* start_blk, void* end_blk, uint32_t N) {
+  sph_t* sph = pbh_get_superpage(pbh);
+  if (UNLIKELY(sph->omark.owner_id != tlh->thread_id)) {
+    // Try to free blocks to the owner.
+    if (remote_free(tlh, pbh, start_blk, end_blk, N))
+      return;
+  }
 
-    // Update LRU state.
-    pb_cache->state = (pb_cache->state & g_way_table[pos].mask) |
+  // Return to the local pbh.
+  uint32_t cl = pbh->sizeclass;
+  blk_list_t* b_list = &tlh->blk_list[cl];
+
+  uint32_t cnt_ref = get_blocks_for_class(cl) - 
+                     (pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt);
+  if (cnt_ref == N) {
+    // PBH becomes totally free.
+    pbh_list_remove(&b_list->pbh_list, pbh);
+    pb_free(tlh, pbh);
+  } else {
+    // Move this pbh to the first of pbh list.
+    if (b_list->pbh_list != pbh) {
+      pbh_list_move_to_first(&b_list->pbh_list, pbh);
+    }
+
+    // Prepend to the the free list of pbh.
+    SET_NEXT(end_blk, pbh->free_list);
+    pbh->free_list = start_blk;
+    pbh->cnt_free += N;
+  }
+}
+
+
+static void pbh_add_unused(tlh_t* tlh, pbh_t* pbh, void* unused, uint32_t N) {
+  uint32_t cl = pbh->sizeclass;
+  blk_list_t* b_list = &tlh->blk_list[cl];
+
+  uint32_t cnt_ref = get_blocks_for_class(cl) - 
+                     (pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt);
+  if (cnt_ref == N) {
+    // PBH becomes totally free.
+    pbh_list_remove(&b_list->pbh_list, pbh);
+    pb_free(tlh, pbh);
+  } else {
+    // Move this pbh to the first of pbh list.
+    if (b_list->pbh_list != pbh) {
+      pbh_list_move_to_first(&b_list->pbh_list, pbh);
+    }
+
+    // Add the unallocateed chunk to pbh.
+    if (pbh->cnt_unused == 0) {
+      pbh->unallocated = unused;
+      pbh->cnt_unused  = N;
+      return;
+    } 
+
+    // PBH already has a unallocated chunk. This may be due to block coloring.
+    // We split the smaller chunk between two unallocated chunks.
+    void* start_blk;
+    void* end_blk;
+    uint32_t block_num, blk_size;
+    if (pbh->cnt_unused < N) {
+      start_blk = pbh->unallocated;
+      block_num = pbh->cnt_unused;
+
+      pbh->unallocated  = unused;
+      pbh->cnt_unused = N;
+    } else {
+      start_blk = unused;
+      block_num = N;
+    }
+
+    // Split and prepend split blocks to the free list of pbh.
+    end_blk  = start_blk;
+    blk_size = get_size_for_class(cl);
+    for (uint32_t i = 1; i < block_num; i++) {
+      void* next_blk = end_blk + blk_size;
+      SET_NEXT(end_blk, next_blk);
+      end_blk = next_blk;
+    }
+    SET_NEXT(end_blk, pbh->free_list);
+    pbh->free_list = start_blk;
+    pbh->cnt_free += block_num;
+  }
+}
+
+
+static inline sph_t* pbh_get_superpage(pbh_t* pbh) {
+  assert(pbh->index > 0 && pbh->index <= SUPERPAGE_LEN);
+  return (sph_t*)(pbh - pbh->index);
+}
+
+
+static inline void pbh_link_init(pbh_t* pbh) {
+  pbh->next = pbh;
+  pbh->prev = pbh;
+}
+
+
+static inline void pbh_field_init(pbh_t* pbh) {
+  pbh->status      = PBH_ON_FREE_LIST;
+  pbh->free_list   = NULL;
+  pbh->unallocated = NULL;
+  pbh->remote_list.together = 0;
+  pbh->sampled     = 0;
+  // Pages of the pbh are dirty from now on.
+  pbh->free_time   = FREE_TIME_NOW();
+  pbh->dirty_first = 0;
+  pbh->dirty_len   = pbh->length;
+}
+
+
+/* Take a free pbh off the free lists. The block counts share their storage
+   with the dirty range, and unallocated with free_time, so they are reset
+   here rather than left to the code that carves the pbh into blocks. */
+static inline void pbh_set_in_use(pbh_t* pbh) {
+  pbh->status      = PBH_IN_USE;
+  pbh->cnt_free    = 0;
+  pbh->cnt_unused  = 0;
+  pbh->unallocated = NULL;
+}
+
+
+/* Merge the dirty range of free pbh hi into free pbh lo that it directly
+   follows, before lo takes over the pages of hi. The oldest free_time is
+   kept, so coalescing neither resets the decay clock of dirty pages nor
+   makes purged pages be madvised again unless they lie between dirty ones. */
+static inline void pbh_merge_dirty(pbh_t* lo, pbh_t* hi) {
+  if (hi->free_time == 0) return;
+
+  uint32_t hi_end = lo->length + hi->dirty_first + hi->dirty_len;
+  if (lo->free_time == 0) {
+    lo->free_time   = hi->free_time;
+    lo->dirty_first = lo->length + hi->dirty_first;
+  } else if ((int32_t)(hi->free_time - lo->free_time) < 0) {
+    lo->free_time   = hi->free_time;
+  }
+  lo->dirty_len = hi_end - lo->dirty_first;
+}
+
+
+static inline void pbh_list_prepend(pbh_t** list, pbh_t* pbh) {
+  if (*list != NULL) {
+    pbh_t* top = *list;
+    pbh->next = top;
+    pbh->prev = top->prev;
+    top->prev->next = pbh;
+    top->prev = pbh;
+  } else {
+    pbh_link_init(pbh);
+  }
+  *list = pbh;
+}
+
+
+static inline void pbh_list_append(pbh_t** list, pbh_t* pbh) {
+  if (*list != NULL) {
+    pbh_t* top = *list;
+    pbh->next = top;
+    pbh->prev = top->prev;
+    top->prev->next = pbh;
+    top->prev = pbh;
+  } else {
+    pbh_link_init(pbh);
+    *list = pbh;
+  }
+}
+
+
+static inline pbh_t* pbh_list_pop(pbh_t** list) {
+  assert(*list != NULL);
+
+  pbh_t* pbh = *list;
+  *list = (pbh != pbh->next) ? pbh->next : NULL;
+
+  // Remove the pbh from the list.
+  pbh->prev->next = pbh->next;
+  pbh->next->prev = pbh->prev;
+  pbh_link_init(pbh);
+
+  return pbh;
+}
+
+
+static inline void pbh_list_remove(pbh_t** list, pbh_t* pbh) {
+  if (pbh == pbh->next) {
+    assert(*list == pbh);
+    *list = NULL;
+  } else {
+    if (*list == pbh) *list = pbh->next;
+    pbh->prev->next = pbh->next;
+    pbh->next->prev = pbh->prev;
+    pbh_link_init(pbh);
+  }
+}
+
+
+static inline void pbh_list_move_to_first(pbh_t** list, pbh_t* pbh) {
+  assert(pbh != pbh->next);
+
+  // First remove the pbh.
+  pbh->prev->next = pbh->next;
+  pbh->next->prev = pbh->prev;
+
+  // Prepend it.
+  pbh_t* top = *list;
+  pbh->next = top;
+  pbh->prev = top->prev;
+  top->prev->next = pbh;
+  top->prev = pbh;
+
+  // Make it the first.
+  *list = pbh;
+}
+
+
+/* The Free Page Block Lists keep free_pb_map up to date, so that
+   pb_alloc_from_tlh() finds the best fit without scanning the lists. */
+static inline void free_pb_list_push(tlh_t* tlh, pbh_t* pbh) {
+  uint32_t c = pbh->length - 1;
+  pbh_list_prepend(&tlh->free_pb_list[c], pbh);
+  tlh->free_pb_map[c >> 6] |= 1ULL << (c & 63);
+}
+
+
+static inline pbh_t* free_pb_list_pop(tlh_t* tlh, uint32_t c) {
+  pbh_t* pbh = pbh_list_pop(&tlh->free_pb_list[c]);
+  if (tlh->free_pb_list[c] == NULL) {
+    tlh->free_pb_map[c >> 6] &= ~(1ULL << (c & 63));
+  }
+  return pbh;
+}
+
+
+static inline void free_pb_list_remove(tlh_t* tlh, pbh_t* pbh) {
+  uint32_t c = pbh->length - 1;
+  pbh_list_remove(&tlh->free_pb_list[c], pbh);
+  if (tlh->free_pb_list[c] == NULL) {
+    tlh->free_pb_map[c >> 6] &= ~(1ULL << (c & 63));
+  }
+}
+
+
+/* Index of the first non-empty Free Page Block List from c, or -1. */
+static inline int32_t free_pb_list_find(tlh_t* tlh, uint32_t c) {
+  uint32_t w = c >> 6;
+  if (w >= FREE_PB_MAP_WORDS) return -1;
+
+  uint64_t bits = tlh->free_pb_map[w] & (~0ULL << (c & 63));
+  while (bits == 0) {
+    if (++w == FREE_PB_MAP_WORDS) return -1;
+    bits = tlh->free_pb_map[w];
+  }
+
+  c = (w << 6) + __builtin_ctzll(bits);
+  assert(tlh->free_pb_list[c] != NULL);
+  return c;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////
+// Page Block Functions
+////////////////////////////////////////////////////////////////////////////
+/* Page block is allocated from Free Page Block List, global Free Superpage
+   List, or the OS. */
+static pbh_t* pb_alloc(tlh_t* tlh, size_t page_len) {
+  assert(page_len > 0 && page_len <= NUM_PAGE_CLASSES);
+
+  idle_tick();
+
+  // Allocate a page block from TLH.
+  pbh_t* pbh = pb_alloc_from_tlh(tlh, page_len);
+  if (pbh) return pbh;
+
+  // Check the Remote PB List of the first superpage in Superpage List
+  sph_t* first_sph = tlh->sp_list;
+  if (first_sph) {
+    if (first_sph->remote_pb_list) {
+      // Rotate first because first_sph may be freed.
+      tlh->sp_list = first_sph->next;
+      sph_free_remote_pbs(tlh, first_sph);
+
+      pbh = pb_alloc_from_tlh(tlh, page_len);
+      if (pbh) return pbh;
+    }
+  }
+
+#ifdef MALLOC_USE_REMOTE_INBOX
+  // Blocks freed by other threads may make pbhs totally free.
+  if (tlh->inbox->head != NULL) {
+    inbox_drain(tlh, tlh->inbox, INBOX_RELEASE);
+    pbh = pb_alloc_from_tlh(tlh, page_len);
+    if (pbh) return pbh;
+  }
+#endif
+
+  purge_tick(tlh);
+
+  // Request memory from the global Free Superpage List or the OS.
+  sph_t* sph = sph_alloc(tlh);
+  size_t new_page_id = GET_START_PAGE(sph);
+  pbh = pbh_alloc(sph, new_page_id, page_len);
+  pbh_set_in_use(pbh);
+  pagemap_set_range(new_page_id, page_len, pbh);
+
+  // remained pages
+  assert(page_len < SUPERPAGE_LEN);
+  size_t rem_start = new_page_id + page_len;
+  size_t rem_len   = SUPERPAGE_LEN - page_len;
+  pbh_t* rem_pbh  = pbh_alloc(sph, rem_start, rem_len);
+  rem_pbh->status = PBH_ON_FREE_LIST;
+  rem_pbh->free_time = sph->free_time;
+  rem_pbh->dirty_first = 0;
+  rem_pbh->dirty_len = rem_len;
+  free_pb_list_push(tlh, rem_pbh);
+  hstat_add_free_pb(tlh, rem_len);
+  pagemap_set_range(rem_start, rem_len, rem_pbh);
+
+  return pbh;
+}
+
+
+static pbh_t* pb_alloc_from_tlh(tlh_t* tlh, size_t page_len) {
+  // Page class index is one less than page_len.
+  int32_t pcl = page_len - 1;
+
+  // Find the smallest non-empty Free Page Block List that fits.
+  int32_t c = free_pb_list_find(tlh, pcl);
+  if (c < 0) return NULL;
+
+  // Pop the first pbh.
+  pbh_t* pbh = free_pb_list_pop(tlh, c);
+  assert((pbh->length - 1) == c);
+  hstat_sub_free_pb(tlh, c + 1);
+
+  // If necessary, split this pbh, and make it in-use.
+  if (c > pcl) pb_split(tlh, pbh, page_len);
+  pbh_set_in_use(pbh);
+
+  return pbh;
+}
+
+
+static void pb_free(tlh_t* tlh, pbh_t* pbh) {
+  assert(pbh->length <= SUPERPAGE_LEN);
+  idle_tick();
+
+  // Mark the pages dirty first. Coalescing keeps the oldest free_time.
+  pbh_field_init(pbh);
+  if (pbh->length < SUPERPAGE_LEN) {
+    pbh = pb_coalesce(tlh, pbh);
+  }
+
+  // If the freed pbh makes superpage totally empty, release superpage.
+  if (pbh->length == SUPERPAGE_LEN) {
+    // Release the superpage.
+    sph_free(tlh, pbh_get_superpage(pbh));
+  } else {
+    // Insert it into the Free Page Block List.
+    free_pb_list_push(tlh, pbh);
+    hstat_add_free_pb(tlh, pbh->length);
+  }
+
+  purge_tick(tlh);
+}
+
+
+static void pb_remote_free(tlh_t* tlh, void* pb, pbh_t* pbh) {
+  sph_t* sph = pbh_get_superpage(pbh);
+  tlh->hazard_ptr->node = sph;
+
+  while (1) {
+    if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
+      if (take_superpage(tlh, sph)) {
+        tlh->hazard_ptr->node = NULL;
+        pb_free(tlh, pbh);
+        return;
+      }
+    }
+
+    void* top = sph->remote_pb_list;
+    SET_NEXT(pb, top);
+    if (cas_stat(CAS_REMOTE_PB_LIST,
+                 CAS_ptr(&sph->remote_pb_list, top, pb))) {
+      sph->omark.finish_mark = DO_NOT_FINISH;
+      break;
+    }
+    hstat_inc_remote_retry(tlh);
+  }
+  hstat_add_remote_free(1);
+
+  if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
+    take_superpage(tlh, sph);
+  }
+  tlh->hazard_ptr->node = NULL;
+}
+
+
+/*
+   Split the pbh into two pbhs.
+   The first pbh has len length and it will be used.
+   The second pbh has remaning length and it is inserted into the appropriate
+   free page block list.
+ */
+static inline void pb_split(tlh_t* tlh, pbh_t* pbh, size_t len) {
+  assert(pbh->length > len);
+  size_t rem_len = pbh->length - len;
+
+  // Update the original pbh.
+  pbh->length = len;
+
+  // Make a pbh for a remaining run of pages and update free list.
+  size_t rem_start = pbh->start_page + len;
+  pbh_t* rem_pbh   = pbh_alloc(pbh_get_superpage(pbh), rem_start, rem_len);
+  rem_pbh->status  = PBH_ON_FREE_LIST;
+
+  // The remaining pages keep the part of the dirty range they cover.
+  uint32_t dirty_end = pbh->dirty_first + pbh->dirty_len;
+  if (pbh->free_time && dirty_end > len) {
+    rem_pbh->free_time   = pbh->free_time;
+    rem_pbh->dirty_first = (pbh->dirty_first > len)
+                           ? pbh->dirty_first - len : 0;
+    rem_pbh->dirty_len   = dirty_end - len - rem_pbh->dirty_first;
+  } else {
+    rem_pbh->free_time   = 0;
+  }
+  free_pb_list_push(tlh, rem_pbh);
+  hstat_add_free_pb(tlh, rem_len);
+
+  // Update the pagemap.
+  pagemap_set_range(rem_start, rem_len, rem_pbh);
+}
+
+
+static inline pbh_t* pb_coalesce(tlh_t* tlh, pbh_t* pbh) {
+  pbh_t* prev_pbh = (pbh_t*)pagemap_get_checked(pbh->start_page - 1);
+  assert(((uintptr_t)prev_pbh & HUGE_MALLOC_MARK) == 0);
+
+  void*  next_val = pagemap_get_checked(pbh->start_page + pbh->length);
+  pbh_t* next_pbh = ((uintptr_t)next_val & HUGE_MALLOC_MARK)
+                    ? NULL : (pbh_t*)next_val;
+
+  if (prev_pbh && (prev_pbh->status == PBH_ON_FREE_LIST)) {
+    // Remove prev_pbh form the page list.
+    uint32_t prev_len = prev_pbh->length;
+    free_pb_list_remove(tlh, prev_pbh);
+    hstat_sub_free_pb(tlh, prev_len);
+
+    pbh_merge_dirty(prev_pbh, pbh);
+    prev_pbh->length += pbh->length;
+
+    // If the coalesced length is same as the length of superpage,
+    // we don't need to update more because superpage will be freed.
+    if (prev_pbh->length == SUPERPAGE_LEN) {
+      // Only prev_pbh is free.
+      return prev_pbh;
+    } else if (next_pbh && (next_pbh->status == PBH_ON_FREE_LIST)) {
+      // Both prev_pbh and next_pbh are free. Coalesce together.
+      uint32_t next_len = next_pbh->length;
+      free_pb_list_remove(tlh, next_pbh);
+      hstat_sub_free_pb(tlh, next_len);
+
+      pbh_merge_dirty(prev_pbh, next_pbh);
+      prev_pbh->length += next_len;
+      if (prev_pbh->length == SUPERPAGE_LEN) return prev_pbh;
+
+      // Update the pagemap and deallocate next_pbh.
+      pagemap_set_range(next_pbh->start_page, next_len, prev_pbh);
+      pbh_free(next_pbh);
+    }
+
+    // Update the pagemap and deallocate pbh.
+    pagemap_set_range(pbh->start_page, pbh->length, prev_pbh);
+    pbh_free(pbh);
+
+    return prev_pbh;
+  } else if (next_pbh && (next_pbh->status == PBH_ON_FREE_LIST)) {
+    // Only next_pbh is free.
+    uint32_t next_len = next_pbh->length;
+    free_pb_list_remove(tlh, next_pbh);
+    hstat_sub_free_pb(tlh, next_len);
+
+    pbh_merge_dirty(pbh, next_pbh);
+    pbh->length += next_len;
+    if (pbh->length == SUPERPAGE_LEN) return pbh;
+
+    // Update the pagemap and deallocate next_pbh.
+    pagemap_set_range(next_pbh->start_page, next_len, pbh);
+    pbh_free(next_pbh);
+  }
+
+  return pbh;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////
+// Thread Local Heap Functions
+////////////////////////////////////////////////////////////////////////////
+static void tlh_init() {
+  // Set the thread ID
+  uint32_t tid = atomic_inc_uint(&g_id);
+  if (tid == MAX_NUM_THREADS) {
+    HANDLE_ERROR("Too many threads are created...\n");
+  }
+
+  // Increase the number of currently running threads.
+  atomic_inc_uint(&g_thread_num);
+
+  tlh_t* tlh = &l_tlh;
+  tlh->thread_id = tid;
+#ifdef MALLOC_USE_NUMA
+  tlh->numa_node = numa_get_node();
+#endif
+#ifdef MALLOC_USE_HEAP_STATS
+  tlh->stat = heap_stat_alloc();
+#endif
+  tlh->release_epoch = g_release_epoch;
+#ifdef MALLOC_USE_HEAP_PROF
+  tlh->prof_rand = ((uintptr_t)tlh * 0x9E3779B97F4A7C15ULL) | tid;
+  tlh->prof_countdown = prof_next_interval(tlh);
+#endif
+
+#ifdef MALLOC_USE_SHARED_HEAPS
+  // The shared heap owns the superpages, the hazard pointer and the inbox.
+  if (g_heap_num > 0) {
+    heap_bind();
+    return;
+  }
+#endif
+
+  // Allocate a hazard pointer.
+  tlh->hazard_ptr = hazard_ptr_alloc();
+#ifdef MALLOC_USE_REMOTE_INBOX
+  tlh->inbox = inbox_alloc();
+#endif
+#ifdef MALLOC_USE_DECAY_PURGE
+  tlh->next_purge = get_msec();
+#endif
+#ifdef MALLOC_USE_IDLE_FLUSH
+  idle_register(tlh);
+#endif
+}
+
+
+/* Give the calling thread a TLH. Return true if the thread has exited and
+   borrowed the exit heap, which exit_heap_leave() must give back. */
+static inline bool tlh_attach() {
+  if (!l_tlh_exited) {
+    sf_malloc_thread_init();
+    return false;
+  }
+  // A nested call, e.g. from backtrace(), already holds the exit heap.
+  if (l_exit_heap != NULL) return false;
+  exit_heap_enter();
+  return true;
+}
+
+
+/* glibc frees TLS blocks after our thread destructor has run. Such calls
+   share one heap, which CUR_TLH() points at while the thread holds its
+   lock, so that they do not set up a TLH each and leave its superpages
+   orphaned. */
+static void exit_heap_enter() {
+  exit_heap_lock();
+
+  tlh_t* tlh = &g_exit_tlh;
+  if (tlh->thread_id == DEAD_OWNER) {
+    // Set up on first use, like a shared heap. It is not a running thread.
+    tlh->thread_id = atomic_inc_uint(&g_id);
+#ifdef MALLOC_USE_NUMA
+    tlh->numa_node = l_tlh.numa_node;
+#endif
+    tlh->hazard_ptr = hazard_ptr_alloc();
+#ifdef MALLOC_USE_REMOTE_INBOX
+    tlh->inbox = inbox_alloc();
+#endif
+#ifdef MALLOC_USE_HEAP_STATS
+    tlh->stat = heap_stat_alloc();
+#endif
+#ifdef MALLOC_USE_DECAY_PURGE
+    tlh->next_purge = get_msec();
+#endif
+#ifdef MALLOC_USE_HEAP_PROF
+    tlh->prof_rand = ((uintptr_t)tlh * 0x9E3779B97F4A7C15ULL)
+                     | tlh->thread_id;
+    tlh->prof_countdown = prof_next_interval(tlh);
+#endif
+    tlh->release_epoch = g_release_epoch;
+  }
+  l_exit_heap = tlh;
+
+  // Released after it has not been used for a whole background interval.
+  g_exit_idle = 2;
+}
+
+
+static void exit_heap_leave() {
+  l_exit_heap = NULL;
+  exit_heap_unlock();
+}
+
+
+/* Return the blocks and pages cached by the exit heap, and the superpages
+   that became free. The thread that holds the exit heap leaves it to the
+   next call. Return the size returned to the OS. */
+static size_t exit_heap_release() {
+  if (g_exit_tlh.thread_id == DEAD_OWNER || l_exit_heap != NULL) return 0;
+
+  exit_heap_lock();
+  size_t total = tlh_release(&g_exit_tlh);
+  g_exit_idle = 0;
+  exit_heap_unlock();
+  return total;
+}
+
+
+#ifdef MALLOC_USE_BG_THREAD
+/* Called by the background thread. Release the exit heap once it has been
+   idle for a whole interval. */
+static void exit_heap_tick() {
+  if (g_exit_idle == 0) return;
+
+  exit_heap_lock();
+  if (g_exit_idle > 0 && --g_exit_idle == 0) tlh_release(&g_exit_tlh);
+  exit_heap_unlock();
+}
+#endif
+
+
+static void exit_heap_lock() {
+  while (atomic_xchg_uint(&g_exit_lock, 1)) sched_yield();
+}
+
+
+static void exit_heap_unlock() {
+  __sync_lock_release(&g_exit_lock);
+}
+
+
+static void tlh_clear(tlh_t* tlh) {
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  // Cached batches may hold blocks of the superpages orphaned below, and
+  // nothing would free them until another thread takes the batches.
+  // Return all of them with the blocks of this thread.
+  tc_drain_to(tlh);
+#endif
+  tlh_flush(tlh);
+
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    if (tlh->blk_list[cl].pbh_list != NULL) {
+      tlh_return_pbhs(tlh, cl);
+    }
+  }
+
+  // If there remains superpages, make them orphaned.
+  if (tlh->sp_list != NULL) {
+    finish_superpages(tlh);
+  }
+
+  // Free pbhs belong to the orphaned superpages now. Forget them in case
+  // this thread calls malloc() again before it exits.
+  memset(tlh->free_pb_list, 0, sizeof(tlh->free_pb_list));
+  memset(tlh->free_pb_map, 0, sizeof(tlh->free_pb_map));
+  hstat_clear_free_pb(tlh);
+
+#ifdef MALLOC_USE_REMOTE_INBOX
+  // All superpages are dead now, so others drain the inbox if they push
+  // to it after this.
+  if (tlh->inbox->head != NULL) {
+    inbox_drain(tlh, tlh->inbox, INBOX_FINISH);
+  }
+#endif
+
+  // Deallocate the hazard pointer.
+  hazard_ptr_free(tlh->hazard_ptr);
+  tlh->hazard_ptr = NULL;
+
+#ifdef MALLOC_USE_HEAP_STATS
+  heap_stat_free(tlh->stat);
+  tlh->stat = &g_heap_stat_anon;
+#endif
+}
+
+
+/* Return the blocks cached in the TLH to their pbhs. */
+static void tlh_flush(tlh_t* tlh) {
+#ifdef MALLOC_USE_REMOTE_BUFFER
+  remote_buf_flush_all(tlh);
+#endif
+#ifdef MALLOC_USE_REMOTE_INBOX
+  if (tlh->inbox->head != NULL) inbox_drain(tlh, tlh->inbox, INBOX_RELEASE);
+#endif
+
+#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
+  pb_cache_t* pb_cache = &tlh->pb_cache;
+  for (int w = 0; w < NUM_PB_CACHE_WAY; w++) {
+    pb_cache_block_t* block = &pb_cache->block[w];
+    if (block->data) {
+      pb_cache_return(tlh, block->data);
+      block->data = NULL;
+      block->length = 0;
+    }
+  }
+#endif
+
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    blk_list_t* b_list = &tlh->blk_list[cl];
+
+    if (b_list->free_blk_list != NULL) {
+      assert(b_list->cnt_free > 0);
+      tlh_return_list(tlh, cl, 0);
+    }
+    
+    if (b_list->ptr_to_unused != NULL) {
+      assert(b_list->cnt_unused > 0);
+      tlh_return_unused(tlh, cl);
+    }
+  }
+}
+
+
+/* Return the cached blocks and free the totally free pbhs and the large
+   blocks freed by other threads. Purge the free page blocks. */
+static size_t tlh_release(tlh_t* tlh) {
+  // Cached blocks may make their pbhs totally free. This also flushes the
+  // blocks buffered for other threads.
+  tlh_flush(tlh);
+
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    if (tlh->blk_list[cl].pbh_list != NULL) {
+      tlh_release_pbhs(tlh, cl);
+    }
+  }
+
+  // Visit each superpage once. It may be freed on the way.
+  uint32_t num_sp = 0;
+  sph_t* sph = tlh->sp_list;
+  if (sph != NULL) {
+    do {
+      num_sp++;
+      sph = sph->next;
+    } while (sph != tlh->sp_list);
+  }
+  for (; num_sp > 0 && tlh->sp_list != NULL; num_sp--) {
+    sph = tlh->sp_list;
+    tlh->sp_list = sph->next;
+    if (sph->remote_pb_list != NULL) {
+      sph_free_remote_pbs(tlh, sph);
+    }
+  }
+
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+  // Start the Block List limits over.
+  list_reset(tlh);
+#endif
+
+  return tlh_purge(tlh, get_msec(), 0);
+}
+
+
+/* Return the free blocks of class cl to their pbhs but keep keep blocks.
+   The blocks are taken from the head, so only the returned ones are read. */
+static void tlh_return_list(tlh_t* tlh, uint32_t cl, uint32_t keep) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+  if (keep >= b_list->cnt_free) return;
+
+  void* list = b_list->free_blk_list;
+  assert(list != NULL);
+  void* rest = NULL;
+  if (keep > 0) {
+    void* last = list;
+    for (uint32_t i = keep + 1; i < b_list->cnt_free; i++) {
+      last = GET_NEXT(last);
+    }
+    rest = GET_NEXT(last);
+    SET_NEXT(last, NULL);
+  }
+
+  void* prev_blk = list;
+  void* curr_blk = GET_NEXT(list);
+  void* blk_list = list;
+  size_t prev_page_id = (size_t)list >> PAGE_SHIFT;
+  pbh_t* blk_pbh = (pbh_t*)pagemap_get(prev_page_id);
+  uint32_t cont_num = 1;
+
+  // If contiguous blocks are in the same pbh, we will return them together.
+  while (curr_blk != NULL) {
+    size_t curr_page_id = (size_t)curr_blk >> PAGE_SHIFT;
+
+    // Check curr_blk is in the same pbh with the previous block.
+    if (curr_page_id == prev_page_id) {
+      // Same --> continue
+      cont_num++;
+    } else {
+      pbh_t* pbh = (pbh_t*)pagemap_get(curr_page_id);
+      if (pbh == blk_pbh) {
+        // Same --> continue
+        prev_page_id = curr_page_id;
+        cont_num++;
+      } else {
+        // Different --> Return to the pbh.
+        pbh_add_blocks(tlh, blk_pbh, blk_list, prev_blk, cont_num);
+
+        // Renew the start block.
+        blk_list = curr_blk;
+        blk_pbh = pbh;
+        prev_page_id = curr_page_id;
+        cont_num = 1;
+      }
+    }
+
+    // Move to the next block.
+    prev_blk = curr_blk;
+    curr_blk = GET_NEXT(curr_blk);
+  }
+
+  // Return remained blocks.
+  pbh_add_blocks(tlh, blk_pbh, blk_list, prev_blk, cont_num);
+
+  b_list->free_blk_list = rest;
+  b_list->cnt_free  = keep;
+}
+
+
+static void tlh_return_unused(tlh_t* tlh, uint32_t cl) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+  
+  void* unallocated = b_list->ptr_to_unused;
+  size_t page_id = (size_t)unallocated >> PAGE_SHIFT;
+  pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
+
+  pbh_add_unused(tlh, pbh, unallocated, b_list->cnt_unused);
+
+  b_list->ptr_to_unused = NULL;
+  b_list->cnt_unused = 0;
+}
+
+
+static void tlh_return_pbhs(tlh_t* tlh, uint32_t cl) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+
+  uint32_t blks_per_pbh = get_blocks_for_class(cl);
+  do {
+    pbh_t* pbh = pbh_list_pop(&b_list->pbh_list);
+
+    // Try again if we can free the pbh.
+    uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
+    if (count == blks_per_pbh) {
+      pb_free(tlh, pbh);
+    }
+
+    // If pbh has some unfreed blocks, just keep it in the superpage.
+    // This is safe because superpage will not be freed.
+    // Another thread will adopt the superpage itself.
+  } while (b_list->pbh_list != NULL);
+}
+
+
+/* Free the totally free pbhs of class cl and keep the others. */
+static void tlh_release_pbhs(tlh_t* tlh, uint32_t cl) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+  pbh_t* keep = NULL;
+
+  uint32_t blks_per_pbh = get_blocks_for_class(cl);
+  do {
+    pbh_t* pbh = pbh_list_pop(&b_list->pbh_list);
+
+    uint32_t count = pbh->cnt_free + pbh->cnt_unused + pbh->remote_list.cnt;
+    if (count == blks_per_pbh) {
+      pb_free(tlh, pbh);
+    } else {
+      pbh_list_append(&keep, pbh);
+    }
+  } while (b_list->pbh_list != NULL);
+
+  b_list->pbh_list = keep;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////
+// Page Block Cache Functions
+////////////////////////////////////////////////////////////////////////////
+static inline int bit_pos(int v) {
+  int pos;
+  __asm__ __volatile__ (
+      "bsf %1, %0"
+      : "=r" (pos)
+      : "r" (v)
+      );
+  return pos;
+}
+
+
+static inline int get_cache_hit_index(v8qi val) {
+  int mask = __builtin_ia32_pmovmskb(val);
+  return bit_pos(mask);
+}
+
+
+static inline void pb_cache_return(tlh_t* tlh, void* pb) {
+  do {
+    size_t page_id = (size_t)pb >> PAGE_SHIFT;
+    pbh_t* pbh = pagemap_get(page_id);
+    void* next_pb = GET_NEXT(pb);
+
+    sph_t* sph = pbh_get_superpage(pbh);
+    if (sph->omark.owner_id == tlh->thread_id) {
+      pb_free(tlh, pbh);
+    } else {
+      pb_remote_free(tlh, pb, pbh);
+    }
+
+    pb = next_pb;
+  } while (pb != NULL);
+}
+
+
+
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+////////////////////////////////////////////////////////////////////////////
+// Adaptive Block List Functions
+////////////////////////////////////////////////////////////////////////////
+/* Upper bound of max_free of class cl. It is at least one pbh of blocks. */
+static inline uint32_t list_max(uint32_t cl) {
+  uint32_t max = LIST_MAX_BYTES / get_size_for_class(cl);
+  if (max > LIST_MAX_BLOCKS) max = LIST_MAX_BLOCKS;
+
+  uint32_t batch = get_blocks_for_class(cl);
+  return (max < batch) ? batch : max;
+}
+
+
+static inline void list_set(tlh_t* tlh, uint32_t cl, uint32_t max_free) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+  size_t size = get_size_for_class(cl);
+  tlh->list_bytes -= b_list->max_free * size;
+  tlh->list_bytes += max_free * size;
+  b_list->max_free = max_free;
+}
+
+
+/* Called by small_free() when the Block List of class cl is full. */
+static void list_overflow(tlh_t* tlh, uint32_t cl) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+  uint32_t batch = get_blocks_for_class(cl);
+
+  if (b_list->max_free == 0) {
+    // Slow start from one pbh of blocks.
+    list_set(tlh, cl, batch);
+    if (b_list->cnt_free < batch) return;
+  } else if (++tlh->list_over[cl] >= LIST_MAX_OVERAGES) {
+    // The returned blocks are not needed again. Keep fewer of them.
+    tlh->list_over[cl] = 0;
+    if (b_list->max_free > batch) {
+      list_set(tlh, cl, b_list->max_free - batch);
+    }
+  }
+
+  // Return one pbh of blocks at least.
+  uint32_t max_free = b_list->max_free;
+  uint32_t keep = (max_free > batch) ? max_free - batch : 0;
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  tc_push(tlh, cl, keep);
+#endif
+  tlh_return_list(tlh, cl, keep);
+  tlh->list_returned[cl] = 1;
+}
+
+
+/* Called by small_malloc() when the Block List of class cl runs empty
+   after blocks were returned. */
+static void list_grow(tlh_t* tlh, uint32_t cl) {
+  blk_list_t* b_list = &tlh->blk_list[cl];
+
+  uint32_t max_free = b_list->max_free + get_blocks_for_class(cl);
+  if (max_free > list_max(cl)) max_free = list_max(cl);
+  if (max_free <= b_list->max_free) return;
+
+  // Stay within the budget of the thread.
+  size_t size = get_size_for_class(cl);
+  size_t need = (max_free - b_list->max_free) * size;
+  if (tlh->list_bytes + need > g_tlh_list_bytes) {
+    list_steal(tlh, cl, need);
+    if (tlh->list_bytes + need > g_tlh_list_bytes) {
+      size_t room = (tlh->list_bytes < g_tlh_list_bytes)
+                  ? g_tlh_list_bytes - tlh->list_bytes : 0;
+      max_free = b_list->max_free + room / size;
+      if (max_free <= b_list->max_free) return;
+    }
+  }
+
+  list_set(tlh, cl, max_free);
+}
+
+
+/* Lower the limits of other classes by one pbh of blocks each, in turn,
+   until need more bytes fit in the budget of the thread. */
+static void list_steal(tlh_t* tlh, uint32_t cl, size_t need) {
+  for (uint32_t n = 0; n < NUM_CLASSES; n++) {
+    if (tlh->list_bytes + need <= g_tlh_list_bytes) return;
+
+    uint32_t v = tlh->list_victim;
+    tlh->list_victim = (v + 1 < NUM_CLASSES) ? v + 1 : 0;
+
+    blk_list_t* b_list = &tlh->blk_list[v];
+    uint32_t batch = get_blocks_for_class(v);
+    if (v == cl || b_list->max_free <= batch) continue;
+
+    list_set(tlh, v, b_list->max_free - batch);
+    if (b_list->cnt_free > b_list->max_free) {
+      tlh_return_list(tlh, v, b_list->max_free);
+    }
+  }
+}
+
+
+/* Forget the limits after the Block Lists have been flushed. */
+static void list_reset(tlh_t* tlh) {
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    tlh->blk_list[cl].max_free = 0;
+    tlh->list_over[cl] = 0;
+    tlh->list_returned[cl] = 0;
+  }
+  tlh->list_bytes = 0;
+}
+#endif //MALLOC_USE_ADAPTIVE_LIST
+
+
+
+#ifdef MALLOC_USE_TRANSFER_CACHE
+////////////////////////////////////////////////////////////////////////////
+// Transfer Cache Functions
+////////////////////////////////////////////////////////////////////////////
+/* A batch is one pbh of blocks. Blocks of classes that are not a multiple
+   of the cache line size go back to their owners to avoid false sharing,
+   so they are not cached. */
+static void tc_init() {
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    size_t size = get_size_for_class(cl);
+    if (size & (CACHE_LINE_SIZE - 1)) continue;
+
+    size_t slots = TC_MAX_BYTES / (size * get_blocks_for_class(cl));
+    if (slots < 1) slots = 1;
+    if (slots > TC_SLOTS) slots = TC_SLOTS;
+    g_tc_slots[cl] = slots;
+  }
+}
+
+
+/* Move a batch from the head of the Block List of class cl to the transfer
+   cache if the list has keep blocks more and the cache has room. */
+static bool tc_push(tlh_t* tlh, uint32_t cl, uint32_t keep) {
+  transfer_cache_t* tc = &g_tc[cl];
+  blk_list_t* b_list = &tlh->blk_list[cl];
+  uint32_t batch = get_blocks_for_class(cl);
+  uint32_t slots = g_tc_slots[cl];
+  if (tc->num >= slots || b_list->cnt_free < keep + batch) return false;
+
+  // Reserve a slot. num is never less than the number of full slots.
+  if (atomic_inc_uint(&tc->num) >= slots) {
+    atomic_dec_int((volatile int*)&tc->num);
+    return false;
+  }
+
+  // Find the end of the batch. Blocks of dead superpages are not cached,
+  // since the superpages could not be freed while the batch waits here.
+  void* first = b_list->free_blk_list;
+  void* last = first;
+  size_t page_id = (size_t)first >> PAGE_SHIFT;
+  bool dead = tc_block_dead(first);
+  for (uint32_t i = 1; i < batch; i++) {
+    last = GET_NEXT(last);
+    if (((size_t)last >> PAGE_SHIFT) != page_id) {
+      page_id = (size_t)last >> PAGE_SHIFT;
+      dead = dead || tc_block_dead(last);
+    }
+  }
+  if (dead) {
+    atomic_dec_int((volatile int*)&tc->num);
+    return false;
+  }
+
+  // Cut the batch off the list.
+  void* rest = GET_NEXT(last);
+  SET_NEXT(last, NULL);
+
+  for (uint32_t i = 0; i < slots; i++) {
+    if (tc->slot[i] == NULL && CAS_ptr(&tc->slot[i], NULL, first)) {
+      b_list->free_blk_list = rest;
+      b_list->cnt_free -= batch;
+      hstat_inc_tc_push();
+      return true;
+    }
+  }
+
+  // A slot emptied by a pop is not counted off yet.
+  SET_NEXT(last, rest);
+  atomic_dec_int((volatile int*)&tc->num);
+  return false;
+}
+
+
+/* Take a batch for the empty Block List of class cl. Return its first
+   block and keep the others in the list. */
+static void* tc_pop(tlh_t* tlh, uint32_t cl) {
+  transfer_cache_t* tc = &g_tc[cl];
+  uint32_t slots = g_tc_slots[cl];
+
+  for (uint32_t i = 0; i < slots; i++) {
+    if (tc->slot[i] == NULL) continue;
+    void* first = atomic_xchg_ptr(&tc->slot[i], NULL);
+    if (first == NULL) continue;
+    atomic_dec_int((volatile int*)&tc->num);
+
+    blk_list_t* b_list = &tlh->blk_list[cl];
+    assert(b_list->free_blk_list == NULL);
+    b_list->free_blk_list = GET_NEXT(first);
+    b_list->cnt_free = get_blocks_for_class(cl) - 1;
+    hstat_inc_tc_pop();
+    return first;
+  }
+  return NULL;
+}
+
+
+static inline bool tc_block_dead(void* blk) {
+  pbh_t* pbh = (pbh_t*)pagemap_get((size_t)blk >> PAGE_SHIFT);
+  return pbh_get_superpage(pbh)->omark.owner_id == DEAD_OWNER;
+}
+
+
+/* Move all cached batches to the Block Lists of the calling thread. */
+static void tc_drain() {
+  if (l_tlh.thread_id == DEAD_OWNER) return;
+  idle_enter();
+
+  tlh_t* tlh = CUR_TLH();
+  HEAP_LOCK();
+  tc_drain_to(tlh);
+  HEAP_UNLOCK();
+
+  idle_leave();
+}
+
+
+/* Move all cached batches to the Block Lists of tlh. */
+static void tc_drain_to(tlh_t* tlh) {
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    transfer_cache_t* tc = &g_tc[cl];
+    for (uint32_t i = 0; i < g_tc_slots[cl] && tc->num > 0; i++) {
+      if (tc->slot[i] == NULL) continue;
+      void* first = atomic_xchg_ptr(&tc->slot[i], NULL);
+      if (first == NULL) continue;
+      atomic_dec_int((volatile int*)&tc->num);
+
+      blk_list_t* b_list = &tlh->blk_list[cl];
+      void* last = first;
+      while (GET_NEXT(last) != NULL) last = GET_NEXT(last);
+      SET_NEXT(last, b_list->free_blk_list);
+      b_list->free_blk_list = first;
+      b_list->cnt_free += get_blocks_for_class(cl);
+    }
+  }
+}
+#endif //MALLOC_USE_TRANSFER_CACHE
+
+
+
+////////////////////////////////////////////////////////////////////////////
+// Allocation/Deallocation Functions
+////////////////////////////////////////////////////////////////////////////
+static inline void* bump_alloc(size_t size, blk_list_t* b_list) {
+  void* ret = b_list->ptr_to_unused;
+
+  // If size is smaller than the half of cache line size, 
+  // split all blocks in a cache line.
+  if (size <= (CACHE_LINE_SIZE / 2)) {
+    uint32_t blks_per_line = CACHE_LINE_SIZE / size;
+
+    // Update the Free Block List.
+    b_list->free_blk_list = ret + size;
+    b_list->cnt_free = blks_per_line - 1;
+
+    void* free_blk = b_list->free_blk_list;
+    for (int i = 2; i < blks_per_line; i++) {
+      void* next_blk = free_blk + size;
+      SET_NEXT(free_blk, next_blk);
+      free_blk = next_blk;
+    }
+    SET_NEXT(free_blk, NULL);
+
+    // Update the unallocated pointer.
+    b_list->cnt_unused -= blks_per_line;
+    b_list->ptr_to_unused = (b_list->cnt_unused > 0) ? (free_blk+size) : NULL;
+  } else {
+    // Update the unallocated pointer.
+    b_list->cnt_unused--;
+    b_list->ptr_to_unused = (b_list->cnt_unused > 0) ? (ret + size) : NULL;
+  }
+
+  return ret;
+}
+
+
+/*
+   Allocate a memory for small sizes.
+   - size: byte size corresponding to the class cl
+   - cl: size-class
+ */
+static inline void* small_malloc(uint32_t cl) {
+  tlh_t* tlh = CUR_TLH();
+  blk_list_t* b_list = &tlh->blk_list[cl];
+
+  ////////////////////////////////////////////////////////////////////////
+  // Case 1: When we have thread-local free list.
+  ////////////////////////////////////////////////////////////////////////
+  if (LIKELY(b_list->free_blk_list != NULL)) {
+    assert(b_list->cnt_free > 0);
+
+    // Pop the first free block.
+    void* ret = b_list->free_blk_list;
+    b_list->free_blk_list = GET_NEXT(ret);
+    b_list->cnt_free--;
+
+    return ret;
+  }
+
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+  // The returned blocks are needed again. Keep more of them.
+  if (UNLIKELY(tlh->list_returned[cl])) list_grow(tlh, cl);
+#endif
+
+  ////////////////////////////////////////////////////////////////////////
+  // Case 2: When we have the unallocated chunk
+  ////////////////////////////////////////////////////////////////////////
+  size_t size = get_size_for_class(cl);
+  if (b_list->ptr_to_unused != NULL) {
+    assert(b_list->cnt_unused > 0);
+    // Use pointer-bumping allocation.
+    lat_path(LAT_BUMP);
+    return bump_alloc(size, b_list);
+  }
+
+#ifdef MALLOC_USE_REMOTE_BUFFER
+  remote_buf_tick(tlh);
+#endif
+#ifdef MALLOC_USE_REMOTE_INBOX
+  // Blocks freed by other threads may refill the pbhs.
+  if (tlh->inbox->head != NULL) inbox_drain(tlh, tlh->inbox, INBOX_REUSE);
+#endif
+
+  ////////////////////////////////////////////////////////////////////////
+  // Case 3: Allocate from the pbh list.
+  ////////////////////////////////////////////////////////////////////////
+  if (b_list->pbh_list != NULL) {
+    pbh_t* pbh = b_list->pbh_list;
+    lat_path(LAT_PBH_REFILL);
+
+    if (pbh->cnt_free > 0) {
+      // PBH has the free list.
+      assert(pbh->free_list != NULL);
+      void* ret = pbh->free_list;
+      
+      b_list->free_blk_list = GET_NEXT(pbh->free_list);
+      b_list->ptr_to_unused = pbh->unallocated;
+      b_list->cnt_free   = pbh->cnt_free - 1;
+      b_list->cnt_unused = pbh->cnt_unused;
+
+      pbh->cnt_free    = 0;
+      pbh->cnt_unused  = 0;
+      pbh->free_list   = NULL;
+      pbh->unallocated = NULL;
+
+      if (pbh->remote_list.cnt == 0) {
+        // Move this pbh to the last of pbh_list.
+        b_list->pbh_list = pbh->next;
+      }
+
+      return ret;
+    } else if (pbh->cnt_unused > 0) {
+      // PBH has only the unallocated chunk.
+      assert(pbh->unallocated != NULL);
+
+      b_list->ptr_to_unused = pbh->unallocated;
+      b_list->cnt_unused = pbh->cnt_unused;
+
+      pbh->unallocated = NULL;
+      pbh->cnt_unused  = 0;
+
+      if (pbh->remote_list.cnt == 0) {
+        // Move this pbh to the last of pbh_list.
+        b_list->pbh_list = pbh->next;
+      }
+
+      return bump_alloc(size, b_list);
+    } else if (pbh->remote_list.cnt > 0) {
+      // If there exists a remote list, get it.
+      remote_list_t top;
+      do {
+        top = pbh->remote_list;
+      } while (!cas_stat(CAS_REMOTE_LIST,
+                 CAS64((uint64_t*)&pbh->remote_list, top.together, 0)));
+
+      void* page_addr = (void*)(pbh->start_page << PAGE_SHIFT);
+      void* ret = page_addr + size * top.head;
+
+      b_list->free_blk_list = GET_NEXT(ret);
+      b_list->cnt_free = top.cnt - 1;
+
+      // Move this pbh to the last of pbh_list.
+      b_list->pbh_list = pbh->next;
+
+      return ret;
+    }
+  }
+
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  ////////////////////////////////////////////////////////////////////////
+  // Case 4: Take a batch that another thread did not need.
+  ////////////////////////////////////////////////////////////////////////
+  if (g_tc[cl].num > 0) {
+    void* ret = tc_pop(tlh, cl);
+    if (ret != NULL) return ret;
+  }
+#endif
+
+  ////////////////////////////////////////////////////////////////////////
+  // Case 5: Otherwise, allocate a new pbh.
+  ////////////////////////////////////////////////////////////////////////
+  uint32_t page_num = get_pages_for_class(cl);
+  lat_path(LAT_PB_ALLOC);
+  pbh_t* pbh = pb_alloc(tlh, page_num);
+  pbh_list_append(&b_list->pbh_list, pbh);
+
+  pbh->sizeclass = cl;
+  pbh->cnt_free  = 0;
+  pbh->free_list = NULL;
+  if (size & (CACHE_LINE_SIZE - 1)) {
+    pbh->status = PBH_AGAINST_FALSE_SHARING;
+  }
+  pbh->remote_list.together = 0;
+
+  uint32_t blks_per_pbh = get_blocks_for_class(cl);
+  void* start_addr = (void*)(pbh->start_page << PAGE_SHIFT);
+  
+  pbh->unallocated = NULL;
+  pbh->cnt_unused  = 0;
+
+  b_list->ptr_to_unused = start_addr;
+  b_list->cnt_unused = blks_per_pbh;
+
+  return bump_alloc(size, b_list);
+}
+
+
+#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
+static inline void pcache_check_sanity(pb_cache_t* pb_cache) {
+  for (int i = 0; i < NUM_PB_CACHE_WAY; i++) {
+    unsigned pb_len = (uint8_t)pb_cache->tag.e[i];
+    void*    pb     = pb_cache->block[i].data;
+    size_t list_len = pb_cache->block[i].length;
+    size_t cnt = 0;
+    while (pb != NULL) {
+      size_t page_id = (size_t)pb >> PAGE_SHIFT;
+      pbh_t* pbh = (pbh_t*)pagemap_get(page_id);
+      if (pbh == NULL) {
+        CRASH("ERROR: i=%u pb_len=%u pbh is NULL\n", i, pb_len);
+      } else if (pbh->length != pb_len) {
+        CRASH("ERROR: i=%u pb_len=%u pbh->length=%u\n",i,pb_len, pbh->length);
+      }
+
+      pb = GET_NEXT(pb);
+      cnt++;
+    }
+    if (cnt != list_len) {
+      CRASH("ERROR: i=%u pb_len=%u list_len=%lu cnt=%lu\n",
+            i, pb_len, list_len, cnt);
+    }
+  }
+}
+
+
+static inline void print_char8(char8_t v) {
+  printf("{ ");
+  for (int i = 7; i >= 0; i--) {
+    printf("%u", (uint8_t)v.e[i]);
+    if (i > 0) printf(", ");
+  }
+  printf(" }");
+}
+#endif
+
+
+/* malloc for MAX_SIZE < size <= NUM_PAGE_CLASSES pages. */
+static inline void* large_malloc(size_t page_len) {
+  tlh_t* tlh = CUR_TLH();
+#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
+#if (NUM_PAGE_CLASSES > PB_CACHE_MAX_LEN)
+  if (page_len > PB_CACHE_MAX_LEN) {
+    lat_path(LAT_PB_ALLOC);
+    pbh_t* pbh = pb_alloc(tlh, page_len);
+    pbh->sizeclass = NUM_CLASSES;
+    return (void*)(pbh->start_page << PAGE_SHIFT);
+  }
+#endif
+
+  pb_cache_t* pb_cache = &tlh->pb_cache;
+  
+  char in = (char)page_len;
+  char8_t v_in = {.v = (v8qi){in, in, in, in, in, in, in, in}};
+
+  // Compare with cache
+  int pos;
+  char8_t v_cmp;
+  v_cmp.v = __builtin_ia32_pcmpeqb(pb_cache->tag.v, v_in.v);
+  if (*(uint64_t*)&v_cmp) {
+    inc_pcache_malloc_hit();
+    hstat_inc_pcache_malloc_hit();
+
+    // Hit
+    pos = get_cache_hit_index(v_cmp.v);
+
+    // Update LRU state.
+    pb_cache->state = (pb_cache->state & g_way_table[pos].mask) |
+                      g_way_table[pos].set_bit;
+
+    // Check the cache block.
+    pb_cache_block_t* block = &pb_cache->block[pos];
+    if (block->data) {
+      inc_pcache_malloc_real_hit();
+      lat_path(LAT_PCACHE);
+
+      void* ret = block->data;
+      block->data = GET_NEXT(ret);
+      block->length--;
+
+      return ret;
+    }
+  }
+  else {
+    inc_pcache_malloc_miss();
+    hstat_inc_pcache_malloc_miss();
+
+    // Miss
+    pos = g_lru_table[pb_cache->state];
+
+    // Update LRU state.
+    pb_cache->state = (pb_cache->state & g_way_table[pos].mask) |
                       g_way_table[pos].set_bit;
 
-    // Check the cache block.
-    pb_cache_block_t* block = &pb_cache->block[pos];
-    if (block->data) {
-      inc_pcache_malloc_real_hit();
+    // Evict the victim.
+    pb_cache_block_t* block = &pb_cache->block[pos];
+    if (block->data) {
+      inc_pcache_malloc_evict();
+
+      pb_cache_return(tlh, block->data);
+
+      block->data = NULL;
+      block->length = 0;
+    }
+
+    // Save the new page class.
+    pb_cache->tag.e[pos] = in;
+  }
+
+  lat_path(LAT_PB_ALLOC);
+  pbh_t* pbh = pb_alloc(tlh, page_len);
+  pbh->sizeclass = NUM_CLASSES;
+  return (void*)(pbh->start_page << PAGE_SHIFT);
+#else
+  lat_path(LAT_PB_ALLOC);
+  pbh_t* pbh = pb_alloc(tlh, page_len);
+  pbh->sizeclass = NUM_CLASSES;
+  return (void*)(pbh->start_page << PAGE_SHIFT);
+#endif
+}
+
+
+static inline void* huge_malloc(size_t page_len) {
+  lat_path(LAT_HUGE_MALLOC);
+
+  // Use mmap directly.
+  size_t size = page_len << PAGE_SHIFT;
+  uintptr_t flags = HUGE_MALLOC_MARK;
+
+  void* ret = NULL;
+#ifdef MALLOC_USE_HUGETLB
+  if (g_use_hugetlb) ret = huge_mmap_hugetlb(&size);
+  if (ret != NULL) flags |= HUGE_MALLOC_HUGETLB;
+#endif
+  if (ret == NULL) ret = do_mmap(size);
+
+  size_t page_id = (size_t)ret >> PAGE_SHIFT;
+  void* val = (void*)(size | flags);
+
+  pagemap_expand(page_id, 1);
+  pagemap_set(page_id, val);
+
+  return ret;
+}
+
+
+#ifdef MALLOC_USE_HUGETLB
+/* Try 1 GB and then 2 MB hugetlb pages for a huge block if rounding size up
+   to the page size wastes at most 1/8 of it. On success, size is updated to
+   the mapped size. */
+static void* huge_mmap_hugetlb(size_t* size) {
+  static const int shifts[2] = { GIANT_PAGE_SHIFT, HUGE_PAGE_SHIFT };
+  for (int i = 0; i < 2; i++) {
+    size_t psize = (size_t)1 << shifts[i];
+    size_t rsize = (*size + psize - 1) & ~(psize - 1);
+    if (rsize - *size > (*size >> 3)) continue;
+
+    void* mem = do_mmap_hugetlb(rsize, shifts[i]);
+    if (mem != NULL) {
+      *size = rsize;
+      return mem;
+    }
+  }
+  return NULL;
+}
+#endif
+
+
+#ifdef MALLOC_USE_REMOTE_INBOX
+static inline bool remote_free(tlh_t* tlh, pbh_t* pbh,
+                               void* first, void* last, uint32_t N) {
+  sph_t* sph = pbh_get_superpage(pbh);
+  tlh->hazard_ptr->node = sph;
+
+  if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
+    if (take_superpage(tlh, sph)) {
+      tlh->hazard_ptr->node = NULL;
+      return false;
+    }
+  }
+
+  inbox_t* ib = sph->inbox;
+  inbox_push(tlh, ib, first, last);
+  sph->omark.finish_mark = DO_NOT_FINISH;
+  hstat_add_remote_free(N);
+
+  // If the owner has exited or the superpage has been adopted since we
+  // read the inbox, nobody may drain it.
+  bool stale = (sph->omark.owner_id == DEAD_OWNER || sph->inbox != ib);
+  tlh->hazard_ptr->node = NULL;
+
+  if (UNLIKELY(stale)) inbox_drain(tlh, ib, INBOX_REUSE);
+
+  return true;
+}
+#else
+static inline bool remote_free(tlh_t* tlh, pbh_t* pbh,
+                               void* first, void* last, uint32_t N) {
+  sph_t* sph = pbh_get_superpage(pbh);
+  uint32_t cl = pbh->sizeclass;
+
+  void* start_addr = (void*)(pbh->start_page << PAGE_SHIFT);
+  uint32_t size = get_size_for_class(cl);
+  uint16_t blk_idx = (uintptr_t)(first - start_addr) / size;
+
+  remote_list_t new_top;
+  new_top.head = blk_idx;
+
+  tlh->hazard_ptr->node = sph;
+
+  while (true) {
+    if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
+      if (take_superpage(tlh, sph)) {
+        tlh->hazard_ptr->node = NULL;
+        return false;
+      }
+    }
+
+    remote_list_t top = pbh->remote_list;
+    if (top.cnt == 0) {
+      SET_NEXT(last, NULL);
+    } else {
+      void* head_addr = start_addr + (size * top.head);
+      SET_NEXT(last, head_addr);
+    }
+    new_top.cnt = top.cnt + N;
+
+    if (cas_stat(CAS_REMOTE_LIST, CAS64((uint64_t*)&pbh->remote_list,
+                                        top.together, new_top.together))) {
+      sph->omark.finish_mark = DO_NOT_FINISH;
+      break;
+    }
+    hstat_inc_remote_retry(tlh);
+  }
+  hstat_add_remote_free(N);
+
+  if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
+    take_superpage(tlh, sph);
+  }
+
+  tlh->hazard_ptr->node = NULL;
+
+  return true;
+}
+#endif //MALLOC_USE_REMOTE_INBOX
+
+
+#ifdef MALLOC_USE_REMOTE_BUFFER
+/* Buffer a block freed to a pbh of another thread. Consecutive remote
+   frees of a size-class usually go to the same pbh, so the slot is chosen
+   by the size-class. */
+static inline void remote_buf_add(tlh_t* tlh, pbh_t* pbh, void* ptr) {
+  uint32_t idx = pbh->sizeclass & (REMOTE_BUF_LEN - 1);
+  remote_buf_t* rb = &tlh->remote_buf[idx];
+
+  if (rb->pbh != pbh) {
+    if (rb->pbh != NULL) remote_buf_flush(tlh, rb);
+    rb->pbh   = pbh;
+    rb->first = NULL;
+    rb->last  = ptr;
+  }
+  SET_NEXT(ptr, rb->first);
+  rb->first = ptr;
+  rb->cnt++;
+
+  if (UNLIKELY(tlh->remote_buf_frees++ == 0)) {
+    tlh->remote_buf_time = get_msec();
+  }
+  if (UNLIKELY(rb->cnt >= REMOTE_BUF_BLKS)) {
+    remote_buf_flush(tlh, rb);
+    remote_buf_tick(tlh);
+  }
+  if (UNLIKELY(tlh->remote_buf_frees >= REMOTE_BUF_FREES)) {
+    remote_buf_flush_all(tlh);
+  }
+}
+
+
+/* Free the buffered blocks of a pbh. The superpage may have been adopted
+   by this thread meanwhile, so pbh_add_blocks() checks the owner again. */
+static void remote_buf_flush(tlh_t* tlh, remote_buf_t* rb) {
+  pbh_t* pbh = rb->pbh;
+  rb->pbh = NULL;
+  pbh_add_blocks(tlh, pbh, rb->first, rb->last, rb->cnt);
+  rb->cnt = 0;
+}
+
+
+static void remote_buf_flush_all(tlh_t* tlh) {
+  for (uint32_t i = 0; i < REMOTE_BUF_LEN; i++) {
+    if (tlh->remote_buf[i].pbh != NULL) {
+      remote_buf_flush(tlh, &tlh->remote_buf[i]);
+    }
+  }
+  tlh->remote_buf_frees = 0;
+}
+
+
+/* Called on the slow paths. Flush all slots once the first buffered block
+   has waited REMOTE_BUF_MS, so that blocks of threads that free only a
+   few do not stay buffered. */
+static inline void remote_buf_tick(tlh_t* tlh) {
+  if (tlh->remote_buf_frees > 0 &&
+      get_msec() - tlh->remote_buf_time >= REMOTE_BUF_MS) {
+    remote_buf_flush_all(tlh);
+  }
+}
+#endif
+
+
+/* Deallocate a memory for small sizes. */
+static inline void small_free(void* ptr, pbh_t* pbh) {
+  tlh_t* tlh = CUR_TLH();
+
+  if (pbh->status == PBH_AGAINST_FALSE_SHARING) {
+    sph_t* sph = pbh_get_superpage(pbh);
+    if (UNLIKELY(sph->omark.owner_id != tlh->thread_id)) {
+      // Try to free the block to the owner.
+      lat_path(LAT_REMOTE_FREE);
+#ifdef MALLOC_USE_REMOTE_BUFFER
+      remote_buf_add(tlh, pbh, ptr);
+      return;
+#else
+      if (remote_free(tlh, pbh, ptr, ptr, 1))
+        return;
+#endif
+    }
+  }
+
+  // Local free
+  uint32_t cl = pbh->sizeclass;
+  blk_list_t* b_list = &tlh->blk_list[cl];
+
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+  if (UNLIKELY(b_list->cnt_free >= b_list->max_free)) {
+    lat_path(LAT_RETURN_LIST);
+    list_overflow(tlh, cl);
+  }
+#else
+  uint32_t threshold = get_blocks_for_class(cl) * g_return_list_pbhs;
+  if (UNLIKELY(b_list->cnt_free >= threshold)) {
+    lat_path(LAT_RETURN_LIST);
+#ifdef MALLOC_USE_TRANSFER_CACHE
+    tc_push(tlh, cl, 0);
+#endif
+    tlh_return_list(tlh, cl, 0);
+  }
+#endif
+
+  // Prepend the free block to the free block list for its size-class.
+  SET_NEXT(ptr, b_list->free_blk_list);
+  b_list->free_blk_list = ptr;
+  b_list->cnt_free++;
+}
+
+
+static inline void large_free(void* ptr, pbh_t* pbh) {
+  tlh_t* tlh = CUR_TLH();
+#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
+#if (NUM_PAGE_CLASSES > PB_CACHE_MAX_LEN)
+  if (pbh->length > PB_CACHE_MAX_LEN) {
+    sph_t* sph = pbh_get_superpage(pbh);
+    if (sph->omark.owner_id == tlh->thread_id) {
+      lat_path(LAT_PB_FREE);
+      pb_free(tlh, pbh);
+    } else {
+      lat_path(LAT_REMOTE_FREE);
+      pb_remote_free(tlh, ptr, pbh);
+    }
+    return;
+  }
+#endif
+
+  pb_cache_t* pb_cache = &tlh->pb_cache;
+
+  char in = (char)pbh->length;
+  char8_t v_in = {.v = (v8qi){in, in, in, in, in, in, in, in}};
+
+  // Compare with cache
+  int pos;
+  char8_t v_cmp;
+  v_cmp.v = __builtin_ia32_pcmpeqb(pb_cache->tag.v, v_in.v);
+  if (*(uint64_t*)&v_cmp) {
+    inc_pcache_free_hit();
+    hstat_inc_pcache_free_hit();
+
+    // Hit
+    pos = get_cache_hit_index(v_cmp.v);
+
+    // Link to the page cache.
+    pb_cache_block_t* block = &pb_cache->block[pos];
+    if (block->length < g_pb_cache_depth) {
+      // Page block cache keeps up to g_pb_cache_depth PBs.
+      SET_NEXT(ptr, block->data);
+      block->data = ptr;
+      block->length++;
+    } else {
+      sph_t* sph = pbh_get_superpage(pbh);
+      if (sph->omark.owner_id == tlh->thread_id) {
+        lat_path(LAT_PB_FREE);
+        pb_free(tlh, pbh);
+      } else {
+        lat_path(LAT_REMOTE_FREE);
+        pb_remote_free(tlh, ptr, pbh);
+      }
+    }
+  } else {
+    inc_pcache_free_miss();
+    hstat_inc_pcache_free_miss();
+
+    // Miss
+    pos = g_lru_table[pb_cache->state];
+
+    // Evict the victim.
+    pb_cache_block_t* block = &pb_cache->block[pos];
+    if (block->data) {
+      inc_pcache_free_evict();
+      lat_path(LAT_PB_FREE);
+
+      pb_cache_return(tlh, block->data);
+    }
+
+    SET_NEXT(ptr, NULL);
+    block->data = ptr;
+    block->length = 1;
+
+    // Save the new page class.
+    pb_cache->tag.e[pos] = in;
+  }
+
+  // Update LRU state.
+  pb_cache->state = (pb_cache->state & g_way_table[pos].mask) |
+                    g_way_table[pos].set_bit;
+#else
+  sph_t* sph = pbh_get_superpage(pbh);
+  if (sph->omark.owner_id == tlh->thread_id) {
+    lat_path(LAT_PB_FREE);
+    pb_free(tlh, pbh);
+  } else {
+    lat_path(LAT_REMOTE_FREE);
+    pb_remote_free(tlh, ptr, pbh);
+  }
+#endif
+}
+
+
+static inline void huge_free(void* ptr, size_t size) {
+  // Clear the pagemap first. Once unmapped, the range may be mapped again
+  // by another thread.
+  lat_path(LAT_HUGE_FREE);
+  pagemap_set((size_t)ptr >> PAGE_SHIFT, NULL);
+  do_munmap(ptr, size);
+}
+
+
+
+#ifdef MALLOC_USE_PERCPU
+////////////////////////////////////////////////////////////////////////////
+// Per-CPU Cache Functions
+////////////////////////////////////////////////////////////////////////////
+/* Use the per-CPU caches if glibc has registered rseq for this thread. */
+static void pcpu_init() {
+  long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (__rseq_size == 0 || (int32_t)RSEQ_AREA()->cpu_id < 0 ||
+      num_cpus > PCPU_MAX_CPUS) {
+    g_percpu = 0;
+    return;
+  }
+
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    uint32_t cap = PCPU_CLASS_BYTES / get_size_for_class(cl);
+    g_pcpu_cap[cl] = (cap < PCPU_SLOTS) ? cap : PCPU_SLOTS;
+  }
+}
+
+
+static pcpu_cache_t* pcpu_cache_get(uint32_t cpu) {
+  pcpu_cache_t* pc = g_pcpu[cpu];
+  if (pc != NULL) return pc;
+
+  pc = (pcpu_cache_t*)do_mmap(PCPU_CACHE_SIZE);
+  if (!CAS_ptr(&g_pcpu[cpu], NULL, pc)) {
+    do_munmap(pc, PCPU_CACHE_SIZE);
+    pc = g_pcpu[cpu];
+  }
+  return pc;
+}
+
+
+static inline void* pcpu_malloc(uint32_t cl) {
+  if (LIKELY(g_percpu)) {
+    struct rseq* rs = RSEQ_AREA();
+    uint32_t cpu = rs->cpu_id_start;
+    pcpu_cache_t* pc = g_pcpu[cpu];
+    void* ret;
+    if (LIKELY(pc != NULL) &&
+        rseq_pop(rs, cpu, &pc->cnt[cl], pc->slot[cl], &ret)) {
+      hstat_inc_pcpu_malloc_hit();
+      return ret;
+    }
+    hstat_inc_pcpu_malloc_miss();
+    pcpu_refill(cl);
+  }
+  return small_malloc(cl);
+}
+
+
+static inline void pcpu_free(void* ptr, pbh_t* pbh) {
+  if (LIKELY(g_percpu)) {
+    struct rseq* rs = RSEQ_AREA();
+    uint32_t cpu = rs->cpu_id_start;
+    uint32_t cl = pbh->sizeclass;
+    pcpu_cache_t* pc = g_pcpu[cpu];
+    if (LIKELY(pc != NULL) &&
+        rseq_push(rs, cpu, &pc->cnt[cl], pc->slot[cl], g_pcpu_cap[cl], ptr)) {
+      hstat_inc_pcpu_free_hit();
+      return;
+    }
+    hstat_inc_pcpu_free_miss();
+    // Make room for the next frees.
+    pcpu_flush(cl, g_pcpu_cap[cl] / 2);
+  }
+  small_free(ptr, pbh);
+}
+
+
+/* Move half a stack of blocks from the TLH to the cache of this CPU. */
+static void pcpu_refill(uint32_t cl) {
+  struct rseq* rs = RSEQ_AREA();
+  uint32_t cpu = rs->cpu_id_start;
+  pcpu_cache_t* pc = pcpu_cache_get(cpu);
+  uint32_t cap = g_pcpu_cap[cl];
+
+  for (uint32_t i = 0; i < cap / 2; i++) {
+    void* blk = small_malloc(cl);
+    if (!rseq_push(rs, cpu, &pc->cnt[cl], pc->slot[cl], cap, blk)) {
+      // Migrated to another CPU
+      small_free(blk, (pbh_t*)pagemap_get((size_t)blk >> PAGE_SHIFT));
+      break;
+    }
+  }
+}
+
+
+/* Move at most n blocks from the cache of this CPU to the TLH. */
+static void pcpu_flush(uint32_t cl, uint32_t n) {
+  struct rseq* rs = RSEQ_AREA();
+  uint32_t cpu = rs->cpu_id_start;
+  pcpu_cache_t* pc = g_pcpu[cpu];
+  if (pc == NULL) return;
+
+  void* blk;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!rseq_pop(rs, cpu, &pc->cnt[cl], pc->slot[cl], &blk)) break;
+    small_free(blk, (pbh_t*)pagemap_get((size_t)blk >> PAGE_SHIFT));
+  }
+}
+
+#endif //MALLOC_USE_PERCPU
+
+
+
+#ifdef MALLOC_USE_SHARED_HEAPS
+////////////////////////////////////////////////////////////////////////////
+// Shared Heap Functions
+////////////////////////////////////////////////////////////////////////////
+/* Called before the first TLH is initialized. */
+static void heaps_init() {
+  g_heap_num = MIN(g_num_heaps, MAX_SHARED_HEAPS);
+  if (g_heap_num == 0) return;
+  g_heaps = (shared_heap_t*)do_mmap(g_heap_num * sizeof(shared_heap_t));
+}
+
+
+static void front_init() {
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    uint32_t cap = FRONT_CACHE_BYTES / get_size_for_class(cl);
+    g_front_cap[cl] = MIN(cap, FRONT_CACHE_BLKS);
+  }
+}
+
+
+/* Bind the calling thread to a shared heap in a round-robin manner. */
+static void heap_bind() {
+  uint32_t idx = atomic_inc_uint(&g_heap_next) % g_heap_num;
+  shared_heap_t* heap = &g_heaps[idx];
+
+  heap_lock(heap);
+  if (heap->tlh.thread_id == DEAD_OWNER) heap_init(heap);
+  heap_unlock(heap);
+
+  l_heap = heap;
+}
+
+
+/* Return the cached blocks at thread exit. The heap itself is kept. */
+static void heap_unbind() {
+  front_flush_all();
+  l_heap = NULL;
+
+#ifdef MALLOC_USE_HEAP_STATS
+  heap_stat_free(l_tlh.stat);
+  l_tlh.stat = &g_heap_stat_anon;
+#endif
+}
+
+
+/* Set up the TLH of a shared heap on its first use. It gets its own ID, so
+   that frees by the threads of other heaps are remote frees. */
+static void heap_init(shared_heap_t* heap) {
+  tlh_t* tlh = &heap->tlh;
+  tlh->thread_id = atomic_inc_uint(&g_id);
+#ifdef MALLOC_USE_NUMA
+  tlh->numa_node = l_tlh.numa_node;
+#endif
+  tlh->hazard_ptr = hazard_ptr_alloc();
+#ifdef MALLOC_USE_REMOTE_INBOX
+  tlh->inbox = inbox_alloc();
+#endif
+#ifdef MALLOC_USE_HEAP_STATS
+  tlh->stat = heap_stat_alloc();
+#endif
+#ifdef MALLOC_USE_DECAY_PURGE
+  tlh->next_purge = get_msec();
+#endif
+  tlh->release_epoch = g_release_epoch;
+}
+
+
+static inline void heap_lock(shared_heap_t* heap) {
+  if (LIKELY(!atomic_xchg_uint(&heap->lock, 1))) return;
+
+  hstat_inc_heap_lock_wait();
+  do {
+    for (uint32_t i = 0; heap->lock; i++) {
+      if (i < HEAP_LOCK_SPINS) __builtin_ia32_pause();
+      else sched_yield();
+    }
+  } while (atomic_xchg_uint(&heap->lock, 1));
+}
+
+
+static inline void heap_unlock(shared_heap_t* heap) {
+  __sync_lock_release(&heap->lock);
+}
+
+
+static void heaps_lock_all() {
+  for (uint32_t i = 0; i < g_heap_num; i++) heap_lock(&g_heaps[i]);
+}
+
+
+static void heaps_unlock_all() {
+  for (uint32_t i = 0; i < g_heap_num; i++) heap_unlock(&g_heaps[i]);
+}
+
+
+/* Pop a block from the front cache, or refill it from the shared heap. */
+static inline void* front_malloc(uint32_t cl) {
+  if (!HEAP_SHARED()) return small_malloc(cl);
+
+  front_cache_t* fc = &l_front;
+  void* ret = fc->list[cl];
+  if (LIKELY(ret != NULL)) {
+    fc->list[cl] = GET_NEXT(ret);
+    fc->cnt[cl]--;
+    return ret;
+  }
+
+  heap_lock(l_heap);
+  ret = small_malloc(cl);
+  for (uint32_t i = 1; i < g_front_cap[cl]; i++) {
+    void* blk = small_malloc(cl);
+    SET_NEXT(blk, fc->list[cl]);
+    fc->list[cl] = blk;
+    fc->cnt[cl]++;
+  }
+  heap_unlock(l_heap);
+
+  return ret;
+}
+
+
+/* Push the block to the front cache. If it overflows, free half of the
+   cache to the shared heap. */
+static inline void front_free(void* ptr, pbh_t* pbh) {
+  if (!HEAP_SHARED()) {
+    small_free(ptr, pbh);
+    return;
+  }
+
+  front_cache_t* fc = &l_front;
+  uint32_t cl = pbh->sizeclass;
+  SET_NEXT(ptr, fc->list[cl]);
+  fc->list[cl] = ptr;
+
+  if (UNLIKELY(++fc->cnt[cl] > g_front_cap[cl])) {
+    front_flush(cl, fc->cnt[cl] - g_front_cap[cl] / 2);
+  }
+}
+
+
+/* Free n blocks of the front cache to the shared heap. */
+static void front_flush(uint32_t cl, uint32_t n) {
+  front_cache_t* fc = &l_front;
+
+  heap_lock(l_heap);
+  for (uint32_t i = 0; i < n; i++) {
+    void* blk = fc->list[cl];
+    fc->list[cl] = GET_NEXT(blk);
+    small_free(blk, (pbh_t*)pagemap_get((size_t)blk >> PAGE_SHIFT));
+  }
+  heap_unlock(l_heap);
+
+  fc->cnt[cl] -= n;
+}
+
+
+static void front_flush_all() {
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    if (l_front.cnt[cl] > 0) front_flush(cl, l_front.cnt[cl]);
+  }
+}
+#endif //MALLOC_USE_SHARED_HEAPS
+
+
+
+////////////////////////////////////////////////////////////////////////////
+// Library Functions
+////////////////////////////////////////////////////////////////////////////
+/*
+   malloc() allocates size bytes and returns a pointer to the allocated 
+   memory.  The memory is not cleared. 
+
+   PARAMETER
+   - size: bytes to allocate
+
+   RETURN VALUE
+   - Return a pointer to the allocated memory, which is suitably aligned for
+     any kind of variable.
+   - On error, return NULL.
+   - NULL may also be returned by a successful call to malloc() with a size
+     of zero.
+ */
+void *malloc(size_t size) {
+  inc_cnt_malloc();
+  malloc_timer_start();
+  trace_begin();
+
+#ifdef MALLOC_NEED_INIT
+  if (UNLIKELY(!g_initialized)) sf_malloc_init();
+#else
+  // malloc() should be called after library initialization through 
+  // sf_malloc_init() call.
+  assert(g_initialized != 0);
+#endif
+  bool exited = UNLIKELY(l_tlh.thread_id == DEAD_OWNER) && tlh_attach();
+  idle_enter();
+
+  // sf_malloc_release_free_memory_all() was called by another thread.
+  if (UNLIKELY(l_tlh.release_epoch != g_release_epoch)) {
+    l_tlh.release_epoch = g_release_epoch;
+    sf_malloc_release_free_memory();
+  }
+
+  void* ret;
+  if (size <= MAX_SIZE) {
+    uint32_t cl = get_sizeclass(size);
+#if defined(MALLOC_USE_PERCPU)
+    ret = pcpu_malloc(cl);
+#elif defined(MALLOC_USE_SHARED_HEAPS)
+    ret = front_malloc(cl);
+#else
+    ret = small_malloc(cl);
+#endif
+    hstat_inc_malloc(cl);
+  } else {
+    size_t page_len = GET_PAGE_LEN(size);
+    if (page_len <= NUM_PAGE_CLASSES) {
+      HEAP_LOCK();
+      ret = large_malloc(page_len);
+      HEAP_UNLOCK();
+      hstat_inc_malloc(HSTAT_LARGE);
+    } else {
+      ret = huge_malloc(page_len);
+      hstat_inc_malloc(HSTAT_HUGE);
+    }
+  }
+
+#ifdef MALLOC_USE_HEAP_PROF
+  l_tlh.prof_countdown -= size;
+  if (UNLIKELY(l_tlh.prof_countdown < 0)) prof_malloc_sample(ret, size);
+#endif
+  idle_leave();
+  if (UNLIKELY(exited)) exit_heap_leave();
+
+  trace_end(SF_TRACE_MALLOC, ret, size, 0);
+  malloc_timer_stop();
+
+  return ret;
+}
+
+
+/*
+   free() frees the memory space pointed to by ptr, which must have been 
+   returned by a previous call to malloc(), calloc() or realloc(). 
+   Otherwise, or if free(ptr) has already been called before, undefined 
+   behavior occurs.
+
+   PARAMETER
+   - ptr: pointer to free
+
+   RETURN VALUE
+   - Return no value.
+ */
+void free(void *ptr) {
+  inc_cnt_free();
+  free_timer_start();
+
+  if (UNLIKELY(ptr == NULL)) return;
+
+  bool exited = UNLIKELY(l_tlh.thread_id == DEAD_OWNER) && tlh_attach();
+  idle_enter();
+
+  // Record before the block can be reused by another thread.
+  trace_begin();
+  trace_free(ptr);
+
+  size_t page_id = (size_t)ptr >> PAGE_SHIFT;
+  void* val = pagemap_get(page_id);
+  assert(val != NULL);
+
+  if (UNLIKELY((uintptr_t)val & HUGE_MALLOC_MARK)) {
+#ifdef MALLOC_USE_HEAP_PROF
+    if ((uintptr_t)val & HUGE_MALLOC_SAMPLED) prof_free_sample(ptr);
+#endif
+    size_t size = (size_t)val & ~HUGE_MALLOC_FLAGS;
+    huge_free(ptr, size);
+    hstat_inc_free(HSTAT_HUGE);
+  } else {
+    pbh_t* pbh = (pbh_t*)val;
+#ifdef MALLOC_USE_HEAP_PROF
+    if (UNLIKELY(pbh->sampled)) prof_free_sample(ptr);
+#endif
+    if (pbh->sizeclass < NUM_CLASSES) {
+      hstat_inc_free(pbh->sizeclass);
+#if defined(MALLOC_USE_PERCPU)
+      pcpu_free(ptr, pbh);
+#elif defined(MALLOC_USE_SHARED_HEAPS)
+      front_free(ptr, pbh);
+#else
+      small_free(ptr, pbh);
+#endif
+    } else {
+      HEAP_LOCK();
+      large_free(ptr, pbh);
+      HEAP_UNLOCK();
+      hstat_inc_free(HSTAT_LARGE);
+    }
+  }
+  idle_leave();
+  if (UNLIKELY(exited)) exit_heap_leave();
+
+  trace_leave();
+  free_timer_stop();
+}
+
+
+/*
+   calloc() allocates memory for an array of nmemb elements of size bytes 
+   each and returns a pointer to the allocated memory.
+   The memory is set to zero.
+
+   PARAMETER
+   - nmemb: # of elements
+   - size: size of each element
 
-      void* ret = block->data;
-      block->data = GET_NEXT(ret);
-      block->length--;
+   RETURN VALUE
+   - Return a pointer to the allocated memory, which is suitably aligned for
+     any kind of variable.
+   - On error, return NULL.
+   - NULL may also be returned by a successful call to calloc() with nmemb 
+     or size equal to zero.
+ */
+void *calloc(size_t nmemb, size_t size) {
+  // If nmemb or size is 0, then calloc() returns either NULL, or a unique
+  // pointer value that can later be successfully passed to free().
+  if (nmemb == 0 || size == 0) {
+    return NULL;
+  }
 
-      return ret;
+  size_t total_size = nmemb * size;
+  void *ret = malloc(total_size);
+  if (ret) memset(ret, 0, total_size);
+
+  return ret;
+}
+
+
+/* 
+   realloc() changes the size of the memory block pointed to by ptr to size
+   bytes.  The contents will be unchanged to the minimum of the old and new 
+   sizes; newly allocated memory will be uninitialized.
+
+   PARAMETER
+   - ptr: pointer to existing memory block
+   - size: new size
+
+   RETURN VALUE
+   - Return a pointer to the newly allocated memory, which is suitably 
+     aligned for any kind of variable and may be different from ptr, 
+     or NULL if the request fails.
+   - If size was equal to 0, either NULL or a pointer suitable to be passed 
+     to free() is returned.
+   - If realloc() fails the original block is left untouched; 
+     it is not freed or moved. 
+ */
+void *realloc(void *ptr, size_t size) {
+  // If ptr is NULL, then the call is equivalent to malloc(size), for all 
+  // values of size.
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+
+  // If size is equal to zero, and ptr is not NULL, then the call is 
+  // equivalent to free(ptr).  Unless ptr is NULL, it must have been returned
+  // by an earlier call to malloc(), calloc() or realloc(). 
+  // If the area pointed to was moved, a free(ptr) is done.
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  inc_cnt_realloc();
+  realloc_timer_start();
+  trace_begin();
+
+  size_t old_size;
+  size_t page_id = (size_t)ptr >> PAGE_SHIFT;
+  void* val = pagemap_get(page_id);
+  if (UNLIKELY((uintptr_t)val & HUGE_MALLOC_MARK)) {
+    old_size = (size_t)val & ~HUGE_MALLOC_FLAGS;
+  } else {
+    pbh_t* pbh = (pbh_t*)val;
+    if (pbh->sizeclass < NUM_CLASSES) {
+      old_size = get_size_for_class(pbh->sizeclass);
+    } else {
+      old_size = pbh->length * PAGE_SIZE;
     }
   }
-  else {
-    inc_pcache_malloc_miss();
 
-    // Miss
-    pos = g_lru_table[pb_cache->state];
+  // If size is larger than old_size or size is smaller than the half of
+  // old_size, allocate a new block.
+  void* ret;
+  if ((size > old_size) || (size < (old_size / 2))) {
+    ret = malloc(size);
+    memcpy(ret, ptr, ((old_size < size) ? old_size : size));
+    free(ptr);
+  } else {
+    // Otherwise, return the original pointer.
+    ret = ptr;
+  }
 
-    // Update LRU state.
-    pb_cache->state = (pb_cache->state & g_way_table[pos].mask) |
-                      g_way_table[pos].set_bit;
+  trace_end(SF_TRACE_REALLOC, ret, size, ptr);
+  realloc_timer_stop();
 
-    // Evict the victim.
-    pb_cache_block_t* block = &pb_cache->block[pos];
-    if (block->data) {
-      inc_pcache_malloc_evict();
+  return ret;
+}
 
-      pb_cache_return(tlh, block->data);
 
-      block->data = NULL;
-      block->length = 0;
+/*
+   The function posix_memalign() allocates size bytes and places the address
+   of the allocated memory in *memptr.  The address of the allocated memory
+   will be a multiple of alignment, which must be a power of two and a 
+   multiple of sizeof(void *).  If size is 0, then posix_memalign() returns
+   either NULL, or a unique pointer value that can later be successfully
+   passed to free().
+
+   PARAMETER
+   - memptr: pointer for saving the pointer to the allocated memory
+   - alignment: alignment number
+   - size: bytes to allocate
+
+   RETURN VALUE
+   - Return zero on success, or one of the error values listed in ERRORS
+   
+   ERRORS
+   - EINVAL: The alignment argument was not a power of two, or was not a 
+             multiple of sizeof(void *).
+   - ENOMEM: There was insufficient memory to fulfill the allocation request. 
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  inc_cnt_memalign();
+  memalign_timer_start();
+  trace_begin();
+
+  if (size == 0) {
+    *memptr = NULL;
+    trace_end(SF_TRACE_MEMALIGN, *memptr, size, alignment);
+    memalign_timer_stop();
+    return 0;
+  }
+
+  // Check if alignment is a power of 2.
+  if ((alignment & (alignment - 1)) != 0) {
+    *memptr = NULL;
+    trace_end(SF_TRACE_MEMALIGN, *memptr, size, alignment);
+    memalign_timer_stop();
+    return EINVAL;
+  }
+
+  // Fall back to malloc if we would already align properly.
+  if (alignment <= get_alignment(size)) {
+    *memptr = malloc(size);
+    assert(((uintptr_t)(*memptr) % alignment) == 0);
+    trace_end(SF_TRACE_MEMALIGN, *memptr, size, alignment);
+    memalign_timer_stop();
+    return 0;
+  }
+
+  // Bigger alignment.
+  if (size <= MAX_SIZE && alignment < PAGE_SIZE) {
+    uint32_t cl = get_sizeclass(size);
+    while (cl < NUM_CLASSES &&
+           ((get_size_for_class(cl) & (alignment - 1)) != 0)) {
+      cl++;
+    }
+    if (cl < NUM_CLASSES) {
+      size = get_size_for_class(cl);
+      *memptr = malloc(size);
+      trace_end(SF_TRACE_MEMALIGN, *memptr, size, alignment);
+      memalign_timer_stop();
+      return 0;
     }
+  }
 
-    // Save the new page class.
-    pb_cache->tag.e[pos] = in;
+  // Use pagelist allocator.
+  if (alignment <= PAGE_SIZE) {
+    // size may not huge, but we need page allocation.
+    size_t page_num = GET_PAGE_LEN(size);
+    if (page_num <= NUM_PAGE_CLASSES) {
+      bool exited = UNLIKELY(l_tlh.thread_id == DEAD_OWNER) && tlh_attach();
+      idle_enter();
+      HEAP_LOCK();
+      *memptr = large_malloc(page_num);
+      HEAP_UNLOCK();
+      idle_leave();
+      if (UNLIKELY(exited)) exit_heap_leave();
+      hstat_inc_malloc(HSTAT_LARGE);
+    } else {
+      *memptr = huge_malloc(page_num);
+      hstat_inc_malloc(HSTAT_HUGE);
+    }
+    trace_end(SF_TRACE_MEMALIGN, *memptr, size, alignment);
+    memalign_timer_stop();
+    return 0;
   }
 
-  pbh_t* pbh = pb_alloc(tlh, page_len);
-  pbh->sizeclass = NUM_CLASSES;
-  return (void*)(pbh->start_page << PAGE_SHIFT);
-#else
-  pbh_t* pbh = pb_alloc(tlh, page_len);
-  pbh->sizeclass = NUM_CLASSES;
-  return (void*)(pbh->start_page << PAGE_SHIFT);
-#endif
+  // Allocate extra pages and carve off an aligned portion.
+  size_t alloc_pages = GET_PAGE_LEN(size + alignment);
+  void *new_blk = huge_malloc(alloc_pages);
+  assert(new_blk != NULL);
+  hstat_inc_malloc(HSTAT_HUGE);
+
+  void* ret_blk = new_blk;
+  while (((uintptr_t)ret_blk & (alignment - 1)) != 0) {
+    ret_blk += PAGE_SIZE;
+  }
+  assert(((size_t)(ret_blk - new_blk) >> PAGE_SHIFT) < alloc_pages);
+
+  if (ret_blk != new_blk) {
+    // We need split.
+    void* val = pagemap_get((size_t)new_blk >> PAGE_SHIFT);
+    size_t skip_size = (size_t)((uintptr_t)ret_blk - (uintptr_t)new_blk);
+    huge_free(new_blk, skip_size);
+
+    // A hugetlb block is aligned to its page size, so skip_size is a
+    // multiple of it.
+    uintptr_t flags = (uintptr_t)val & HUGE_MALLOC_FLAGS;
+    size_t size = ((size_t)val & ~HUGE_MALLOC_FLAGS) - skip_size;
+    size_t page_id = (size_t)ret_blk >> PAGE_SHIFT;
+    val = (void*)(size | flags);
+
+    pagemap_expand(page_id, 1);
+    pagemap_set(page_id, val);
+  }
+
+  *memptr = ret_blk;
+  trace_end(SF_TRACE_MEMALIGN, *memptr, size, alignment);
+  memalign_timer_stop();
+  return 0;
+}
+
+
+/*
+   valloc() allocates size bytes and returns a pointer to the allocated
+   memory.  The memory address will be a multiple of the page size.
+
+   PARAMETER
+   - size: bytes to allocate
+
+   RETURN VALUE
+   - Return the pointer to the allocated memory
+   - Return NULL if the request fails
+ */
+void *valloc(size_t size) {
+  void *free_blk;
+  int ret = posix_memalign(&free_blk, sysconf(_SC_PAGESIZE), size);
+  assert(ret == 0);
+
+  return free_blk;
+}
+
+
+/*
+   memalign() allocates size bytes and returns a pointer to the allocated
+   memory.  The memory address will be a multiple of boundary, which must 
+   be a power of two.
+
+   PARAMETER
+   - boundary: alignment number
+   - size: bytes to allocate
+
+   RETURN VALUE
+   - Return the pointer to the allocated memory
+   - Return NULL if the request fails
+ */
+void *memalign(size_t boundary, size_t size) {
+  void *free_blk;
+  int ret = posix_memalign(&free_blk, boundary, size);
+  assert(ret == 0);
+
+  return free_blk;
 }
 
 
-static inline void* huge_malloc(size_t page_len) {
-  // Use mmap directly.
-  size_t size = page_len << PAGE_SHIFT;
+////////////////////////////////////////////////////////////////////////////
+// Statistics Functions
+////////////////////////////////////////////////////////////////////////////
+#ifdef MALLOC_USE_HEAP_STATS
+static heap_stat_t* heap_stat_alloc() {
+  // Reuse a slot of an exited thread. Its counters are kept.
+  for (heap_stat_t* hs = g_heap_stat_list; hs != NULL; hs = hs->next) {
+    if (hs->active) continue;
+    if (atomic_xchg_uint(&hs->active, 1)) continue;
+    return hs;
+  }
 
-  void* ret = do_mmap(size);
+  // Allocate new pages and split them.
+  size_t chunk_size = (sizeof(heap_stat_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  heap_stat_t* first_hs = (heap_stat_t*)do_mmap(chunk_size);
+  first_hs->active = 1;
 
-  size_t page_id = (size_t)ret >> PAGE_SHIFT;
-  void* val = (void*)(size | HUGE_MALLOC_MARK);
+  uint32_t rem_len = (chunk_size / sizeof(heap_stat_t)) - 1;
 
-  pagemap_expand(page_id, 1);
-  pagemap_set(page_id, val);
+  heap_stat_t* last_hs = first_hs;
+  for (uint32_t i = 0; i < rem_len; i++) {
+    heap_stat_t* next_hs = last_hs + 1;
+    last_hs->next = next_hs;
+    last_hs = next_hs;
+  }
 
-  return ret;
-}
+  heap_stat_t* top;
+  do {
+    top = g_heap_stat_list;
+    last_hs->next = top;
+  } while (!CAS_ptr(&g_heap_stat_list, top, first_hs));
 
+  return first_hs;
+}
 
-static inline bool remote_free(tlh_t* tlh, pbh_t* pbh,
-                               void* first, void* last, uint32_t N) {
-  sph_t* sph = pbh_get_superpage(pbh);
-  uint32_t cl = pbh->sizeclass;
 
-  void* start_addr = (void*)(pbh->start_page << PAGE_SHIFT);
-  uint32_t size = get_size_for_class(cl);
-  uint16_t blk_idx = (uintptr_t)(first - start_addr) / size;
+static void heap_stat_free(heap_stat_t* hstat) {
+  hstat->active = 0;
+}
 
-  remote_list_t new_top;
-  new_top.head = blk_idx;
 
-  tlh->hazard_ptr->node = sph;
+/* Sum the counters of all slots. Counters of running threads are read
+   without synchronization, so the result is approximate. */
+static void heap_stat_sum(heap_stat_t* sum) {
+  memset(sum, 0, sizeof(heap_stat_t));
 
-  while (true) {
-    if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
-      if (take_superpage(tlh, sph)) {
-        tlh->hazard_ptr->node = NULL;
-        return false;
-      }
+  heap_stat_t* hs = &g_heap_stat_anon;
+  while (hs != NULL) {
+    for (uint32_t i = 0; i < NUM_CLASSES + 2; i++) {
+      sum->cnt_malloc[i] += hs->cnt_malloc[i];
+      sum->cnt_free[i]   += hs->cnt_free[i];
     }
-
-    remote_list_t top = pbh->remote_list;
-    if (top.cnt == 0) {
-      SET_NEXT(last, NULL);
-    } else {
-      void* head_addr = start_addr + (size * top.head);
-      SET_NEXT(last, head_addr);
+    sum->cnt_free_pb        += hs->cnt_free_pb;
+    sum->cnt_remote_free    += hs->cnt_remote_free;
+    sum->cnt_remote_retry   += hs->cnt_remote_retry;
+    sum->cnt_inbox_drain    += hs->cnt_inbox_drain;
+    sum->cnt_inbox_blk      += hs->cnt_inbox_blk;
+    if (hs->inbox_max_depth > sum->inbox_max_depth) {
+      sum->inbox_max_depth = hs->inbox_max_depth;
     }
-    new_top.cnt = top.cnt + N;
-
-    if (CAS64((uint64_t*)&pbh->remote_list, top.together, new_top.together)) {
-      sph->omark.finish_mark = DO_NOT_FINISH;
-      break;
+    sum->cnt_sp_adopt       += hs->cnt_sp_adopt;
+    sum->pcache_malloc_hit  += hs->pcache_malloc_hit;
+    sum->pcache_malloc_miss += hs->pcache_malloc_miss;
+    sum->pcache_free_hit    += hs->pcache_free_hit;
+    sum->pcache_free_miss   += hs->pcache_free_miss;
+    sum->pcpu_malloc_hit    += hs->pcpu_malloc_hit;
+    sum->pcpu_malloc_miss   += hs->pcpu_malloc_miss;
+    sum->pcpu_free_hit      += hs->pcpu_free_hit;
+    sum->pcpu_free_miss     += hs->pcpu_free_miss;
+    sum->heap_lock_wait     += hs->heap_lock_wait;
+    sum->idle_flush         += hs->idle_flush;
+    sum->tc_push            += hs->tc_push;
+    sum->tc_pop             += hs->tc_pop;
+    sum->pmap_cache_hit     += hs->pmap_cache_hit;
+    sum->pmap_cache_miss    += hs->pmap_cache_miss;
+#ifdef MALLOC_STATS
+    for (uint32_t i = 0; i < NUM_LAT; i++) {
+      for (uint32_t b = 0; b < NUM_LAT_BUCKETS; b++) {
+        sum->lat[i][b] += hs->lat[i][b];
+      }
     }
-  }
+    for (uint32_t i = 0; i < NUM_CAS; i++) {
+      sum->cas_attempt[i] += hs->cas_attempt[i];
+      sum->cas_fail[i]    += hs->cas_fail[i];
+      if (hs->cas_max_fail[i] > sum->cas_max_fail[i]) {
+        sum->cas_max_fail[i] = hs->cas_max_fail[i];
+      }
+    }
+#endif
 
-  if (UNLIKELY(sph->omark.owner_id == DEAD_OWNER)) {
-    take_superpage(tlh, sph);
+    hs = (hs == &g_heap_stat_anon) ? g_heap_stat_list : hs->next;
   }
+}
 
-  tlh->hazard_ptr->node = NULL;
 
-  return true;
+static inline uint64_t get_live(heap_stat_t* sum, uint32_t i) {
+  // A free may be counted before its malloc while we read.
+  return (sum->cnt_malloc[i] > sum->cnt_free[i])
+         ? sum->cnt_malloc[i] - sum->cnt_free[i] : 0;
 }
+#endif
 
 
-/* Deallocate a memory for small sizes. */
-static inline void small_free(void* ptr, pbh_t* pbh) {
-  tlh_t* tlh = &l_tlh;
-
-  if (pbh->status == PBH_AGAINST_FALSE_SHARING) {
-    sph_t* sph = pbh_get_superpage(pbh);
-    if (UNLIKELY(sph->omark.owner_id != tlh->thread_id)) {
-      // Try to free the block to the owner.
-      if (remote_free(tlh, pbh, ptr, ptr, 1))
-        return;
-    }
-  }
+void sf_malloc_get_stats(sf_malloc_stats_t* st) {
+  memset(st, 0, sizeof(sf_malloc_stats_t));
+  st->free_sp = (size_t)g_free_sp_len * SUPERPAGE_SIZE;
 
-  // Local free
-  uint32_t cl = pbh->sizeclass;
-  blk_list_t* b_list = &tlh->blk_list[cl];
+#ifdef MALLOC_USE_HEAP_STATS
+  heap_stat_t sum;
+  heap_stat_sum(&sum);
 
-  uint32_t threshold = get_blocks_for_class(cl);
-  if (UNLIKELY(b_list->cnt_free >= threshold)) {
-    tlh_return_list(tlh, cl);
+  st->mapped  = (g_size_mapped > 0) ? (size_t)g_size_mapped : 0;
+  st->free_pb = (sum.cnt_free_pb > 0)
+                ? (size_t)sum.cnt_free_pb << PAGE_SHIFT : 0;
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    st->live_small += get_live(&sum, cl);
   }
+  st->live_large  = get_live(&sum, HSTAT_LARGE);
+  st->live_huge   = get_live(&sum, HSTAT_HUGE);
+  st->remote_free = sum.cnt_remote_free;
+  st->remote_retry = sum.cnt_remote_retry;
+  st->inbox_drain  = sum.cnt_inbox_drain;
+  st->inbox_blocks = sum.cnt_inbox_blk;
+  st->inbox_max_depth = sum.inbox_max_depth;
+  st->sp_adopt    = sum.cnt_sp_adopt;
+  st->pcache_malloc_hit  = sum.pcache_malloc_hit;
+  st->pcache_malloc_miss = sum.pcache_malloc_miss;
+  st->pcache_free_hit    = sum.pcache_free_hit;
+  st->pcache_free_miss   = sum.pcache_free_miss;
+  st->pcpu_malloc_hit    = sum.pcpu_malloc_hit;
+  st->pcpu_malloc_miss   = sum.pcpu_malloc_miss;
+  st->pcpu_free_hit      = sum.pcpu_free_hit;
+  st->pcpu_free_miss     = sum.pcpu_free_miss;
+  st->heap_lock_wait     = sum.heap_lock_wait;
+  st->idle_flush         = sum.idle_flush;
+  st->tc_push            = sum.tc_push;
+  st->tc_pop             = sum.tc_pop;
+  st->pmap_cache_hit     = sum.pmap_cache_hit;
+  st->pmap_cache_miss    = sum.pmap_cache_miss;
+#endif
 
-  // Prepend the free block to the free block list for its size-class.
-  SET_NEXT(ptr, b_list->free_blk_list);
-  b_list->free_blk_list = ptr;
-  b_list->cnt_free++;
+#ifdef MALLOC_USE_PERCPU
+  // Read without synchronization, so the result is approximate.
+  for (uint32_t cpu = 0; cpu < PCPU_MAX_CPUS; cpu++) {
+    pcpu_cache_t* pc = g_pcpu[cpu];
+    if (pc == NULL) continue;
+    for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+      st->pcpu_cached += (size_t)pc->cnt[cl] * get_size_for_class(cl);
+    }
+  }
+#endif
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    st->tc_cached += (size_t)g_tc[cl].num * get_blocks_for_class(cl) *
+                     get_size_for_class(cl);
+  }
+#endif
 }
 
 
-static inline void large_free(void* ptr, pbh_t* pbh) {
-  tlh_t* tlh = &l_tlh;
-#ifdef MALLOC_USE_PAGE_BLOCK_CACHE
-  pb_cache_t* pb_cache = &tlh->pb_cache;
+int sf_malloc_get_class_stats(unsigned cl, size_t* size, uint64_t* live) {
+  if (cl >= NUM_CLASSES) return 0;
 
-  char in = (char)pbh->length;
-  char8_t v_in = {.v = (v8qi){in, in, in, in, in, in, in, in}};
+  *size = get_size_for_class(cl);
+#ifdef MALLOC_USE_HEAP_STATS
+  heap_stat_t sum;
+  heap_stat_sum(&sum);
+  *live = get_live(&sum, cl);
+#else
+  *live = 0;
+#endif
+  return 1;
+}
 
-  // Compare with cache
-  int pos;
-  char8_t v_cmp;
-  v_cmp.v = __builtin_ia32_pcmpeqb(pb_cache->tag.v, v_in.v);
-  if (*(uint64_t*)&v_cmp) {
-    inc_pcache_free_hit();
 
-    // Hit
-    pos = get_cache_hit_index(v_cmp.v);
+static inline double get_hit_rate(uint64_t hit, uint64_t miss) {
+  return (hit + miss) ? (100.0 * hit / (hit + miss)) : 0.0;
+}
 
-    // Link to the page cache.
-    pb_cache_block_t* block = &pb_cache->block[pos];
-    if (block->length < 2) {
-      // Page block cache keeps up to two PBs.
-      SET_NEXT(ptr, block->data);
-      block->data = ptr;
-      block->length++;
-    } else {
-      sph_t* sph = pbh_get_superpage(pbh);
-      if (sph->omark.owner_id == tlh->thread_id) {
-        pb_free(tlh, pbh);
-      } else {
-        pb_remote_free(tlh, ptr, pbh);
-      }
-    }
-  } else {
-    inc_pcache_free_miss();
 
-    // Miss
-    pos = g_lru_table[pb_cache->state];
+#ifdef MALLOC_STATS
+static const char* g_lat_names[NUM_LAT] = {
+  "malloc", "free", "realloc", "memalign",
+  "  small_fast", "  bump", "  pcache", "  pbh_refill", "  pb_alloc",
+  "  sph_alloc", "  sph_mmap", "  huge_malloc",
+  "  free_local", "  return_list", "  remote_free", "  pb_free",
+  "  huge_free"
+};
+
+/* Return the upper bound in cycles of the bucket holding the q-th
+   quantile (in permille). */
+static uint64_t lat_quantile(uint64_t* hist, uint64_t cnt, uint32_t q) {
+  uint64_t rank = (cnt * q + 999) / 1000;
+  uint64_t acc = 0;
+  for (uint32_t b = 0; b < NUM_LAT_BUCKETS; b++) {
+    acc += hist[b];
+    if (acc >= rank) return (uint64_t)2 << b;
+  }
+  return (uint64_t)2 << (NUM_LAT_BUCKETS - 1);
+}
 
-    // Evict the victim.
-    pb_cache_block_t* block = &pb_cache->block[pos];
-    if (block->data) {
-      inc_pcache_free_evict();
+static void print_lat_stats(heap_stat_t* sum) {
+  fprintf(stderr, "latency (cycles)   count        p50       p99     p99.9\n");
+  for (uint32_t i = 0; i < NUM_LAT; i++) {
+    uint64_t* hist = sum->lat[i];
+    uint64_t cnt = 0;
+    for (uint32_t b = 0; b < NUM_LAT_BUCKETS; b++) cnt += hist[b];
+    if (cnt == 0) continue;
+    fprintf(stderr, "%-14s %9lu %10lu %9lu %9lu\n", g_lat_names[i], cnt,
+            lat_quantile(hist, cnt, 500), lat_quantile(hist, cnt, 990),
+            lat_quantile(hist, cnt, 999));
+  }
+}
 
-      pb_cache_return(tlh, block->data);
-    }
+static const char* g_cas_names[NUM_CAS] = {
+  "free_sp_list", "remote_list", "remote_pb_list", "owner_mark",
+  "hazard_list", "orphan_list", "inbox"
+};
+
+static void print_cas_stats(heap_stat_t* sum) {
+  fprintf(stderr, "CAS              attempt       fail   fail%%  max_fail\n");
+  for (uint32_t i = 0; i < NUM_CAS; i++) {
+    if (sum->cas_attempt[i] == 0) continue;
+    fprintf(stderr, "%-14s %9lu %10lu %6.2f %9lu\n", g_cas_names[i],
+            sum->cas_attempt[i], sum->cas_fail[i],
+            100.0 * sum->cas_fail[i] / sum->cas_attempt[i],
+            sum->cas_max_fail[i]);
+  }
+}
+#endif
 
-    SET_NEXT(ptr, NULL);
-    block->data = ptr;
-    block->length = 1;
 
-    // Save the new page class.
-    pb_cache->tag.e[pos] = in;
-  }
+/* Print the process-wide statistics to stderr. */
+void malloc_stats() {
+  sf_malloc_stats_t st;
+  sf_malloc_get_stats(&st);
+
+  fprintf(stderr, "======= SFMALLOC STATISTICS =======\n"
+      "mapped   : %lu B (%.1f MB)\n"
+      "free pb  : %lu B (%.1f MB)\n"
+      "free sp  : %lu B (%.1f MB)\n"
+      "live     : small(%lu) large(%lu) huge(%lu)\n"
+      "remote   : free(%lu) retry(%lu)\n"
+      "inbox    : drain(%lu) blocks(%lu) max(%lu)\n"
+      "adopt    : sp(%lu)\n"
+      "pcache   : malloc(hit:%lu miss:%lu %.1f%%) free(hit:%lu miss:%lu %.1f%%)\n",
+      st.mapped, getMB(st.mapped),
+      st.free_pb, getMB(st.free_pb),
+      st.free_sp, getMB(st.free_sp),
+      st.live_small, st.live_large, st.live_huge,
+      st.remote_free, st.remote_retry,
+      st.inbox_drain, st.inbox_blocks, st.inbox_max_depth,
+      st.sp_adopt,
+      st.pcache_malloc_hit, st.pcache_malloc_miss,
+      get_hit_rate(st.pcache_malloc_hit, st.pcache_malloc_miss),
+      st.pcache_free_hit, st.pcache_free_miss,
+      get_hit_rate(st.pcache_free_hit, st.pcache_free_miss));
+#ifdef MALLOC_USE_PERCPU
+  fprintf(stderr,
+      "pcpu     : cached(%lu B) malloc(hit:%lu miss:%lu %.1f%%) "
+      "free(hit:%lu miss:%lu %.1f%%)\n",
+      st.pcpu_cached,
+      st.pcpu_malloc_hit, st.pcpu_malloc_miss,
+      get_hit_rate(st.pcpu_malloc_hit, st.pcpu_malloc_miss),
+      st.pcpu_free_hit, st.pcpu_free_miss,
+      get_hit_rate(st.pcpu_free_hit, st.pcpu_free_miss));
+#endif
+#ifdef MALLOC_USE_SHARED_HEAPS
+  fprintf(stderr, "heaps    : shared(%u) lock wait(%lu)\n",
+          g_heap_num, st.heap_lock_wait);
+#endif
+#ifdef MALLOC_USE_TRANSFER_CACHE
+  fprintf(stderr, "transfer : cached(%lu B) push(%lu) pop(%lu)\n",
+          st.tc_cached, st.tc_push, st.tc_pop);
+#endif
+#ifdef MALLOC_USE_PAGEMAP_CACHE
+  fprintf(stderr, "pagemap  : cache(hit:%lu miss:%lu %.1f%%)\n",
+          st.pmap_cache_hit, st.pmap_cache_miss,
+          get_hit_rate(st.pmap_cache_hit, st.pmap_cache_miss));
+#endif
+#ifdef MALLOC_USE_IDLE_FLUSH
+  fprintf(stderr, "idle     : flushed TLHs(%lu)%s\n", st.idle_flush,
+          g_idle_ok ? "" : " membarrier unavailable");
+#endif
 
-  // Update LRU state.
-  pb_cache->state = (pb_cache->state & g_way_table[pos].mask) |
-                    g_way_table[pos].set_bit;
-#else
-  sph_t* sph = pbh_get_superpage(pbh);
-  if (sph->omark.owner_id == tlh->thread_id) {
-    pb_free(tlh, pbh);
-  } else {
-    pb_remote_free(tlh, ptr, pbh);
+#ifdef MALLOC_USE_HEAP_STATS
+  heap_stat_t sum;
+  heap_stat_sum(&sum);
+
+  fprintf(stderr, "class     size        live\n");
+  for (uint32_t cl = 0; cl < NUM_CLASSES; cl++) {
+    uint64_t live = get_live(&sum, cl);
+    if (live == 0) continue;
+    fprintf(stderr, "%5u %8u %11lu\n", cl, get_size_for_class(cl), live);
   }
+#ifdef MALLOC_STATS
+  print_lat_stats(&sum);
+  print_cas_stats(&sum);
+#endif
 #endif
 }
 
 
-static inline void huge_free(void* ptr, size_t size) {
-  do_munmap(ptr, size);
-  pagemap_set((size_t)ptr >> PAGE_SHIFT, NULL);
+
+////////////////////////////////////////////////////////////////////////////
+// Control Functions
+////////////////////////////////////////////////////////////////////////////
+// Options read only at startup are set from SFMALLOC_OPTIONS or before the
+// first allocation, and are read-only afterwards.
+// The names are listed in sf_malloc.h with sf_mallctl(); keep both in sync.
+#define CTL_ANY       false, 0, UINT32_MAX
+#define CTL_BOOL      false, 0, 1
+#define CTL_STARTUP   true
+
+typedef struct {
+  const char*        name;
+  volatile uint32_t* var;
+  bool               startup_only;
+  uint32_t           min;         // range of valid values
+  uint32_t           max;
+} ctl_opt_t;
+
+static const ctl_opt_t g_ctl_opts[] = {
+  {"opt.free_sp_mult",      &g_free_sp_mult,      CTL_ANY},
+  {"opt.pb_cache_depth",    &g_pb_cache_depth,    CTL_ANY},
+  {"opt.return_list_pbhs",  &g_return_list_pbhs,  false, 0, 1024},
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+  {"opt.tlh_list_bytes",    &g_tlh_list_bytes,    CTL_ANY},
+#endif
+  {"opt.stats_print",       &g_stats_print,       CTL_BOOL},
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+  {"opt.thp",               &g_use_thp,           CTL_BOOL},
+#endif
+#ifdef MALLOC_USE_HUGETLB
+  {"opt.hugetlb",           &g_use_hugetlb,       CTL_BOOL},
+#endif
+#ifdef MALLOC_USE_HEAP_PROF
+  {"opt.prof_sample",       &g_prof_sample,       CTL_ANY},
+  {"opt.prof_signal",       &g_prof_signal,       CTL_STARTUP, 0, NSIG - 1},
+#endif
+#ifdef MALLOC_USE_TRACE
+  {"opt.trace",             &g_trace,             CTL_STARTUP, 0, 1},
+#endif
+#ifdef MALLOC_USE_PERCPU
+  {"opt.percpu",            &g_percpu,            CTL_STARTUP, 0, 1},
+#endif
+#ifdef MALLOC_USE_SHARED_HEAPS
+  {"opt.heaps",             &g_num_heaps,         CTL_STARTUP, 0,
+   MAX_SHARED_HEAPS},
+#endif
+#ifdef MALLOC_USE_ARENA
+  {"opt.arena",             &g_arena,             CTL_STARTUP, 0, 1},
+#endif
+#ifdef MALLOC_USE_IDLE_FLUSH
+  {"opt.idle_flush_ms",     &g_idle_flush_ms,     CTL_ANY},
+  {"opt.idle_flush_events", &g_idle_flush_events, CTL_ANY},
+#endif
+#ifdef MALLOC_USE_DECAY_PURGE
+  {"opt.purge",             &g_purge,             CTL_BOOL},
+  {"opt.purge_decay_ms",    &g_purge_decay,       CTL_ANY},
+  {"opt.purge_interval_ms", &g_purge_interval,    CTL_ANY},
+#endif
+#ifdef MALLOC_USE_BG_THREAD
+  {"opt.bg_interval_ms",    &g_bg_interval,       false, 1, UINT32_MAX},
+#endif
+};
+
+typedef struct {
+  const char* name;
+  size_t      offset;
+} ctl_stat_t;
+
+#define CTL_STAT(f)   {"stats." #f, offsetof(sf_malloc_stats_t, f)}
+static const ctl_stat_t g_ctl_stats[] = {
+  CTL_STAT(mapped),
+  CTL_STAT(free_pb),
+  CTL_STAT(free_sp),
+  CTL_STAT(live_small),
+  CTL_STAT(live_large),
+  CTL_STAT(live_huge),
+  CTL_STAT(remote_free),
+  CTL_STAT(remote_retry),
+  CTL_STAT(inbox_drain),
+  CTL_STAT(inbox_blocks),
+  CTL_STAT(inbox_max_depth),
+  CTL_STAT(sp_adopt),
+  CTL_STAT(pcache_malloc_hit),
+  CTL_STAT(pcache_malloc_miss),
+  CTL_STAT(pcache_free_hit),
+  CTL_STAT(pcache_free_miss),
+  CTL_STAT(pcpu_cached),
+  CTL_STAT(pcpu_malloc_hit),
+  CTL_STAT(pcpu_malloc_miss),
+  CTL_STAT(pcpu_free_hit),
+  CTL_STAT(pcpu_free_miss),
+  CTL_STAT(heap_lock_wait),
+  CTL_STAT(idle_flush),
+  CTL_STAT(tc_cached),
+  CTL_STAT(tc_push),
+  CTL_STAT(tc_pop),
+  CTL_STAT(pmap_cache_hit),
+  CTL_STAT(pmap_cache_miss),
+};
+
+#define CTL_NUM(t)    (sizeof(t) / sizeof(t[0]))
+
+
+/* Copy the value of var out to oldp and in from newp. */
+static int ctl_value(void* var, size_t size, bool writable,
+                     void* oldp, size_t* oldlen, void* newp, size_t newlen) {
+  if (oldp != NULL) {
+    if (oldlen == NULL || *oldlen != size) return EINVAL;
+    memcpy(oldp, var, size);
+  }
+  if (newp != NULL) {
+    if (!writable) return EPERM;
+    if (newlen != size) return EINVAL;
+    memcpy(var, newp, size);
+  }
+  return 0;
 }
 
 
+/* Read and write the option named name. startup is true while the options
+   read only at startup may still be written. */
+static int ctl_opt(const char* name, bool startup, void* oldp,
+                   size_t* oldlen, void* newp, size_t newlen) {
+  for (uint32_t i = 0; i < CTL_NUM(g_ctl_opts); i++) {
+    const ctl_opt_t* o = &g_ctl_opts[i];
+    if (strcmp(name, o->name) != 0) continue;
+
+    if (newp != NULL) {
+      if (o->startup_only && !startup) return EPERM;
+      if (newlen != sizeof(uint32_t)) return EINVAL;
+      uint32_t v;
+      memcpy(&v, newp, sizeof(v));
+      if (v < o->min || v > o->max) return EINVAL;
+    }
+    return ctl_value((void*)o->var, sizeof(uint32_t), true,
+                     oldp, oldlen, newp, newlen);
+  }
+  return ENOENT;
+}
 
-////////////////////////////////////////////////////////////////////////////
-// Library Functions
-////////////////////////////////////////////////////////////////////////////
-/*
-   malloc() allocates size bytes and returns a pointer to the allocated 
-   memory.  The memory is not cleared. 
 
-   PARAMETER
-   - size: bytes to allocate
+int sf_mallctl(const char* name, void* oldp, size_t* oldlen,
+               void* newp, size_t newlen) {
+  if (strncmp(name, "opt.", 4) == 0) {
+    int ret = ctl_opt(name, !g_initialized, oldp, oldlen, newp, newlen);
+    if (ret != ENOENT) return ret;
+  }
 
-   RETURN VALUE
-   - Return a pointer to the allocated memory, which is suitably aligned for
-     any kind of variable.
-   - On error, return NULL.
-   - NULL may also be returned by a successful call to malloc() with a size
-     of zero.
- */
-void *malloc(size_t size) {
-  inc_cnt_malloc();
-  malloc_timer_start();
+  for (uint32_t i = 0; i < CTL_NUM(g_ctl_stats); i++) {
+    if (strcmp(name, g_ctl_stats[i].name) == 0) {
+      sf_malloc_stats_t st;
+      sf_malloc_get_stats(&st);
+      return ctl_value((void*)&st + g_ctl_stats[i].offset, sizeof(uint64_t),
+                       false, oldp, oldlen, newp, newlen);
+    }
+  }
 
-#ifdef MALLOC_NEED_INIT
-  if (UNLIKELY(!g_initialized)) sf_malloc_init();
-  if (UNLIKELY(l_tlh.thread_id == 0)) sf_malloc_thread_init();
-#else
-  // malloc() should be called after library initialization through 
-  // sf_malloc_init() call.
-  assert(g_initialized != 0);
-#endif
+  // stats.class.<cl>.size or stats.class.<cl>.live
+  unsigned cl;
+  char field[8];
+  if (sscanf(name, "stats.class.%u.%7s", &cl, field) == 2) {
+    size_t size;
+    uint64_t live;
+    if (!sf_malloc_get_class_stats(cl, &size, &live)) return ENOENT;
+    if (strcmp(field, "size") == 0) {
+      return ctl_value(&size, sizeof(size), false,
+                       oldp, oldlen, newp, newlen);
+    } else if (strcmp(field, "live") == 0) {
+      return ctl_value(&live, sizeof(live), false,
+                       oldp, oldlen, newp, newlen);
+    }
+    return ENOENT;
+  }
 
-  void* ret;
-  if (size <= MAX_SIZE) {
-    uint32_t cl = get_sizeclass(size);
-    ret = small_malloc(cl);
-  } else {
-    size_t page_len = GET_PAGE_LEN(size);
-    if (page_len <= NUM_PAGE_CLASSES) {
-      ret = large_malloc(page_len);
-    } else {
-      ret = huge_malloc(page_len);
+#ifdef MALLOC_USE_HEAP_PROF
+  // prof.dump takes the file name (const char*) or NULL.
+  if (strcmp(name, "prof.dump") == 0) {
+    if (oldp != NULL) return EPERM;
+    const char* path = NULL;
+    if (newp != NULL) {
+      if (newlen != sizeof(const char*)) return EINVAL;
+      path = *(const char**)newp;
     }
+    return sf_malloc_prof_dump(path);
   }
+#endif
 
-  malloc_timer_stop();
+  if (strcmp(name, "release") == 0) {
+    if (newp != NULL) return EPERM;
+    size_t released = sf_malloc_release_free_memory();
+    return ctl_value(&released, sizeof(released), false,
+                     oldp, oldlen, NULL, 0);
+  }
 
-  return ret;
+  return ENOENT;
 }
 
 
-/*
-   free() frees the memory space pointed to by ptr, which must have been 
-   returned by a previous call to malloc(), calloc() or realloc(). 
-   Otherwise, or if free(ptr) has already been called before, undefined 
-   behavior occurs.
-
-   PARAMETER
-   - ptr: pointer to free
+/* Print a warning about SFMALLOC_OPTIONS without allocating memory. */
+static void options_warn(const char* msg, const char* opt, size_t len) {
+  const char* prefix = "sfmalloc: SFMALLOC_OPTIONS: ";
+  if (write(STDERR_FILENO, prefix, strlen(prefix)) < 0) return;
+  if (write(STDERR_FILENO, msg, strlen(msg)) < 0) return;
+  if (write(STDERR_FILENO, opt, len) < 0) return;
+  if (write(STDERR_FILENO, "\n", 1) < 0) return;
+}
 
-   RETURN VALUE
-   - Return no value.
- */
-void free(void *ptr) {
-  inc_cnt_free();
-  free_timer_start();
 
-#ifdef MALLOC_NEED_INIT
-  if (UNLIKELY(l_tlh.thread_id == 0)) sf_malloc_thread_init();
+/* Set one "key:value" option. The value is a number, or a word for
+   purge_advice. Return false if the option is not valid. */
+static bool options_set(const char* key, size_t key_len,
+                        const char* val, size_t val_len) {
+  char name[64] = "opt.";
+  if (key_len == 0 || key_len + 4 >= sizeof(name)) return false;
+  memcpy(name + 4, key, key_len);
+  name[key_len + 4] = '\0';
+
+#ifdef MALLOC_USE_DECAY_PURGE
+  if (strcmp(name, "opt.purge_advice") == 0) {
+    if (val_len == 8 && strncmp(val, "dontneed", 8) == 0) {
+      g_purge_advice = MADV_DONTNEED;
+      return true;
+    }
+#ifdef MADV_FREE
+    if (val_len == 4 && strncmp(val, "free", 4) == 0) {
+      g_purge_advice = MADV_FREE;
+      return true;
+    }
+#endif
+    return false;
+  }
 #endif
 
-  if (UNLIKELY(ptr == NULL)) return;
+  uint32_t v = 0;
+  if (val_len == 0 || val_len > 9) return false;
+  for (size_t i = 0; i < val_len; i++) {
+    if (val[i] < '0' || val[i] > '9') return false;
+    v = v * 10 + (val[i] - '0');
+  }
+  return ctl_opt(name, true, NULL, NULL, &v, sizeof(v)) == 0;
+}
 
-  size_t page_id = (size_t)ptr >> PAGE_SHIFT;
-  void* val = pagemap_get(page_id);
-  assert(val != NULL);
 
-  if (UNLIKELY((uintptr_t)val & HUGE_MALLOC_MARK)) {
-    size_t size = (size_t)val & ~HUGE_MALLOC_MARK;
-    huge_free(ptr, size);
-  } else {
-    pbh_t* pbh = (pbh_t*)val;
-    if (pbh->sizeclass < NUM_CLASSES) {
-      small_free(ptr, pbh);
-    } else {
-      large_free(ptr, pbh);
+/* Parse SFMALLOC_OPTIONS="key:value,key:value,...". The keys are the opt.*
+   names of sf_mallctl() without "opt.", plus purge_advice:free|dontneed.
+   This runs before any allocation and must not allocate. */
+static void options_init() {
+  const char* opts = getenv("SFMALLOC_OPTIONS");
+  if (opts == NULL) return;
+
+  const char* p = opts;
+  while (*p != '\0') {
+    const char* end = strchr(p, ',');
+    if (end == NULL) end = p + strlen(p);
+
+    const char* colon = memchr(p, ':', end - p);
+    if (colon == NULL ||
+        !options_set(p, colon - p, colon + 1, end - colon - 1)) {
+      options_warn("invalid option: ", p, end - p);
     }
+
+    p = (*end == ',') ? end + 1 : end;
   }
+}
 
-  free_timer_stop();
+
+////////////////////////////////////////////////////////////////////////////
+// Heap Profile Functions
+////////////////////////////////////////////////////////////////////////////
+#ifdef MALLOC_USE_HEAP_PROF
+/* A dump calls open() and snprintf(), which are not async-signal-safe, so
+   the handler only requests it. prof_dump_requested() writes it. */
+static void prof_signal_handler(int sig) {
+  g_prof_dump_req = 1;
 }
 
 
-/*
-   calloc() allocates memory for an array of nmemb elements of size bytes 
-   each and returns a pointer to the allocated memory.
-   The memory is set to zero.
+/* Write the dump requested by opt.prof_signal, if any. This runs on the
+   next sample of any thread and in the background thread. */
+static void prof_dump_requested() {
+  if (g_prof_dump_req == 0) return;
+  if (atomic_xchg_uint(&g_prof_dump_req, 0) == 0) return;
 
-   PARAMETER
-   - nmemb: # of elements
-   - size: size of each element
+  int saved_errno = errno;
+  sf_malloc_prof_dump(NULL);
+  errno = saved_errno;
+}
 
-   RETURN VALUE
-   - Return a pointer to the allocated memory, which is suitably aligned for
-     any kind of variable.
-   - On error, return NULL.
-   - NULL may also be returned by a successful call to calloc() with nmemb 
-     or size equal to zero.
- */
-void *calloc(size_t nmemb, size_t size) {
-  // If nmemb or size is 0, then calloc() returns either NULL, or a unique
-  // pointer value that can later be successfully passed to free().
-  if (nmemb == 0 || size == 0) {
-    return NULL;
+
+/* Install the handler of opt.prof_signal. */
+static void prof_init() {
+  if (g_prof_signal == 0) return;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = prof_signal_handler;
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(g_prof_signal, &sa, NULL)) {
+    options_warn("invalid option: ", "prof_signal", 11);
   }
+}
 
-  size_t total_size = nmemb * size;
-  void *ret = malloc(total_size);
-  if (ret) memset(ret, 0, total_size);
 
-  return ret;
+/* Draw the next sampling interval from the exponential distribution with
+   the mean of opt.prof_sample, so that pprof can unsample the profile. */
+static int64_t prof_next_interval(tlh_t* tlh) {
+  uint32_t mean = g_prof_sample;
+  if (mean == 0) return PROF_IDLE_BYTES;
+
+  // xorshift64
+  uint64_t x = tlh->prof_rand;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  tlh->prof_rand = x;
+
+  // q is uniform in [1, 2^26]. -ln(q / 2^26) is computed with a quadratic
+  // approximation of log2 of the mantissa, which is good enough here.
+  uint64_t q = (x >> 38) + 1;
+  int e = 63 - __builtin_clzll(q);
+  double m = (double)q / ((uint64_t)1 << e);
+  double log2_q = e + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+  return (int64_t)((26 - log2_q) * 0.69314718 * mean) + 1;
 }
 
 
-/* 
-   realloc() changes the size of the memory block pointed to by ptr to size
-   bytes.  The contents will be unchanged to the minimum of the old and new 
-   sizes; newly allocated memory will be uninitialized.
+static inline uint32_t prof_hash(void* ptr) {
+  return ((uintptr_t)ptr * 0x9E3779B97F4A7C15ULL) >> 48;
+}
 
-   PARAMETER
-   - ptr: pointer to existing memory block
-   - size: new size
 
-   RETURN VALUE
-   - Return a pointer to the newly allocated memory, which is suitably 
-     aligned for any kind of variable and may be different from ptr, 
-     or NULL if the request fails.
-   - If size was equal to 0, either NULL or a pointer suitable to be passed 
-     to free() is returned.
-   - If realloc() fails the original block is left untouched; 
-     it is not freed or moved. 
- */
-void *realloc(void *ptr, size_t size) {
-  // If ptr is NULL, then the call is equivalent to malloc(size), for all 
-  // values of size.
-  if (ptr == NULL) {
-    return malloc(size);
-  }
+static prof_sample_t* prof_table_get() {
+  prof_sample_t* table = g_prof_table;
+  if (table != NULL) return table;
 
-  // If size is equal to zero, and ptr is not NULL, then the call is 
-  // equivalent to free(ptr).  Unless ptr is NULL, it must have been returned
-  // by an earlier call to malloc(), calloc() or realloc(). 
-  // If the area pointed to was moved, a free(ptr) is done.
-  if (size == 0) {
-    free(ptr);
-    return NULL;
+  size_t size = PROF_TABLE_SIZE * sizeof(prof_sample_t);
+  table = (prof_sample_t*)do_mmap(size);
+  if (!CAS_ptr(&g_prof_table, NULL, table)) {
+    do_munmap(table, size);
+    table = g_prof_table;
   }
+  return table;
+}
 
-  inc_cnt_realloc();
-  realloc_timer_start();
 
-  size_t old_size;
-  size_t page_id = (size_t)ptr >> PAGE_SHIFT;
-  void* val = pagemap_get(page_id);
-  if (UNLIKELY((uintptr_t)val & HUGE_MALLOC_MARK)) {
-    old_size = (size_t)val & ~HUGE_MALLOC_MARK;
-  } else {
-    pbh_t* pbh = (pbh_t*)val;
-    if (pbh->sizeclass < NUM_CLASSES) {
-      old_size = get_size_for_class(pbh->sizeclass);
+/* Called when the countdown of the thread runs out. Record the backtrace
+   of ptr in the sample table and mark its pbh or pagemap entry, so that
+   free() can find it. */
+static void prof_malloc_sample(void* ptr, size_t size) {
+  tlh_t* tlh = &l_tlh;
+  tlh->prof_countdown = prof_next_interval(tlh);
+  prof_dump_requested();
+  if (g_prof_sample == 0 || ptr == NULL || l_prof_busy) return;
+  l_prof_busy = 1;
+
+  // Skip this function and malloc().
+  void* stack[PROF_MAX_DEPTH + 2];
+  int depth = backtrace(stack, PROF_MAX_DEPTH + 2) - 2;
+  if (depth < 0) depth = 0;
+
+  prof_sample_t* table = prof_table_get();
+  uint32_t h = prof_hash(ptr);
+  for (uint32_t i = 0; i < PROF_MAX_PROBE; i++) {
+    prof_sample_t* slot = &table[(h + i) & (PROF_TABLE_SIZE - 1)];
+    void* old = slot->ptr;
+    if (old != PROF_SLOT_EMPTY && old != PROF_SLOT_DELETED) continue;
+    if (!CAS_ptr(&slot->ptr, old, PROF_SLOT_BUSY)) continue;
+
+    slot->size  = size;
+    slot->depth = depth;
+    memcpy(slot->stack, stack + 2, depth * sizeof(void*));
+    CAS_ptr(&slot->ptr, PROF_SLOT_BUSY, ptr);   // publish
+
+    atomic_add_uint64(&g_prof_alloc_cnt, 1);
+    atomic_add_uint64(&g_prof_alloc_size, size);
+
+    size_t page_id = (size_t)ptr >> PAGE_SHIFT;
+    void* val = pagemap_get(page_id);
+    if ((uintptr_t)val & HUGE_MALLOC_MARK) {
+      pagemap_set(page_id, (void*)((uintptr_t)val | HUGE_MALLOC_SAMPLED));
     } else {
-      old_size = pbh->length * PAGE_SIZE;
+      ((pbh_t*)val)->sampled = 1;
     }
+    break;
   }
+  // The sample is dropped if the table is too full.
 
-  // If size is larger than old_size or size is smaller than the half of
-  // old_size, allocate a new block.
-  void* ret;
-  if ((size > old_size) || (size < (old_size / 2))) {
-    ret = malloc(size);
-    memcpy(ret, ptr, ((old_size < size) ? old_size : size));
-    free(ptr);
-  } else {
-    // Otherwise, return the original pointer.
-    ret = ptr;
-  }
+  l_prof_busy = 0;
+}
 
-  realloc_timer_stop();
 
-  return ret;
+/* Remove ptr from the sample table if it is there. */
+static void prof_free_sample(void* ptr) {
+  prof_sample_t* table = g_prof_table;
+  if (table == NULL) return;
+
+  uint32_t h = prof_hash(ptr);
+  for (uint32_t i = 0; i < PROF_MAX_PROBE; i++) {
+    prof_sample_t* slot = &table[(h + i) & (PROF_TABLE_SIZE - 1)];
+    void* cur = slot->ptr;
+    if (cur == ptr) {
+      slot->ptr = PROF_SLOT_DELETED;
+      return;
+    }
+    if (cur == PROF_SLOT_EMPTY) return;
+  }
 }
 
 
-/*
-   The function posix_memalign() allocates size bytes and places the address
-   of the allocated memory in *memptr.  The address of the allocated memory
-   will be a multiple of alignment, which must be a power of two and a 
-   multiple of sizeof(void *).  If size is 0, then posix_memalign() returns
-   either NULL, or a unique pointer value that can later be successfully
-   passed to free().
+typedef struct {
+  int    fd;
+  size_t len;
+  char   data[4096];
+} prof_buf_t;
 
-   PARAMETER
-   - memptr: pointer for saving the pointer to the allocated memory
-   - alignment: alignment number
-   - size: bytes to allocate
+static void prof_flush(prof_buf_t* buf) {
+  size_t off = 0;
+  while (off < buf->len) {
+    ssize_t n = write(buf->fd, buf->data + off, buf->len - off);
+    if (n <= 0) break;
+    off += n;
+  }
+  buf->len = 0;
+}
 
-   RETURN VALUE
-   - Return zero on success, or one of the error values listed in ERRORS
-   
-   ERRORS
-   - EINVAL: The alignment argument was not a power of two, or was not a 
-             multiple of sizeof(void *).
-   - ENOMEM: There was insufficient memory to fulfill the allocation request. 
- */
-int posix_memalign(void **memptr, size_t alignment, size_t size) {
-  inc_cnt_memalign();
-  memalign_timer_start();
+static void prof_printf(prof_buf_t* buf, const char* fmt, ...) {
+  if (buf->len + 128 > sizeof(buf->data)) prof_flush(buf);
 
-  if (size == 0) {
-    *memptr = NULL;
-    memalign_timer_stop();
-    return 0;
-  }
+  va_list ap;
+  va_start(ap, fmt);
+  size_t rem = sizeof(buf->data) - buf->len;
+  int n = vsnprintf(buf->data + buf->len, rem, fmt, ap);
+  va_end(ap);
+  if (n > 0) buf->len += ((size_t)n < rem) ? (size_t)n : rem - 1;
+}
 
-  // Check if alignment is a power of 2.
-  if ((alignment & (alignment - 1)) != 0) {
-    *memptr = NULL;
-    memalign_timer_stop();
-    return EINVAL;
-  }
 
-  // Fall back to malloc if we would already align properly.
-  if (alignment <= get_alignment(size)) {
-    *memptr = malloc(size);
-    assert(((uintptr_t)(*memptr) % alignment) == 0);
-    memalign_timer_stop();
-    return 0;
+/* Copy a live sample out of the table. Return false if the slot is not
+   a live sample. */
+static bool prof_read_sample(prof_sample_t* slot, prof_sample_t* s) {
+  void* ptr = slot->ptr;
+  if (ptr == PROF_SLOT_EMPTY || ptr == PROF_SLOT_DELETED ||
+      ptr == PROF_SLOT_BUSY) {
+    return false;
   }
+  memcpy(s, slot, sizeof(prof_sample_t));
+  if (s->depth > PROF_MAX_DEPTH) s->depth = PROF_MAX_DEPTH;
+  return slot->ptr == ptr;
+}
 
-  // Bigger alignment.
-  if (size <= MAX_SIZE && alignment < PAGE_SIZE) {
-    uint32_t cl = get_sizeclass(size);
-    while (cl < NUM_CLASSES &&
-           ((get_size_for_class(cl) & (alignment - 1)) != 0)) {
-      cl++;
-    }
-    if (cl < NUM_CLASSES) {
-      size = get_size_for_class(cl);
-      *memptr = malloc(size);
-      memalign_timer_stop();
-      return 0;
+
+/* Write the live samples in the legacy heap profile format of pprof.
+   This does not allocate, so it can be called from malloc(). */
+static void prof_dump(int fd) {
+  prof_buf_t buf;
+  buf.fd  = fd;
+  buf.len = 0;
+
+  prof_sample_t* table = g_prof_table;
+  prof_sample_t s;
+
+  uint64_t cnt = 0, size = 0;
+  for (uint32_t i = 0; table != NULL && i < PROF_TABLE_SIZE; i++) {
+    if (!prof_read_sample(&table[i], &s)) continue;
+    cnt++;
+    size += s.size;
+  }
+  prof_printf(&buf, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%u\n",
+              cnt, size, g_prof_alloc_cnt, g_prof_alloc_size,
+              g_prof_sample);
+
+  for (uint32_t i = 0; table != NULL && i < PROF_TABLE_SIZE; i++) {
+    if (!prof_read_sample(&table[i], &s)) continue;
+    prof_printf(&buf, "1: %lu [1: %lu] @", s.size, s.size);
+    for (uint32_t d = 0; d < s.depth; d++) {
+      prof_printf(&buf, " %p", s.stack[d]);
     }
+    prof_printf(&buf, "\n");
   }
 
-  // Use pagelist allocator.
-  if (alignment <= PAGE_SIZE) {
-    // size may not huge, but we need page allocation.
-    size_t page_num = GET_PAGE_LEN(size);
-    if (page_num <= NUM_PAGE_CLASSES) {
-      *memptr = large_malloc(page_num);
-    } else {
-      *memptr = huge_malloc(page_num);
+  // pprof needs the mappings to symbolize shared libraries.
+  prof_printf(&buf, "\nMAPPED_LIBRARIES:\n");
+  prof_flush(&buf);
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps >= 0) {
+    ssize_t n;
+    while ((n = read(maps, buf.data, sizeof(buf.data))) > 0) {
+      buf.len = n;
+      prof_flush(&buf);
     }
-    memalign_timer_stop();
-    return 0;
+    close(maps);
   }
+}
+#endif
 
-  // Allocate extra pages and carve off an aligned portion.
-  size_t alloc_pages = GET_PAGE_LEN(size + alignment);
-  void *new_blk = huge_malloc(alloc_pages);
-  assert(new_blk != NULL);
 
-  void* ret_blk = new_blk;
-  while (((uintptr_t)ret_blk & (alignment - 1)) != 0) {
-    ret_blk += PAGE_SIZE;
+int sf_malloc_prof_dump(const char* path) {
+#ifdef MALLOC_USE_HEAP_PROF
+  char name[64];
+  if (path == NULL) {
+    snprintf(name, sizeof(name), "sfmalloc.%d.%u.heap", (int)getpid(),
+             atomic_inc_uint(&g_prof_dump_seq));
+    path = name;
   }
-  assert(((size_t)(ret_blk - new_blk) >> PAGE_SHIFT) < alloc_pages);
 
-  if (ret_blk != new_blk) {
-    // We need split.
-    void* val = pagemap_get((size_t)new_blk >> PAGE_SHIFT);
-    size_t skip_size = (size_t)((uintptr_t)ret_blk - (uintptr_t)new_blk);
-    huge_free(new_blk, skip_size);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return errno;
+  prof_dump(fd);
+  close(fd);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
 
-    size_t size = ((size_t)val & ~HUGE_MALLOC_MARK) - skip_size;
-    size_t page_id = (size_t)ret_blk >> PAGE_SHIFT;
-    val = (void*)(size | HUGE_MALLOC_MARK);
 
-    pagemap_expand(page_id, 1);
-    pagemap_set(page_id, val);
+////////////////////////////////////////////////////////////////////////////
+// Allocation Trace Functions
+////////////////////////////////////////////////////////////////////////////
+#ifdef MALLOC_USE_TRACE
+/* Open the trace file if opt.trace is set. */
+static void trace_init() {
+  if (g_trace == 0) return;
+
+  char name[64];
+  snprintf(name, sizeof(name), "sfmalloc.%d.trace", (int)getpid());
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    options_warn("cannot open ", name, strlen(name));
+    return;
   }
 
-  *memptr = ret_blk;
-  memalign_timer_stop();
-  return 0;
+  uint64_t magic = SF_TRACE_MAGIC;
+  if (write(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+    close(fd);
+    return;
+  }
+  g_trace_fd = fd;
 }
 
 
-/*
-   valloc() allocates size bytes and returns a pointer to the allocated
-   memory.  The memory address will be a multiple of the page size.
+static trace_buf_t* trace_buf_alloc() {
+  // Reuse a buffer of an exited thread.
+  for (trace_buf_t* tb = g_trace_buf_list; tb != NULL; tb = tb->next) {
+    if (tb->active) continue;
+    if (atomic_xchg_uint(&tb->active, 1)) continue;
+    return tb;
+  }
 
-   PARAMETER
-   - size: bytes to allocate
+  trace_buf_t* tb = (trace_buf_t*)do_mmap(TRACE_BUF_SIZE);
+  tb->active = 1;
+  tb->len = 0;
 
-   RETURN VALUE
-   - Return the pointer to the allocated memory
-   - Return NULL if the request fails
- */
-void *valloc(size_t size) {
-  void *free_blk;
-  int ret = posix_memalign(&free_blk, sysconf(_SC_PAGESIZE), size);
-  assert(ret == 0);
+  trace_buf_t* top;
+  do {
+    top = g_trace_buf_list;
+    tb->next = top;
+  } while (!CAS_ptr(&g_trace_buf_list, top, tb));
 
-  return free_blk;
+  return tb;
 }
 
 
-/*
-   memalign() allocates size bytes and returns a pointer to the allocated
-   memory.  The memory address will be a multiple of boundary, which must 
-   be a power of two.
+static void trace_record(uint32_t op, void* ptr, size_t size, uintptr_t arg) {
+  trace_buf_t* tb = l_trace_buf;
+  if (UNLIKELY(tb == NULL)) {
+    tb = trace_buf_alloc();
+    l_trace_buf = tb;
+  }
 
-   PARAMETER
-   - boundary: alignment number
-   - size: bytes to allocate
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-   RETURN VALUE
-   - Return the pointer to the allocated memory
-   - Return NULL if the request fails
- */
-void *memalign(size_t boundary, size_t size) {
-  void *free_blk;
-  int ret = posix_memalign(&free_blk, boundary, size);
-  assert(ret == 0);
+  sf_trace_rec_t* rec = &tb->rec[tb->len];
+  rec->time   = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->ptr    = (uintptr_t)ptr;
+  rec->arg    = arg;
+  rec->size   = size;
+  rec->thread = l_tlh.thread_id;
+  rec->op     = op;
 
-  return free_blk;
+  if (++tb->len == TRACE_BUF_RECS) trace_flush(tb);
 }
 
 
-////////////////////////////////////////////////////////////////////////////
-// Statistics Functions
-////////////////////////////////////////////////////////////////////////////
-void malloc_stats() {
+/* Append the records of tb to the trace file. A single write() with
+   O_APPEND keeps the records of a chunk together. */
+static void trace_flush(trace_buf_t* tb) {
+  if (tb->len > 0 && g_trace_fd >= 0) {
+    size_t size = tb->len * sizeof(sf_trace_rec_t);
+    // Records are dropped on errors.
+    if (write(g_trace_fd, tb->rec, size) < 0) tb->len = 0;
+  }
+  tb->len = 0;
 }
 
+
+static void trace_thread_exit() {
+  trace_buf_t* tb = l_trace_buf;
+  if (tb == NULL) return;
+
+  trace_flush(tb);
+  l_trace_buf = NULL;
+  tb->active = 0;
+}
+
+
+/* Flush the buffers of all threads. Records of threads that are still
+   running may be lost or written later. */
+static void trace_exit() {
+  for (trace_buf_t* tb = g_trace_buf_list; tb != NULL; tb = tb->next) {
+    if (tb->active) trace_flush(tb);
+  }
+}
+#endif
+
+
 #ifdef MALLOC_STATS
 void stats_init() {
   FILE *cpuinfo_stream;
@@ -2436,7 +6064,9 @@ void print_stats() {
       "          free(hit:%lu miss:%lu evict:%lu)\n"
       "mmap    : cnt(%lu) size(%lu B, %.1f KB, %.1f MB) max(%.1f MB)\n"
       "munmap  : cnt(%lu) size(%lu B, %.1f KB, %.1f MB)\n"
-      "madvise : cnt(%lu) size(%lu B, %.1f KB, %.1f MB)\n\n",
+      "madvise : cnt(%lu) size(%lu B, %.1f KB, %.1f MB)\n"
+      "purge   : pb(%lu B, %.1f MB) sp(%lu B, %.1f MB)\n"
+      "hugetlb : cnt(%lu) fail(%lu) size(%lu B, %.1f MB)\n\n",
       l_tlh.thread_id,
       get_cnt_malloc(), get_time_malloc(),
       get_cnt_free(), get_time_free(),
@@ -2454,9 +6084,33 @@ void print_stats() {
       getKB(get_size_munmap()), getMB(get_size_munmap()),
 
       get_cnt_madvise(), get_size_madvise(),
-      getKB(get_size_madvise()), getMB(get_size_madvise())
+      getKB(get_size_madvise()), getMB(get_size_madvise()),
+
+      get_size_purge_pb(), getMB(get_size_purge_pb()),
+      get_size_purge_sp(), getMB(get_size_purge_sp()),
+
+      get_cnt_hugetlb(), get_cnt_hugetlb_fail(),
+      get_size_hugetlb(), getMB(get_size_hugetlb())
       );
 }
+
+#ifdef MALLOC_USE_BG_THREAD
+static void print_bg_stats() {
+  thread_stat_t* st = &g_bg_stat;
+  fprintf(stdout, "======= BACKGROUND THREAD STATISTICS =======\n"
+      "wakeup  : cnt(%lu)\n"
+      "orphan  : freed(%lu)\n"
+      "free sp : len(%u)\n"
+      "munmap  : cnt(%lu) size(%lu B, %.1f MB)\n"
+      "madvise : cnt(%lu) size(%lu B, %.1f MB)\n\n",
+      st->cnt_bg_wakeup,
+      st->cnt_orphan_free,
+      g_free_sp_len,
+      st->cnt_munmap, st->size_munmap, getMB(st->size_munmap),
+      st->cnt_madvise, st->size_madvise, getMB(st->size_madvise)
+      );
+}
+#endif
 #endif
 
 
@@ -2566,7 +6220,7 @@ void print_pbh(pbh_t* pbh) {
       "cnt_free    : %u\n"
       "cnt_unused  : %u\n"
       "page_color  : %u\n"
-      "block_color : %u\n"
+      "sampled     : %u\n"
       "free_list   : %p\n"
       "unallocated : %p\n"
       "remote_list.head : %u\n"
@@ -2577,7 +6231,7 @@ void print_pbh(pbh_t* pbh) {
       pbh->start_page, pbh->length, pbh->sizeclass,
       get_pbh_status_str(pbh->status),
       pbh->cnt_free, pbh->cnt_unused,
-      pbh->page_color, pbh->block_color,
+      pbh->page_color, pbh->sampled,
       pbh->free_list, pbh->unallocated,
       pbh->remote_list.head, pbh->remote_list.cnt
   );
@@ -2641,7 +6295,7 @@ void print_superpage(sph_t* spage) {
       "omark.finish_mark : %u\n"
       "---------------------------------------\n",
       spage,
-      spage->next, spage->prev, spage->start_page,
+      spage->next, spage->prev, GET_START_PAGE(spage),
       spage->omark.owner_id, spage->omark.finish_mark
   );
 
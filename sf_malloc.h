@@ -41,6 +41,9 @@
 #ifndef __SF_MALLOC_H__
 #define __SF_MALLOC_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 void *malloc(size_t size);
 void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
@@ -53,4 +56,136 @@ void *memalign(size_t boundary, size_t size);
 void sf_malloc_init();
 void malloc_stats();
 
+/* Return fully free pages to the OS. The calling thread first returns the
+   blocks it caches, including those it buffered for other threads with
+   MALLOC_USE_REMOTE_BUFFER. Blocks that other threads buffered for it are
+   returned when those threads flush them, within REMOTE_BUF_MS of their
+   next slow path. With MALLOC_USE_PERCPU, only the cache of the current
+   CPU is flushed; the caches of the other CPUs are left to the threads
+   that run there. malloc_trim() keeps up to pad bytes of free
+   superpages mapped and unpurged, rounded up to whole superpages. */
+int    malloc_trim(size_t pad);
+size_t sf_malloc_release_free_memory();
+void   sf_malloc_release_free_memory_all();
+/* Return the blocks and page blocks cached by the calling thread, as at
+   thread exit, but keep its heap. With MALLOC_USE_PERCPU, only the cache
+   of the current CPU is flushed. Return the size returned to the OS. */
+size_t sf_malloc_thread_flush();
+
+/* Process-wide statistics. They can be read at any time. */
+typedef struct {
+  size_t   mapped;        // bytes mapped from the OS
+  size_t   free_pb;       // bytes in free page blocks of thread heaps
+  size_t   free_sp;       // bytes in free superpages
+  uint64_t live_small;    // live small blocks
+  uint64_t live_large;    // live large blocks
+  uint64_t live_huge;     // live huge blocks
+  uint64_t remote_free;   // blocks freed by threads other than the owner
+  uint64_t remote_retry;  // failed CASes on remote lists and inboxes
+  uint64_t inbox_drain;   // drains of remote free inboxes
+  uint64_t inbox_blocks;  // blocks taken from the inboxes
+  uint64_t inbox_max_depth; // most blocks taken by one drain
+  uint64_t sp_adopt;      // superpages adopted from exited threads
+  uint64_t pcache_malloc_hit;
+  uint64_t pcache_malloc_miss;
+  uint64_t pcache_free_hit;
+  uint64_t pcache_free_miss;
+  size_t   pcpu_cached;   // bytes in per-CPU caches (MALLOC_USE_PERCPU)
+  uint64_t pcpu_malloc_hit;
+  uint64_t pcpu_malloc_miss;
+  uint64_t pcpu_free_hit;
+  uint64_t pcpu_free_miss;
+  uint64_t heap_lock_wait;  // busy shared heaps (MALLOC_USE_SHARED_HEAPS)
+  uint64_t idle_flush;      // idle threads flushed (MALLOC_USE_IDLE_FLUSH)
+  size_t   tc_cached;     // bytes in transfer caches
+                          // (MALLOC_USE_TRANSFER_CACHE)
+  uint64_t tc_push;
+  uint64_t tc_pop;
+  uint64_t pmap_cache_hit;  // pagemap leaves found in the per-thread cache
+  uint64_t pmap_cache_miss; // (MALLOC_USE_PAGEMAP_CACHE)
+} sf_malloc_stats_t;
+
+void   sf_malloc_get_stats(sf_malloc_stats_t* st);
+/* Get the block size and the number of live blocks of size-class cl.
+   Return 0 if cl is not a valid size-class. */
+int    sf_malloc_get_class_stats(unsigned cl, size_t* size, uint64_t* live);
+
+/* Read and write statistics and tunables by name, like mallctl().
+   If oldp is not NULL, the current value is copied to it. If newp is not
+   NULL, the value is set from it. *oldlen and newlen must match the size
+   of the value. Return 0, ENOENT for an unknown name, EINVAL for a wrong
+   size or an out-of-range value, or EPERM for writing a read-only name or,
+   after the first allocation, an option read only at startup. Names are:
+     opt.free_sp_mult       (uint32_t) free superpages kept per thread
+     opt.pb_cache_depth     (uint32_t) page blocks per page block cache way
+     opt.return_list_pbhs   (uint32_t) local free blocks kept, in pbhs,
+                            without MALLOC_USE_ADAPTIVE_LIST, at most 1024
+     opt.tlh_list_bytes     (uint32_t) with MALLOC_USE_ADAPTIVE_LIST, bytes
+                            of local free blocks kept per thread
+     opt.stats_print        (uint32_t) 1 to print malloc_stats() at exit
+     opt.thp                (uint32_t) with MALLOC_USE_HUGE_SUPERPAGE, 0 to
+                            not madvise superpages for THP
+     opt.hugetlb            (uint32_t) with MALLOC_USE_HUGETLB, 0 to not try
+                            hugetlb pages
+     opt.prof_sample        (uint32_t) mean bytes between heap profile
+                            samples, 0 to disable (MALLOC_USE_HEAP_PROF)
+     opt.prof_signal        (uint32_t) signal that dumps the heap profile
+                            on the next sample of any thread, or in the
+                            background thread; read only at startup
+     opt.trace              (uint32_t) with MALLOC_USE_TRACE, record all
+                            calls to sfmalloc.<pid>.trace, read only at
+                            startup
+     opt.percpu             (uint32_t) with MALLOC_USE_PERCPU, 0 to cache
+                            blocks only in thread heaps, read only at
+                            startup
+     opt.heaps              (uint32_t) with MALLOC_USE_SHARED_HEAPS, number
+                            of heaps shared by all threads, 0 for one heap
+                            per thread, read only at startup
+     opt.arena              (uint32_t) with MALLOC_USE_ARENA, 0 to map
+                            superpages one by one, read only at startup
+     opt.idle_flush_ms      (uint32_t) with MALLOC_USE_IDLE_FLUSH, flush
+                            threads idle for this long, 0 to disable
+     opt.idle_flush_events  (uint32_t) with MALLOC_USE_IDLE_FLUSH, flush
+                            threads idle during this many slow paths of
+                            other threads, 0 to disable
+     opt.purge              (uint32_t) with MALLOC_USE_DECAY_PURGE, 0 to
+                            never purge by decay
+     opt.purge_decay_ms     (uint32_t) with MALLOC_USE_DECAY_PURGE
+     opt.purge_interval_ms  (uint32_t) with MALLOC_USE_DECAY_PURGE
+     opt.bg_interval_ms     (uint32_t) with MALLOC_USE_BG_THREAD, at least 1
+     prof.dump              (const char*, write-only) sf_malloc_prof_dump()
+     stats.<field>          (size_t/uint64_t, read-only) sf_malloc_stats_t
+     stats.class.<cl>.size  (size_t, read-only)
+     stats.class.<cl>.live  (uint64_t, read-only)
+     release                (size_t, read-only) released bytes */
+int    sf_mallctl(const char* name, void* oldp, size_t* oldlen,
+                  void* newp, size_t newlen);
+
+/* Allocation trace written with MALLOC_USE_TRACE and opt.trace. The file
+   starts with SF_TRACE_MAGIC, followed by records in per-thread chunks.
+   Sort the records by time to get the order of the calls. A malloc is
+   stamped when it returns and a free when it is called. */
+#define SF_TRACE_MAGIC    0x3143415254465353ULL   // "SSFTRAC1"
+
+enum {
+  SF_TRACE_MALLOC = 1,  // ptr = malloc(size), also for calloc()
+  SF_TRACE_FREE,        // free(ptr)
+  SF_TRACE_REALLOC,     // ptr = realloc(arg, size)
+  SF_TRACE_MEMALIGN     // ptr = memalign(arg, size)
+};
+
+typedef struct {
+  uint64_t time;        // CLOCK_MONOTONIC in nanoseconds
+  uint64_t ptr;         // the block, used as its id
+  uint64_t arg;
+  uint64_t size;
+  uint32_t thread;      // thread id of SFMalloc
+  uint32_t op;
+} sf_trace_rec_t;
+
+/* Write the sampled live allocations to path in the pprof heap profile
+   format. If path is NULL, write to sfmalloc.<pid>.<seq>.heap. Return 0 or
+   an errno value. */
+int    sf_malloc_prof_dump(const char* path);
+
 #endif //__SF_MALLOC_H__
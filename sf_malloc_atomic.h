@@ -66,6 +66,16 @@ static inline unsigned atomic_xchg_uint(volatile unsigned *addr,
   return val;
 }
 
+static inline void* atomic_xchg_ptr(void* volatile *addr, void* val) {
+  __asm__ __volatile__ (
+      "lock; xchgq %0, %1"
+      : "=r" (val)
+      : "m" (*addr), "0" (val)
+      : "memory"
+      );
+  return val;
+}
+
 /*
    This function atomically increment the value of *addr and returns the 
    value of *addr before the increment.
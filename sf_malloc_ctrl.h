@@ -57,9 +57,101 @@
 #define MALLOC_USE_PAGEMAP_CACHE
 #define MALLOC_USE_PAGE_BLOCK_CACHE
 
+/* Adapt the number of free blocks kept in each Block List to the reuse
+   seen by the thread, within opt.tlh_list_bytes per thread. Otherwise,
+   opt.return_list_pbhs pbhs of blocks are kept in each list. */
+#define MALLOC_USE_ADAPTIVE_LIST
+
+/* Move whole pbhs of free blocks between threads through a global cache
+   per size-class, instead of returning them to their pbhs. Only classes
+   whose blocks do not share cache lines are cached. */
+#define MALLOC_USE_TRANSFER_CACHE
+
+/* Buffer small blocks freed to pbhs of other threads and free the blocks
+   of each pbh together with one CAS. */
+#define MALLOC_USE_REMOTE_BUFFER
+
+/* Push small blocks freed by other threads to an inbox of the owner
+   instead of the remote lists of their pbhs. The owner drains the inbox
+   on its slow paths. */
+#define MALLOC_USE_REMOTE_INBOX
+
+/* Cache small blocks per CPU in front of the TLHs, with restartable
+   sequences (Linux 4.18, glibc 2.35, x86-64). Cached memory is then bounded
+   by the number of CPUs rather than threads. Without rseq, or with
+   opt.percpu set to 0, the TLHs are used as before. */
+//#define MALLOC_USE_PERCPU
+
+/* Map the threads onto opt.heaps shared TLHs, locked on their slow paths,
+   instead of one TLH each. Every thread only keeps a small cache of free
+   blocks. For processes with many mostly idle threads. Replaces
+   MALLOC_USE_PERCPU. */
+//#define MALLOC_USE_SHARED_HEAPS
+
+/* Let other threads flush the TLH of a thread that has not called malloc()
+   or free() for opt.idle_flush_ms, or during opt.idle_flush_events slow
+   paths of the process. Needs membarrier() (Linux 4.14). */
+//#define MALLOC_USE_IDLE_FLUSH
+
+/* Keep per-thread counters for sf_malloc_get_stats() and malloc_stats(). */
+#define MALLOC_USE_HEAP_STATS
+
+/* Return pages of long-unused free page blocks and superpages to the OS. */
+#define MALLOC_USE_DECAY_PURGE
+/* Purge with MADV_FREE instead of MADV_DONTNEED (Linux 4.5 or later). */
+//#define MALLOC_USE_MADV_FREE
+
+/* Run purging and superpage maintenance in a background thread. */
+//#define MALLOC_USE_BG_THREAD
+
+/* Make a superpage with its header one 2 MB page backed by THP.
+   This costs much more memory: one touched block makes a whole superpage
+   resident, and every thread keeps superpages of its own. The max RSS of
+   larson grew from 51 MB to 559 MB with 2 threads, and from 116 MB to
+   1 GB with 8 threads. thp:0 gives that memory back, without the TLB
+   gain. */
+//#define MALLOC_USE_HUGE_SUPERPAGE
+
+/* Carve superpages from one reserved range aligned to their size, so that
+   the pbh of a small or large block is found from its address and a flat
+   per-page index instead of the radix pagemap. Huge blocks, and superpages
+   mapped once the range is used up, stay in the radix pagemap. */
+#define MALLOC_USE_ARENA
+
+/* Try MAP_HUGETLB pages for huge blocks and, with MALLOC_USE_HUGE_SUPERPAGE,
+   for superpages. Fall back to regular pages if the hugetlb pool is empty. */
+//#define MALLOC_USE_HUGETLB
+
+/* Keep free superpages per NUMA node and bind new superpages to the node
+   of the thread that maps them. */
+//#define MALLOC_USE_NUMA
+/* Pretend to have this many nodes, assigned to threads in a round-robin
+   manner. For testing on a machine without NUMA. */
+//#define MALLOC_NUMA_FAKE_NODES  2
+
+/* Sample allocations with their backtraces for heap profiles. Sampling is
+   off until opt.prof_sample is set. */
+#define MALLOC_USE_HEAP_PROF
+
+/* Record every allocation call to sfmalloc.<pid>.trace when opt.trace is
+   set. See bench/sf_replay.c. */
+//#define MALLOC_USE_TRACE
+
 /* Minor Experiments */
 
 
+/* MALLOC_STATS keeps its latency histograms in the heap statistics. */
+#ifdef MALLOC_STATS
+#ifndef MALLOC_USE_HEAP_STATS
+#define MALLOC_USE_HEAP_STATS
+#endif
+#endif
+
+/* Threads bound to shared heaps do not use the per-CPU caches. */
+#ifdef MALLOC_USE_SHARED_HEAPS
+#undef MALLOC_USE_PERCPU
+#endif
+
 /* MALLOC_DEBUG_DETAIL needs MALLOC_DEBUG */
 #ifdef MALLOC_DEBUG_DETAIL
 #ifndef MALLOC_DEBUG
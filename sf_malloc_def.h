@@ -53,9 +53,17 @@
 // Currently, SFMalloc targets only the 64-bit environment.
 #define MACHINE_BIT         64
 #define PAGE_SHIFT          12
+#define HUGE_PAGE_SHIFT     21
+#define GIANT_PAGE_SHIFT    30
 #define CACHE_LINE_SIZE     64
 #define MAX_NUM_THREADS     UINT_MAX
 
+#ifdef MALLOC_USE_NUMA
+#define MAX_NUMA_NODES      64
+#else
+#define MAX_NUMA_NODES      1
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////
 // Constant Definitions
@@ -67,11 +75,19 @@
 #define MAX_SMALL_SIZE      1024
 #define CLASS_ARRAY_SIZE    ((((1<<PAGE_SHIFT)*8u + 127 + (120<<7)) >> 7) + 1)
 #define NUM_PB_CACHE_WAY    8
+#define HUGE_PAGE_SIZE      (1 << HUGE_PAGE_SHIFT)
+
+/* Page Block Cache tags are 8 bits. Longer page blocks bypass the cache. */
+#define PB_CACHE_MAX_LEN    255
 
-/* NUM_PAGE_CLASSES should be less than 256. */
+#ifdef MALLOC_USE_HUGE_SUPERPAGE
+/* A superpage and its header fill one huge page. */
+#define NUM_PAGE_CLASSES    503
+#else
 #define NUM_PAGE_CLASSES    62
 //#define NUM_PAGE_CLASSES    126
 //#define NUM_PAGE_CLASSES    254
+#endif
 
 #if (NUM_PAGE_CLASSES <= 62)
 #define SPH_SIZE  PAGE_SIZE
@@ -79,13 +95,79 @@
 #define SPH_SIZE  (PAGE_SIZE * 2)
 #elif (NUM_PAGE_CLASSES <= 254)
 #define SPH_SIZE  (PAGE_SIZE * 4)
+#elif (NUM_PAGE_CLASSES <= 503)
+#define SPH_SIZE  (PAGE_SIZE * 8)
 #endif
 
 #define SUPERPAGE_LEN       (NUM_PAGE_CLASSES + 1)
+#define FREE_PB_MAP_WORDS   ((NUM_PAGE_CLASSES + 63) / 64)
 #define SUPERPAGE_SIZE      (SUPERPAGE_LEN * PAGE_SIZE)
+#define SUPERPAGE_MAP_SIZE  (SUPERPAGE_SIZE + SPH_SIZE)
+
+#ifdef MALLOC_USE_ARENA
+/* Virtual range reserved for superpages at startup. Only the superpages
+   in use are backed by memory. */
+#define ARENA_SIZE          (64UL << 30)
+#define ARENA_SUPERPAGES    (ARENA_SIZE / SUPERPAGE_MAP_SIZE)
+#if ((SUPERPAGE_MAP_SIZE & (SUPERPAGE_MAP_SIZE - 1)) != 0)
+#error "MALLOC_USE_ARENA needs a power-of-two SUPERPAGE_MAP_SIZE"
+#endif
+#endif
 #define DEAD_OWNER          0
 
 #define HUGE_MALLOC_MARK    0x1
+#define HUGE_MALLOC_HUGETLB 0x2   // the huge block is on hugetlb pages
+#define HUGE_MALLOC_SAMPLED 0x4   // the huge block is in the heap profile
+#define HUGE_MALLOC_FLAGS   (HUGE_MALLOC_MARK | HUGE_MALLOC_HUGETLB | \
+                             HUGE_MALLOC_SAMPLED)
+
+/* Free pages are purged after they have not been reused for PURGE_DECAY_MS.
+   Each thread checks its free page blocks at most once per
+   PURGE_INTERVAL_MS. */
+#define PURGE_DECAY_MS      10000
+#define PURGE_INTERVAL_MS   1000
+
+/* The background thread wakes up every BG_THREAD_INTERVAL_MS. */
+#define BG_THREAD_INTERVAL_MS 100
+
+/* Default values of the tunables that sf_mallctl() can change. */
+// Free superpages kept per running thread
+#define FREE_SP_LIST_MULT   2
+// Page blocks kept in each way of the Page Block Cache
+#define PB_CACHE_DEPTH      2
+// Free blocks kept in a Block List, in units of blocks per pbh
+#define RETURN_LIST_PBHS    1
+// Bytes of free blocks that the Block Lists of a thread may keep
+#define TLH_LIST_BYTES      (4 << 20)
+
+/* Adaptive Block List limits. The limit of a class starts at one pbh of
+   blocks. Once the class has returned blocks, the limit grows by one pbh
+   of blocks each time the list runs empty, up to LIST_MAX_BLOCKS or
+   LIST_MAX_BYTES, and drops by one pbh of blocks every LIST_MAX_OVERAGES
+   returns. */
+#define LIST_MAX_BLOCKS     8192
+#define LIST_MAX_BYTES      (1 << 20)
+#define LIST_MAX_OVERAGES   3
+
+/* Heap profile. With sampling off, a thread checks opt.prof_sample again
+   after allocating PROF_IDLE_BYTES. */
+#define PROF_TABLE_SIZE     (1 << 16)   // slots in the sample table
+#define PROF_MAX_PROBE      64
+#define PROF_MAX_DEPTH      32
+#define PROF_IDLE_BYTES     (64 << 20)
+
+/* Remote free buffer. A thread buffers blocks freed to one pbh of other
+   threads per slot, and frees them to the pbh when REMOTE_BUF_BLKS blocks
+   are buffered or a block of another pbh comes to the slot. All slots are
+   flushed every REMOTE_BUF_FREES buffered frees, and on the slow paths once
+   the first buffered block has waited REMOTE_BUF_MS. */
+#define REMOTE_BUF_LEN      16      // slots indexed by size-class, power of 2
+#define REMOTE_BUF_BLKS     32
+#define REMOTE_BUF_FREES    4096
+#define REMOTE_BUF_MS       10
+
+/* Size of a per-thread allocation trace buffer */
+#define TRACE_BUF_SIZE      (64 * 1024)
 
 #define CACHE_LINE_ALIGN    __attribute__ ((aligned (CACHE_LINE_SIZE)))
 #define TLS_MODEL           __attribute__ ((tls_model ("initial-exec")))
@@ -139,6 +221,52 @@ typedef struct {
   pagemap_node_t* node[PMAP_INTERIOR_LEN];
 } pagemap_t CACHE_LINE_ALIGN;
 
+// Leaves last used by a thread, for MALLOC_USE_PAGEMAP_CACHE, direct-mapped
+// by the low bits of their tags. Tags are kept plus one so that a zeroed
+// cache matches no tag.
+#define PMAP_CACHE_LEN        4     // power of 2
+
+typedef struct {
+  size_t          tag[PMAP_CACHE_LEN];
+  pagemap_leaf_t* leaf[PMAP_CACHE_LEN];
+} pagemap_cache_t;
+
+
+//-------------------------------------------------------------------
+// Type for Remote Free Inbox
+//-------------------------------------------------------------------
+// Blocks freed by other threads are chained through their first words.
+// A slot is reused by a later thread.
+typedef struct inbox inbox_t;
+struct inbox {
+  void* volatile    head;
+  inbox_t*          next;       // next slot in g_inbox_list
+  volatile uint32_t active;
+} CACHE_LINE_ALIGN;
+
+// How inbox_drain() returns the blocks
+#define INBOX_REUSE     0   // keep them in the pbhs for the next refills
+#define INBOX_RELEASE   1   // also free the totally free pbhs
+#define INBOX_FINISH    2   // the superpages of the TLH are being finished
+
+
+//-------------------------------------------------------------------
+// Type for Per-CPU Cache
+//-------------------------------------------------------------------
+// Stacks of free small blocks for each size-class, used on one CPU only.
+// A stack holds at most PCPU_CLASS_BYTES and PCPU_SLOTS blocks.
+#define PCPU_MAX_CPUS       1024
+#define PCPU_SLOTS          64
+#define PCPU_CLASS_BYTES    (16 * 1024)
+
+typedef struct pcpu_cache {
+  uint32_t  cnt[NUM_CLASSES];
+  void*     slot[NUM_CLASSES][PCPU_SLOTS];
+} pcpu_cache_t;
+
+#define PCPU_CACHE_SIZE \
+  ((sizeof(pcpu_cache_t) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+
 
 //-------------------------------------------------------------------
 // Type for Superpage and Superpage Header (SPH)
@@ -159,11 +287,22 @@ typedef union {
 typedef struct sph {
   struct sph* next;            // next pointer in linked list
   struct sph* prev;            // prev pointer in linked list
-  size_t      start_page;      // starting page number
   volatile ownermark_t omark;  // owner_id + finish_mark
   void*       remote_pb_list;  // remote list for large blocks 
   uint32_t    hazard_mark;
-} sph_t;
+  uint32_t    free_time;       // time when it became free (0: purged)
+  struct sph* orphan_next;     // next pointer in orphan list
+  volatile uint32_t orphan_mark;
+  uint16_t    hugetlb;         // 1 if backed by hugetlb pages
+  uint16_t    numa_node;       // node of the Free Superpage List to use
+#ifdef MALLOC_USE_REMOTE_INBOX
+  inbox_t* volatile inbox;     // inbox of the owner
+#endif
+} sph_t;    // must fit in PBH_SIZE, the slot before the first pbh
+
+#define ORPHAN_NONE     0
+#define ORPHAN_LISTED   1
+#define ORPHAN_RELISTED 2
 
 
 //-------------------------------------------------------------------
@@ -178,6 +317,120 @@ struct hazard_ptr {
 };
 
 
+//-------------------------------------------------------------------
+// Type for Heap Statistics
+//-------------------------------------------------------------------
+// Per-thread counters. A slot is reused by a later thread without being
+// cleared, so the sum over all slots gives the process-wide values.
+// Index NUM_CLASSES is for large blocks and NUM_CLASSES+1 for huge ones.
+#define HSTAT_LARGE   NUM_CLASSES
+#define HSTAT_HUGE    (NUM_CLASSES + 1)
+
+#ifdef MALLOC_STATS
+// Latency histograms. Bucket b counts operations that took [2^b, 2^(b+1))
+// cycles. An operation is counted for itself and for the slowest path it
+// went through. Paths of the same operation are ordered from fast to slow.
+enum {
+  LAT_MALLOC, LAT_FREE, LAT_REALLOC, LAT_MEMALIGN,
+  // malloc paths
+  LAT_SMALL_FAST,     // pop from the Block List
+  LAT_BUMP,           // bump allocation from the unused chunk
+  LAT_PCACHE,         // hit in the Page Block Cache
+  LAT_PBH_REFILL,     // take blocks from a pbh in the PBH List
+  LAT_PB_ALLOC,       // allocate a page block
+  LAT_SPH_ALLOC,      // take a superpage from the Free Superpage List
+  LAT_SPH_MMAP,       // mmap a new superpage
+  LAT_HUGE_MALLOC,
+  // free paths
+  LAT_FREE_LOCAL,     // push to the Block List or the Page Block Cache
+  LAT_RETURN_LIST,    // return the Block List to pbhs
+  LAT_REMOTE_FREE,
+  LAT_PB_FREE,        // free a page block
+  LAT_HUGE_FREE,
+  NUM_LAT
+};
+#define NUM_LAT_BUCKETS   32
+
+// Lock-free structures whose CAS operations are counted
+enum {
+  CAS_FREE_SP_LIST,     // g_free_sp_list
+  CAS_REMOTE_LIST,      // pbh->remote_list
+  CAS_REMOTE_PB_LIST,   // sph->remote_pb_list
+  CAS_OWNER_MARK,       // sph->omark
+  CAS_HAZARD_LIST,      // g_hazard_ptr_list
+  CAS_ORPHAN_LIST,      // g_orphan_sp_list
+  CAS_INBOX,            // inbox_t
+  NUM_CAS
+};
+#endif
+
+typedef struct heap_stat heap_stat_t;
+struct heap_stat {
+  heap_stat_t*      next;
+  volatile uint32_t active;
+  int64_t  cnt_free_pb;                 // pages in the Free PB Lists
+  uint64_t cnt_malloc[NUM_CLASSES + 2];
+  uint64_t cnt_free[NUM_CLASSES + 2];
+  uint64_t cnt_remote_free;
+  uint64_t cnt_remote_retry;
+  uint64_t cnt_inbox_drain;
+  uint64_t cnt_inbox_blk;               // blocks taken from the inbox
+  uint64_t inbox_max_depth;             // most blocks taken at once
+  uint64_t cnt_sp_adopt;
+  uint64_t pcache_malloc_hit;
+  uint64_t pcache_malloc_miss;
+  uint64_t pcache_free_hit;
+  uint64_t pcache_free_miss;
+  uint64_t pcpu_malloc_hit;
+  uint64_t pcpu_malloc_miss;
+  uint64_t pcpu_free_hit;
+  uint64_t pcpu_free_miss;
+  uint64_t heap_lock_wait;              // shared heap found locked
+  uint64_t idle_flush;                  // TLHs of idle threads flushed
+  uint64_t tc_push;                     // batches put in transfer caches
+  uint64_t tc_pop;                      // batches taken from them
+  uint64_t pmap_cache_hit;              // pagemap leaves found cached
+  uint64_t pmap_cache_miss;
+#ifdef MALLOC_STATS
+  uint64_t lat[NUM_LAT][NUM_LAT_BUCKETS];
+  uint64_t cas_attempt[NUM_CAS];
+  uint64_t cas_fail[NUM_CAS];
+  uint64_t cas_max_fail[NUM_CAS];       // most failures in a row
+#endif
+} CACHE_LINE_ALIGN;
+
+
+//-------------------------------------------------------------------
+// Type for Heap Profile Samples
+//-------------------------------------------------------------------
+// A slot of the sample table. ptr is claimed with CAS.
+#define PROF_SLOT_EMPTY     ((void*)0)
+#define PROF_SLOT_DELETED   ((void*)1)
+#define PROF_SLOT_BUSY      ((void*)2)
+
+typedef struct {
+  void* volatile ptr;           // sampled block
+  size_t         size;          // requested size
+  uint32_t       depth;
+  void*          stack[PROF_MAX_DEPTH];
+} prof_sample_t;
+
+
+//-------------------------------------------------------------------
+// Type for Allocation Trace Buffers
+//-------------------------------------------------------------------
+typedef struct trace_buf trace_buf_t;
+struct trace_buf {
+  trace_buf_t*      next;       // next buffer in g_trace_buf_list
+  volatile uint32_t active;     // used by a thread
+  uint32_t          len;        // number of records
+  sf_trace_rec_t    rec[];
+};
+
+#define TRACE_BUF_RECS  \
+  ((TRACE_BUF_SIZE - sizeof(trace_buf_t)) / sizeof(sf_trace_rec_t))
+
+
 //-------------------------------------------------------------------
 // Type for Page Block Header (PBH)
 //-------------------------------------------------------------------
@@ -196,17 +449,29 @@ struct pbh {
   pbh_t*   prev;          // prev pointer in linked list
   size_t   start_page;    // starting page number
 
-  uint8_t  length;        // number of pages in pbh
-  uint8_t  index;         // position(index) in superpage
+  uint16_t length;        // number of pages in pbh
+  uint16_t index;         // position(index) in superpage
   uint8_t  sizeclass;     // size-calss for small blocks
   uint8_t  status;        // status of the pbh
-  uint32_t cnt_free;      // number of free blocks in free list
-  uint32_t cnt_unused;    // number of unused free blocks    
-  uint16_t page_color;    // for page coloring
-  uint16_t block_color;   // for block coloring
+  uint8_t  page_color;    // for page coloring
+  uint8_t  sampled;       // may hold blocks in the heap profile
+  union {
+    struct {
+      uint32_t cnt_free;    // number of free blocks in free list
+      uint32_t cnt_unused;  // number of unused free blocks
+    };
+    struct {
+      uint32_t dirty_first; // first page not purged (free pbh)
+      uint32_t dirty_len;   // pages from dirty_first that may be dirty
+    };
+  };
 
   void*    free_list;     // pointer to the first free block
-  void*    unallocated;   // pointer to the first unused free block
+  union {
+    void*    unallocated; // pointer to the first unused free block
+    uint32_t free_time;   // oldest time a dirty page became free
+                          // (0: purged or unused)
+  };
 
   volatile remote_list_t  remote_list;   // for remote free
 };
@@ -226,7 +491,8 @@ typedef struct {
   void*    free_blk_list;   // free block list for a specific size-class
   void*    ptr_to_unused;   // pointer to the unallocated chunk
   uint32_t cnt_free;        // length of free_list
-  uint32_t cnt_unused;      // number of unallocated blocks
+  uint16_t cnt_unused;      // number of unallocated blocks
+  uint16_t max_free;        // limit of cnt_free (0: not set yet)
   pbh_t*   pbh_list;        // list of PBs that are used in this class
 } blk_list_t;
 
@@ -284,6 +550,19 @@ const way_table_t g_way_table[NUM_PB_CACHE_WAY] = {
 #endif
 
 
+//-------------------------------------------------------------------
+// Remote Free Buffer
+//-------------------------------------------------------------------
+#ifdef MALLOC_USE_REMOTE_BUFFER
+typedef struct {
+  pbh_t*    pbh;        // owner of the blocks, NULL if empty
+  void*     first;
+  void*     last;
+  uint32_t  cnt;
+} remote_buf_t;
+#endif
+
+
 //-------------------------------------------------------------------
 // Thread Local Heap (TLH)
 //-------------------------------------------------------------------
@@ -291,12 +570,37 @@ const way_table_t g_way_table[NUM_PB_CACHE_WAY] = {
 typedef struct {
   blk_list_t    blk_list[NUM_CLASSES];          // Block Lists
   pbh_t*        free_pb_list[NUM_PAGE_CLASSES]; // Free Page Block Lists
+  uint64_t      free_pb_map[FREE_PB_MAP_WORDS]; // bit c: free_pb_list[c]
   sph_t*        sp_list;        // Superpage List
+#ifdef MALLOC_USE_REMOTE_INBOX
+  inbox_t*      inbox;          // blocks freed by other threads
+#endif
   hazard_ptr_t* hazard_ptr;     // PTR to Hazard Pointer
+  heap_stat_t*  stat;           // PTR to Heap Statistics slot
 #ifdef MALLOC_USE_PAGE_BLOCK_CACHE
   pb_cache_t    pb_cache;       // Page Block Cache
 #endif
   uint32_t      thread_id;
+#ifdef MALLOC_USE_DECAY_PURGE
+  uint32_t      next_purge;     // time of the next purge check
+#endif
+  uint32_t      release_epoch;  // last seen g_release_epoch
+  uint32_t      numa_node;      // NUMA node the thread started on
+#ifdef MALLOC_USE_REMOTE_BUFFER
+  uint32_t      remote_buf_frees;   // buffered frees since the last flush
+  uint32_t      remote_buf_time;    // when the first of them was buffered
+  remote_buf_t  remote_buf[REMOTE_BUF_LEN];
+#endif
+#ifdef MALLOC_USE_HEAP_PROF
+  int64_t       prof_countdown; // bytes to allocate before the next sample
+  uint64_t      prof_rand;      // random state for sampling intervals
+#endif
+#ifdef MALLOC_USE_ADAPTIVE_LIST
+  size_t        list_bytes;     // sum of max_free of the Block Lists in bytes
+  uint32_t      list_victim;    // next class to take list_bytes from
+  uint8_t       list_over[NUM_CLASSES];   // returns since the last drop
+  uint8_t       list_returned[NUM_CLASSES]; // 1 if blocks were returned
+#endif
 
 #ifdef MALLOC_USE_PAGE_COLORING
   char8_t       pagecolor_cache;
@@ -305,12 +609,86 @@ typedef struct {
 } tlh_t CACHE_LINE_ALIGN;
 
 
+//-------------------------------------------------------------------
+// Shared Heap
+//-------------------------------------------------------------------
+#ifdef MALLOC_USE_SHARED_HEAPS
+#define MAX_SHARED_HEAPS    4096
+// Each thread caches at most FRONT_CACHE_BYTES and FRONT_CACHE_BLKS blocks
+// of a size-class. Larger blocks always go to the shared heap.
+#define FRONT_CACHE_BYTES   512
+#define FRONT_CACHE_BLKS    8
+// Spins on a busy shared heap before yielding the CPU
+#define HEAP_LOCK_SPINS     64
+
+// A TLH used by the threads bound to it, one at a time.
+typedef struct {
+  tlh_t             tlh;
+  volatile uint32_t lock;
+} shared_heap_t CACHE_LINE_ALIGN;
+
+// Free blocks each thread keeps in front of its shared heap
+typedef struct {
+  void*     list[NUM_CLASSES];
+  uint8_t   cnt[NUM_CLASSES];
+} front_cache_t;
+#endif
+
+
+//-------------------------------------------------------------------
+// Transfer Cache
+//-------------------------------------------------------------------
+#ifdef MALLOC_USE_TRANSFER_CACHE
+#define TC_SLOTS            16
+// Bytes cached per size-class, at least one batch
+#define TC_MAX_BYTES        (512 * 1024)
+
+// Batches of one pbh of blocks, linked with GET_NEXT(). A slot is taken
+// and emptied with atomic operations only, so no block is read by a
+// thread that does not own it.
+typedef struct transfer_cache transfer_cache_t;
+struct transfer_cache {
+  void* volatile    slot[TC_SLOTS]; // first blocks of batches, or NULL
+  volatile uint32_t num;            // batches in slot[], and reserved ones
+} CACHE_LINE_ALIGN;
+#endif
+
+
+//-------------------------------------------------------------------
+// Idle Thread Flushing
+//-------------------------------------------------------------------
+#ifdef MALLOC_USE_IDLE_FLUSH
+#define IDLE_FLUSH_MS       1000  // default of opt.idle_flush_ms
+#define IDLE_FLUSH_EVENTS   0     // default of opt.idle_flush_events
+#define IDLE_SCAN_MS        100   // scan the threads at most this often
+#define IDLE_EVENT_BATCH    16    // slow paths counted together
+
+// The owner only writes calls and depth, and other threads only write
+// the rest. The slot outlives the thread and is reused by a later one.
+typedef struct idle_slot idle_slot_t;
+struct idle_slot {
+  tlh_t* volatile   tlh;        // NULL if the thread has exited
+  idle_slot_t*      next;       // next slot in g_idle_list
+  volatile uint32_t calls;      // incremented when the owner enters
+  volatile uint32_t depth;      // nonzero while the owner is in a call
+  volatile uint32_t flushing;   // set while another thread checks or
+                                // flushes the TLH
+  volatile uint32_t active;
+  uint32_t          seen_calls;   // calls at the last scan
+  uint32_t          seen_time;    // time when calls last changed
+  uint32_t          seen_events;  // g_idle_events when calls last changed
+  uint32_t          flushed;      // flushed since calls last changed
+} CACHE_LINE_ALIGN;
+#endif
+
+
 
 ////////////////////////////////////////////////////////////////////////////
 // Macro Functions
 ////////////////////////////////////////////////////////////////////////////
 /* s should the pointer to the superpage header. */
 #define GET_FIRST_PBH(s)  ((pbh_t*)(s) + 1)
+#define GET_START_PAGE(s) (((size_t)(s) + SPH_SIZE) >> PAGE_SHIFT)
 
 #define GET_NEXT(p)       (void*)(*(uintptr_t*)(p))
 #define SET_NEXT(p,n)     *(uintptr_t*)(p) = (uintptr_t)(n)
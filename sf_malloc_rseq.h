@@ -0,0 +1,136 @@
+/*****************************************************************************/
+/*                                                                           */
+/* Copyright (c) 2011, Seoul National University.                            */
+/* All rights reserved.                                                      */
+/*                                                                           */
+/* Redistribution and use in source and binary forms, with or without        */
+/* modification, are permitted provided that the following conditions        */
+/* are met:                                                                  */
+/*   1. Redistributions of source code must retain the above copyright       */
+/*      notice, this list of conditions and the following disclaimer.        */
+/*   2. Redistributions in binary form must reproduce the above copyright    */
+/*      notice, this list of conditions and the following disclaimer in the  */
+/*      documentation and/or other materials provided with the distribution. */
+/*   3. Neither the name of Seoul National University nor the names of its   */
+/*      contributors may be used to endorse or promote products derived      */
+/*      from this software without specific prior written permission.        */
+/*                                                                           */
+/* THIS SOFTWARE IS PROVIDED BY SEOUL NATIONAL UNIVERSITY "AS IS" AND ANY    */
+/* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED */
+/* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE    */
+/* DISCLAIMED. IN NO EVENT SHALL SEOUL NATIONAL UNIVERSITY BE LIABLE FOR ANY */
+/* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL        */
+/* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS   */
+/* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)     */
+/* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,       */
+/* STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN  */
+/* ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE           */
+/* POSSIBILITY OF SUCH DAMAGE.                                               */
+/*                                                                           */
+/* Contact information:                                                      */
+/*   Center for Manycore Programming                                         */
+/*   School of Computer Science and Engineering                              */
+/*   Seoul National University, Seoul 151-744, Korea                         */
+/*   http://aces.snu.ac.kr                                                   */
+/*                                                                           */
+/* Contributors:                                                             */
+/*   Sangmin Seo, Junghyun Kim, and Jaejin Lee                               */
+/*                                                                           */
+/*****************************************************************************/
+
+#ifndef __SF_MALLOC_RSEQ_H__
+#define __SF_MALLOC_RSEQ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/rseq.h>
+
+/*
+   Restartable sequences on per-CPU arrays of pointers (x86-64).
+   Each operation runs on the CPU cpu only and commits with its last store.
+   The kernel restarts it at the abort handler if the thread is preempted,
+   migrated or signaled before the commit. A failed operation returns false.
+ */
+
+/* rseq area of the calling thread registered by glibc (2.35 or later) */
+#define RSEQ_AREA() \
+  ((struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset))
+
+#define RSEQ_STR_(x)    #x
+#define RSEQ_STR(x)     RSEQ_STR_(x)
+
+/* Descriptor of the critical section from 1 to 2 aborting to 4 */
+#define RSEQ_CS_BEGIN                                     \
+  ".pushsection __rseq_cs, \"aw\"\n\t"                    \
+  ".balign 32\n\t"                                        \
+  "3:\n\t"                                                \
+  ".long 0x0, 0x0\n\t"                                    \
+  ".quad 1f, (2f - 1f), 4f\n\t"                           \
+  ".popsection\n\t"                                       \
+  "leaq 3b(%%rip), %%rax\n\t"                             \
+  "movq %%rax, %[rseq_cs]\n\t"                            \
+  "1:\n\t"                                                \
+  "cmpl %[cpu], %[cpu_id]\n\t"                            \
+  "jnz 4f\n\t"
+
+/* The abort handler must follow the signature. */
+#define RSEQ_CS_END(fail)                                 \
+  "2:\n\t"                                                \
+  ".pushsection __rseq_failure, \"ax\"\n\t"               \
+  ".byte 0x0f, 0xb9, 0x3d\n\t"                            \
+  ".long " RSEQ_STR(RSEQ_SIG) "\n\t"                      \
+  "4:\n\t"                                                \
+  "jmp %l[" #fail "]\n\t"                                 \
+  ".popsection\n\t"
+
+
+/* Pop the last pointer of slot[0..*cnt) to *ret. */
+static inline bool rseq_pop(struct rseq* rs, uint32_t cpu,
+                            uint32_t* cnt, void** slot, void** ret) {
+  __asm__ __volatile__ goto (
+      RSEQ_CS_BEGIN
+      "movl %[cnt], %%ecx\n\t"
+      "testl %%ecx, %%ecx\n\t"
+      "jz %l[fail]\n\t"
+      "subl $1, %%ecx\n\t"
+      "movq (%[slot], %%rcx, 8), %%rax\n\t"
+      "movq %%rax, (%[ret])\n\t"
+      "movl %%ecx, %[cnt]\n\t"
+      RSEQ_CS_END(fail)
+      :
+      : [rseq_cs] "m" (rs->rseq_cs), [cpu_id] "m" (rs->cpu_id),
+        [cpu] "r" (cpu), [cnt] "m" (*cnt), [slot] "r" (slot),
+        [ret] "r" (ret)
+      : "memory", "cc", "rax", "rcx"
+      : fail);
+  return true;
+fail:
+  return false;
+}
+
+
+/* Push ptr to slot[0..*cnt) unless it has cap pointers already. */
+static inline bool rseq_push(struct rseq* rs, uint32_t cpu,
+                             uint32_t* cnt, void** slot, uint32_t cap,
+                             void* ptr) {
+  __asm__ __volatile__ goto (
+      RSEQ_CS_BEGIN
+      "movl %[cnt], %%ecx\n\t"
+      "cmpl %[cap], %%ecx\n\t"
+      "jae %l[fail]\n\t"
+      "movq %[ptr], (%[slot], %%rcx, 8)\n\t"
+      "addl $1, %%ecx\n\t"
+      "movl %%ecx, %[cnt]\n\t"
+      RSEQ_CS_END(fail)
+      :
+      : [rseq_cs] "m" (rs->rseq_cs), [cpu_id] "m" (rs->cpu_id),
+        [cpu] "r" (cpu), [cnt] "m" (*cnt), [slot] "r" (slot),
+        [cap] "r" (cap), [ptr] "r" (ptr)
+      : "memory", "cc", "rax", "rcx"
+      : fail);
+  return true;
+fail:
+  return false;
+}
+
+#endif //__SF_MALLOC_RSEQ_H__
@@ -41,6 +41,10 @@
 #ifndef __SF_MALLOC_STAT_H__
 #define __SF_MALLOC_STAT_H__
 
+#define getKB(s)    ((s) / 1024.0)
+#define getMB(s)    ((s) / 1024.0 / 1024.0)
+#define getGB(s)    ((s) / 1024.0 / 1024.0 / 1024.0)
+
 #ifdef MALLOC_STATS
 static double CPU_CLOCK = 1.0;
 
@@ -64,6 +68,13 @@ typedef struct {
   uint64_t size_munmap;
   uint64_t size_madvise;
   uint64_t size_mmap_max;
+  uint64_t size_purge_pb;
+  uint64_t size_purge_sp;
+  uint64_t cnt_bg_wakeup;
+  uint64_t cnt_orphan_free;
+  uint64_t cnt_hugetlb;
+  uint64_t cnt_hugetlb_fail;
+  uint64_t size_hugetlb;
 
   uint64_t cnt_malloc;
   uint64_t cnt_free;
@@ -89,6 +100,31 @@ typedef struct {
 
 static __thread thread_stat_t l_stat TLS_MODEL;
 
+// The slowest path taken by the current operation
+static __thread uint32_t l_lat_path TLS_MODEL;
+
+static __inline__ uint32_t lat_bucket(uint64_t t) {
+  uint32_t b = 63 - __builtin_clzll(t | 1);
+  return (b < NUM_LAT_BUCKETS) ? b : NUM_LAT_BUCKETS - 1;
+}
+
+// Failed CASes in a row on each structure
+static __thread uint32_t l_cas_fail[NUM_CAS] TLS_MODEL;
+
+static __inline__ bool cas_count(heap_stat_t* hs, uint32_t site, bool ok) {
+  hs->cas_attempt[site]++;
+  if (ok) {
+    if (l_cas_fail[site] > hs->cas_max_fail[site]) {
+      hs->cas_max_fail[site] = l_cas_fail[site];
+    }
+    l_cas_fail[site] = 0;
+  } else {
+    hs->cas_fail[site]++;
+    l_cas_fail[site]++;
+  }
+  return ok;
+}
+
 
 #define inc_cnt_mmap()                l_stat.cnt_mmap++
 #define inc_cnt_munmap()              l_stat.cnt_munmap++
@@ -99,6 +135,13 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #define update_size_mmap_max()        \
   if ((l_stat.size_mmap - l_stat.size_munmap) > l_stat.size_mmap_max) \
     l_stat.size_mmap_max = l_stat.size_mmap - l_stat.size_munmap
+#define inc_size_purge_pb(s)          l_stat.size_purge_pb += (s)
+#define inc_size_purge_sp(s)          l_stat.size_purge_sp += (s)
+#define inc_cnt_bg_wakeup()           l_stat.cnt_bg_wakeup++
+#define inc_cnt_orphan_free()         l_stat.cnt_orphan_free++
+#define inc_cnt_hugetlb()             l_stat.cnt_hugetlb++
+#define inc_cnt_hugetlb_fail()        l_stat.cnt_hugetlb_fail++
+#define inc_size_hugetlb(s)           l_stat.size_hugetlb += (s)
 
 #define get_cnt_mmap()                l_stat.cnt_mmap
 #define get_cnt_munmap()              l_stat.cnt_munmap
@@ -107,6 +150,13 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #define get_size_munmap()             l_stat.size_munmap
 #define get_size_madvise()            l_stat.size_madvise
 #define get_size_mmap_max()           l_stat.size_mmap_max
+#define get_size_purge_pb()           l_stat.size_purge_pb
+#define get_size_purge_sp()           l_stat.size_purge_sp
+#define get_cnt_bg_wakeup()           l_stat.cnt_bg_wakeup
+#define get_cnt_orphan_free()         l_stat.cnt_orphan_free
+#define get_cnt_hugetlb()             l_stat.cnt_hugetlb
+#define get_cnt_hugetlb_fail()        l_stat.cnt_hugetlb_fail
+#define get_size_hugetlb()            l_stat.size_hugetlb
 
 #define inc_cnt_malloc()              l_stat.cnt_malloc++
 #define inc_cnt_free()                l_stat.cnt_free++
@@ -146,22 +196,30 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #define get_pcolor_new()              l_stat.pcolor_new
 #define get_pcolor_dup()              l_stat.pcolor_dup
 
-#define malloc_timer_start()    uint64_t _start_time = get_timestamp()
+#define lat_path(p)           l_lat_path = ((p) > l_lat_path) ? (p) : l_lat_path
+#define inc_lat(op,t)         l_tlh.stat->lat[op][lat_bucket(t)]++
+#define cas_stat(site,ok)     cas_count(l_tlh.stat, site, ok)
+
+#define malloc_timer_start()    l_lat_path = LAT_SMALL_FAST; \
+                                uint64_t _start_time = get_timestamp()
 #define malloc_timer_stop()     uint64_t _end_time = get_timestamp(); \
-                                inc_time_malloc(_end_time - _start_time)
-#define free_timer_start()      uint64_t _start_time = get_timestamp()
+                                inc_time_malloc(_end_time - _start_time); \
+                                inc_lat(LAT_MALLOC, _end_time - _start_time); \
+                                inc_lat(l_lat_path, _end_time - _start_time)
+#define free_timer_start()      l_lat_path = LAT_FREE_LOCAL; \
+                                uint64_t _start_time = get_timestamp()
 #define free_timer_stop()       uint64_t _end_time = get_timestamp(); \
-                                inc_time_free(_end_time - _start_time)
+                                inc_time_free(_end_time - _start_time); \
+                                inc_lat(LAT_FREE, _end_time - _start_time); \
+                                inc_lat(l_lat_path, _end_time - _start_time)
 #define realloc_timer_start()   uint64_t _start_time = get_timestamp()
 #define realloc_timer_stop()    uint64_t _end_time = get_timestamp(); \
-                                inc_time_realloc(_end_time - _start_time)
+                                inc_time_realloc(_end_time - _start_time); \
+                                inc_lat(LAT_REALLOC, _end_time - _start_time)
 #define memalign_timer_start()  uint64_t _start_time = get_timestamp()
 #define memalign_timer_stop()   uint64_t _end_time = get_timestamp(); \
-                                inc_time_memalign(_end_time - _start_time)
-
-#define getKB(s)    ((s) / 1024.0)
-#define getMB(s)    ((s) / 1024.0 / 1024.0)
-#define getGB(s)    ((s) / 1024.0 / 1024.0 / 1024.0)
+                                inc_time_memalign(_end_time - _start_time); \
+                                inc_lat(LAT_MEMALIGN, _end_time - _start_time)
 
 #else //MALLOC_STATS
 
@@ -172,6 +230,13 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #define inc_size_munmap(s)
 #define inc_size_madvise(s)
 #define update_size_mmap_max()
+#define inc_size_purge_pb(s)
+#define inc_size_purge_sp(s)
+#define inc_cnt_bg_wakeup()
+#define inc_cnt_orphan_free()
+#define inc_cnt_hugetlb()
+#define inc_cnt_hugetlb_fail()
+#define inc_size_hugetlb(s)
 
 #define get_cnt_mmap()
 #define get_cnt_munmap()
@@ -180,6 +245,13 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #define get_size_munmap()
 #define get_size_madvise()
 #define get_size_mmap_max()
+#define get_size_purge_pb()
+#define get_size_purge_sp()
+#define get_cnt_bg_wakeup()
+#define get_cnt_orphan_free()
+#define get_cnt_hugetlb()
+#define get_cnt_hugetlb_fail()
+#define get_size_hugetlb()
 
 #define inc_cnt_malloc()
 #define inc_cnt_free()
@@ -219,6 +291,9 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #define get_pcolor_new()
 #define get_pcolor_dup()
 
+#define lat_path(p)
+#define cas_stat(site,ok)     (ok)
+
 #define malloc_timer_start()
 #define malloc_timer_stop()
 #define free_timer_start()
@@ -231,5 +306,66 @@ static __thread thread_stat_t l_stat TLS_MODEL;
 #endif //MALLOC_STATS
 
 
+//-------------------------------------------------------------------
+// Heap Statistics (process-wide)
+//-------------------------------------------------------------------
+#ifdef MALLOC_USE_HEAP_STATS
+#define hstat_inc_malloc(cl)          l_tlh.stat->cnt_malloc[cl]++
+#define hstat_inc_free(cl)            l_tlh.stat->cnt_free[cl]++
+#define hstat_add_remote_free(n)      l_tlh.stat->cnt_remote_free += (n)
+#define hstat_inc_remote_retry(t)     (t)->stat->cnt_remote_retry++
+#define hstat_inbox_drain(t,n)        do { \
+    (t)->stat->cnt_inbox_drain++; \
+    (t)->stat->cnt_inbox_blk += (n); \
+    if ((n) > (t)->stat->inbox_max_depth) \
+      (t)->stat->inbox_max_depth = (n); \
+  } while (0)
+#define hstat_inc_sp_adopt(t)         (t)->stat->cnt_sp_adopt++
+#define hstat_add_free_pb(t,len)      (t)->stat->cnt_free_pb += (len)
+#define hstat_sub_free_pb(t,len)      (t)->stat->cnt_free_pb -= (len)
+#define hstat_clear_free_pb(t)        (t)->stat->cnt_free_pb = 0
+#define hstat_inc_pcache_malloc_hit()   l_tlh.stat->pcache_malloc_hit++
+#define hstat_inc_pcache_malloc_miss()  l_tlh.stat->pcache_malloc_miss++
+#define hstat_inc_pcache_free_hit()     l_tlh.stat->pcache_free_hit++
+#define hstat_inc_pcache_free_miss()    l_tlh.stat->pcache_free_miss++
+#define hstat_inc_pcpu_malloc_hit()     l_tlh.stat->pcpu_malloc_hit++
+#define hstat_inc_pcpu_malloc_miss()    l_tlh.stat->pcpu_malloc_miss++
+#define hstat_inc_pcpu_free_hit()       l_tlh.stat->pcpu_free_hit++
+#define hstat_inc_pcpu_free_miss()      l_tlh.stat->pcpu_free_miss++
+#define hstat_inc_heap_lock_wait()      l_tlh.stat->heap_lock_wait++
+#define hstat_inc_idle_flush()          l_tlh.stat->idle_flush++
+#define hstat_inc_tc_push()             l_tlh.stat->tc_push++
+#define hstat_inc_tc_pop()              l_tlh.stat->tc_pop++
+#define hstat_inc_pmap_cache_hit()      l_tlh.stat->pmap_cache_hit++
+#define hstat_inc_pmap_cache_miss()     l_tlh.stat->pmap_cache_miss++
+#define hstat_add_size_mapped(s)      atomic_add_int64(&g_size_mapped, (s))
+#else
+#define hstat_inc_malloc(cl)
+#define hstat_inc_free(cl)
+#define hstat_add_remote_free(n)
+#define hstat_inc_remote_retry(t)
+#define hstat_inbox_drain(t,n)
+#define hstat_inc_sp_adopt(t)
+#define hstat_add_free_pb(t,len)
+#define hstat_sub_free_pb(t,len)
+#define hstat_clear_free_pb(t)
+#define hstat_inc_pcache_malloc_hit()
+#define hstat_inc_pcache_malloc_miss()
+#define hstat_inc_pcache_free_hit()
+#define hstat_inc_pcache_free_miss()
+#define hstat_inc_pcpu_malloc_hit()
+#define hstat_inc_pcpu_malloc_miss()
+#define hstat_inc_pcpu_free_hit()
+#define hstat_inc_pcpu_free_miss()
+#define hstat_inc_heap_lock_wait()
+#define hstat_inc_idle_flush()
+#define hstat_inc_tc_push()
+#define hstat_inc_tc_pop()
+#define hstat_inc_pmap_cache_hit()
+#define hstat_inc_pmap_cache_miss()
+#define hstat_add_size_mapped(s)
+#endif //MALLOC_USE_HEAP_STATS
+
+
 #endif //__SF_MALLOC_STAT_H__
 
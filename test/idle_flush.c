@@ -0,0 +1,169 @@
+/*
+ * idle_flush.c - a thread flushed while idle allocates again.
+ *
+ * With MALLOC_USE_IDLE_FLUSH, another thread returns the blocks and pages
+ * cached by a thread that has not called malloc() or free() for
+ * opt.idle_flush_ms. The idle thread here fills its caches, keeps some
+ * blocks and waits. The flusher thread runs slow paths until the idle
+ * thread is flushed, and hands it blocks to free. The idle thread then
+ * checks the blocks it kept, frees them with the handed ones, and
+ * allocates and frees blocks of every kind again.
+ *
+ * Without MALLOC_USE_IDLE_FLUSH, or without membarrier(), nothing is
+ * flushed and only the second half is run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "sf_malloc.h"
+
+#define KEPT        64      // blocks kept by the idle thread per size
+#define HANDED      64      // blocks the flusher hands to the idle thread
+#define ROUNDS      2000    // allocations per size between the phases
+#define WAIT_MS     5000    // time to wait for the flush
+#define FLUSH_MS    20      // opt.idle_flush_ms
+
+static const size_t g_sizes[] = { 16, 64, 200, 1024, 4000, 40 << 10 };
+#define NUM_SIZES   (sizeof(g_sizes) / sizeof(g_sizes[0]))
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_cond  = PTHREAD_COND_INITIALIZER;
+static int   g_phase = 0;   // 1: idle thread waits, 2: it may resume
+static void* g_handed[HANDED];
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "idle_flush: %s\n", what);
+    exit(1);
+  }
+}
+
+static void set_phase(int phase) {
+  pthread_mutex_lock(&g_mutex);
+  g_phase = phase;
+  pthread_cond_broadcast(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static void wait_phase(int phase) {
+  pthread_mutex_lock(&g_mutex);
+  while (g_phase < phase) pthread_cond_wait(&g_cond, &g_mutex);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static uint64_t idle_flushes() {
+  sf_malloc_stats_t st;
+  sf_malloc_get_stats(&st);
+  return st.idle_flush;
+}
+
+/* Allocate and free ROUNDS blocks of each size, ending with cached blocks
+   of every kind. */
+static void churn(unsigned char fill) {
+  static __thread void* blocks[ROUNDS];
+  for (size_t s = 0; s < NUM_SIZES; s++) {
+    for (int i = 0; i < ROUNDS; i++) {
+      blocks[i] = malloc(g_sizes[s]);
+      check(blocks[i] != NULL, "malloc");
+      memset(blocks[i], fill, g_sizes[s]);
+    }
+    for (int i = 0; i < ROUNDS; i++) free(blocks[i]);
+  }
+}
+
+static void* idle_main(void* arg) {
+  void* kept[NUM_SIZES][KEPT];
+
+  churn(1);
+  for (size_t s = 0; s < NUM_SIZES; s++) {
+    for (int i = 0; i < KEPT; i++) {
+      kept[s][i] = malloc(g_sizes[s]);
+      memset(kept[s][i], (int)(s + i), g_sizes[s]);
+    }
+  }
+
+  // Wait without calling malloc() or free().
+  set_phase(1);
+  wait_phase(2);
+
+  for (size_t s = 0; s < NUM_SIZES; s++) {
+    for (int i = 0; i < KEPT; i++) {
+      unsigned char* p = (unsigned char*)kept[s][i];
+      check(p[0] == (unsigned char)(s + i) &&
+            p[g_sizes[s] - 1] == (unsigned char)(s + i),
+            "kept block was overwritten");
+    }
+  }
+  for (int i = 0; i < HANDED; i++) {
+    check(((unsigned char*)g_handed[i])[99] == 3, "handed block");
+    free(g_handed[i]);
+  }
+  churn(4);
+  for (size_t s = 0; s < NUM_SIZES; s++) {
+    for (int i = 0; i < KEPT; i++) free(kept[s][i]);
+  }
+  churn(5);
+  return NULL;
+}
+
+static void* flusher_main(void* arg) {
+  int flushed = (int)(long)arg;
+  uint64_t start = idle_flushes();
+
+  wait_phase(1);
+  for (int i = 0; i < HANDED; i++) {
+    g_handed[i] = malloc(100 + i * 16);
+    memset(g_handed[i], 3, 100 + i * 16);
+  }
+
+  // More large blocks than the page block cache holds take the slow paths
+  // that scan for idle threads.
+  for (int ms = 0; flushed && ms < WAIT_MS; ms += 5) {
+    void* large[32];
+    for (int i = 0; i < 32; i++) {
+      large[i] = malloc(64 << 10);
+      memset(large[i], 2, 64);
+    }
+    for (int i = 0; i < 32; i++) free(large[i]);
+    if (idle_flushes() > start) break;
+    usleep(5000);
+  }
+  check(!flushed || idle_flushes() > start,
+        "the idle thread was not flushed");
+
+  set_phase(2);
+  churn(6);
+  return NULL;
+}
+
+int main() {
+  // Flush idle threads soon, if they can be flushed at all.
+  uint32_t ms = FLUSH_MS;
+  int flushed = sf_mallctl("opt.idle_flush_ms", NULL, NULL, &ms, sizeof(ms));
+  check(flushed == 0 || flushed == ENOENT, "opt.idle_flush_ms");
+  flushed = (flushed == 0);
+#ifdef SYS_membarrier
+  // MEMBARRIER_CMD_QUERY lists MEMBARRIER_CMD_PRIVATE_EXPEDITED.
+  if (syscall(SYS_membarrier, 0, 0) <= 0 ||
+      !(syscall(SYS_membarrier, 0, 0) & (1 << 3))) {
+    flushed = 0;
+  }
+#else
+  flushed = 0;
+#endif
+
+  pthread_t idle, flusher;
+  check(pthread_create(&idle, NULL, idle_main, NULL) == 0, "pthread_create");
+  check(pthread_create(&flusher, NULL, flusher_main,
+                       (void*)(long)flushed) == 0, "pthread_create");
+  pthread_join(flusher, NULL);
+  pthread_join(idle, NULL);
+
+  printf("idle_flush ok (%s)\n", flushed ? "flushed" : "not flushed");
+  return 0;
+}
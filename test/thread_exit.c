@@ -0,0 +1,130 @@
+/*
+ * thread_exit.c - malloc() and free() after sf_malloc_thread_exit().
+ *
+ * glibc frees TLS blocks and runs other TLS destructors after the one of
+ * SFMalloc has cleared the TLH of an exiting thread, so the thread may still
+ * allocate and free. Each thread here does so from a destructor that sets
+ * its key again, so that the work is done in the second round, after the
+ * destructor of SFMalloc. It frees the blocks it allocated while running,
+ * allocates and frees blocks of every kind, and leaves some blocks for the
+ * main thread to free.
+ *
+ * Such calls share one heap, which sf_malloc_release_free_memory() releases
+ * too. Once the main thread has freed the blocks left to it, the memory
+ * mapped outside the free superpages must be back near where it started.
+ * With MALLOC_USE_BG_THREAD, free superpages may wait for the background
+ * thread before they are unmapped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sf_malloc.h"
+
+#define THREADS     64      // threads that exit
+#define BATCH       8       // threads running at the same time
+#define KEPT        16      // blocks kept per thread for the main thread
+#define MAX_GROWTH  (8UL << 20)
+
+static pthread_key_t g_key;
+static void* g_kept[THREADS][KEPT + 1];
+static volatile int g_done = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "thread_exit: %s\n", what);
+    exit(1);
+  }
+}
+
+static void after_exit(void* arg) {
+  void** mine = (void**)arg;
+  long t = (long)mine[0];
+
+  // Wait for the next round, when SFMalloc has cleared the TLH.
+  if (mine[3] == NULL) {
+    mine[3] = mine;
+    pthread_setspecific(g_key, mine);
+    return;
+  }
+
+  // Blocks allocated before the thread exited.
+  free(mine[1]);
+  free(mine[2]);
+  free(mine);
+
+  // Blocks of every kind, freed by this thread.
+  void* small = malloc(24);
+  void* large = calloc(1, 40 << 10);
+  void* page = NULL;
+  check(posix_memalign(&page, 4096, 3 << 12) == 0, "posix_memalign");
+  check(((size_t)page & 4095) == 0, "posix_memalign alignment");
+  check(((char*)large)[(40 << 10) - 1] == 0, "calloc");
+  small = realloc(small, 200);
+  memset(small, 1, 200);
+  memset(page, 2, 3 << 12);
+  free(small);
+  free(large);
+  free(page);
+
+  // Blocks freed by the main thread.
+  for (int i = 0; i < KEPT; i++) {
+    g_kept[t][i] = malloc(32 + i * 8);
+    memset(g_kept[t][i], (int)t, 32 + i * 8);
+  }
+  g_kept[t][KEPT] = malloc(64 << 10);
+  memset(g_kept[t][KEPT], (int)t, 64 << 10);
+
+  __sync_fetch_and_add(&g_done, 1);
+}
+
+static void* thread_main(void* arg) {
+  void** mine = (void**)malloc(4 * sizeof(void*));
+  mine[0] = arg;
+  mine[1] = malloc(48);
+  mine[2] = malloc(64 << 10);
+  mine[3] = NULL;
+  pthread_setspecific(g_key, mine);
+  return NULL;
+}
+
+int main() {
+  // Initialize SFMalloc before creating our key.
+  free(malloc(1));
+  check(pthread_key_create(&g_key, after_exit) == 0, "pthread_key_create");
+
+  sf_malloc_stats_t before, after;
+  sf_malloc_release_free_memory();
+  sf_malloc_get_stats(&before);
+
+  pthread_t th[BATCH];
+  for (long t = 0; t < THREADS; t += BATCH) {
+    for (long i = 0; i < BATCH; i++) {
+      check(pthread_create(&th[i], NULL, thread_main, (void*)(t + i)) == 0,
+            "pthread_create");
+    }
+    for (long i = 0; i < BATCH; i++) pthread_join(th[i], NULL);
+  }
+  check(g_done == THREADS, "destructors did not run");
+
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i <= KEPT; i++) {
+      check(((unsigned char*)g_kept[t][i])[31] == (unsigned char)t,
+            "block was overwritten");
+      free(g_kept[t][i]);
+    }
+  }
+
+  sf_malloc_release_free_memory();
+  sf_malloc_get_stats(&after);
+  printf("mapped %lu KB -> %lu KB (%lu KB free) after %d thread exits\n",
+         (unsigned long)(before.mapped >> 10),
+         (unsigned long)(after.mapped >> 10),
+         (unsigned long)(after.free_sp >> 10), THREADS);
+  check(after.mapped - after.free_sp <= before.mapped + MAX_GROWTH,
+        "the exit heap keeps memory after it was released");
+
+  printf("thread_exit ok\n");
+  return 0;
+}